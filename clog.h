@@ -1,21 +1,122 @@
 /*
  provide log interface
+
+ levels are trace, debug, info, warn and error. calls below CLOG_LEVEL
+ are removed at compile time (-DCLOG_LEVEL=CLOG_INFO for production
+ builds), the rest check the runtime level with one branch. the runtime
+ level starts at info, or at $CLOG_LEVEL (trace, debug, ...), and can be
+ changed with clog_set_level.
+
+ the *_rl variants take a rate (messages per second) and a burst and are
+ meant for per-packet and per-event call sites. each call site has its
+ own token bucket; what it holds back is counted and reported with the
+ next message that gets through.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include "clog_async.h"
 
 #ifndef CLOG_H
 #define CLOG_H
 
-#define linfo(...) do {\
-	printf("[INFO] "); \
-	printf(__VA_ARGS__); \
-	printf("\n"); \
+#define CLOG_TRACE 0
+#define CLOG_DEBUG 1
+#define CLOG_INFO  2
+#define CLOG_WARN  3
+#define CLOG_ERROR 4
+
+#ifndef CLOG_LEVEL
+#define CLOG_LEVEL CLOG_TRACE
+#endif
+
+static int clog_level = CLOG_INFO;
+
+static inline void clog_set_level(int level)
+{
+    clog_level = level;
+}
+
+__attribute__((constructor)) static inline void clog_level_from_env()
+{
+    static const char *names[] = { "trace", "debug", "info", "warn", "error" };
+    const char *env = getenv("CLOG_LEVEL");
+    int i;
+
+    for (i = 0; env != NULL && i <= CLOG_ERROR; i++)
+        if (strcasecmp(env, names[i]) == 0)
+            clog_level = i;
+}
+
+// the first half is a constant, so calls below CLOG_LEVEL compile to nothing
+#define clog_on(level) ((level) >= CLOG_LEVEL && (level) >= clog_level)
+
+#define llog(level, prefix, ...) do {\
+    if (clog_on(level)) \
+        clog_log(prefix, (level) == CLOG_ERROR, __VA_ARGS__); \
 } while(0)
 
-#define lerror(...) do {\
-	printf("[ERROR] "); \
-	printf(__VA_ARGS__); \
-	printf("\n"); \
+#define ltrace(...) llog(CLOG_TRACE, "[TRACE] ", __VA_ARGS__)
+#define ldebug(...) llog(CLOG_DEBUG, "[DEBUG] ", __VA_ARGS__)
+#define linfo(...)  llog(CLOG_INFO,  "[INFO]  ", __VA_ARGS__)
+#define lwarn(...)  llog(CLOG_WARN,  "[WARN]  ", __VA_ARGS__)
+#define lerror(...) llog(CLOG_ERROR, "[ERROR] ", __VA_ARGS__)
+
+#define lerror_exit(...) do {\
+    clog_log("[ERROR] ", 1, __VA_ARGS__); \
+    exit(-1); \
 } while(0)
 
-#endif
\ No newline at end of file
+/*
+ token bucket kept as the time the bucket is next empty (GCRA): a message
+ passes if that time is less than burst intervals ahead of now. one CAS
+ per message, shared by every thread hitting the call site.
+ */
+struct clog_bucket {
+    unsigned long long tat;        // ns
+    unsigned int suppressed;
+};
+
+static inline int clog_allow(struct clog_bucket *b, unsigned int rate, unsigned int burst,
+                             unsigned int *suppressed)
+{
+    struct timespec ts;
+    unsigned long long interval = 1000000000ULL / (rate ? rate : 1);
+    unsigned long long now, tat, next;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    tat = __atomic_load_n(&b->tat, __ATOMIC_RELAXED);
+    do {
+        if (tat > now && tat - now >= burst * interval)
+        {
+            __atomic_add_fetch(&b->suppressed, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        next = (tat > now ? tat : now) + interval;
+    } while (!__atomic_compare_exchange_n(&b->tat, &tat, next, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    *suppressed = __atomic_exchange_n(&b->suppressed, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+#define llog_rl(level, prefix, rate, burst, ...) do {\
+    static struct clog_bucket _clog_b; \
+    unsigned int _clog_n; \
+    if (clog_on(level) && clog_allow(&_clog_b, rate, burst, &_clog_n)) \
+    { \
+        if (_clog_n > 0) \
+            clog_log(prefix, 0, "%u similar messages suppressed", _clog_n); \
+        clog_log(prefix, (level) == CLOG_ERROR, __VA_ARGS__); \
+    } \
+} while(0)
+
+#define ltrace_rl(rate, burst, ...) llog_rl(CLOG_TRACE, "[TRACE] ", rate, burst, __VA_ARGS__)
+#define ldebug_rl(rate, burst, ...) llog_rl(CLOG_DEBUG, "[DEBUG] ", rate, burst, __VA_ARGS__)
+#define linfo_rl(rate, burst, ...)  llog_rl(CLOG_INFO,  "[INFO]  ", rate, burst, __VA_ARGS__)
+#define lwarn_rl(rate, burst, ...)  llog_rl(CLOG_WARN,  "[WARN]  ", rate, burst, __VA_ARGS__)
+#define lerror_rl(rate, burst, ...) llog_rl(CLOG_ERROR, "[ERROR] ", rate, burst, __VA_ARGS__)
+
+#endif
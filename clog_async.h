@@ -0,0 +1,590 @@
+/*
+ asynchronous log backend for clog.h
+
+ a log call only captures its arguments: the prefix and format pointers
+ and the raw argument values (strings are copied) go into a fixed size
+ slot of a lock-free multi-producer ring. one writer thread turns slots
+ into text and hands whole batches to writev, with the literal parts of
+ the format pointing straight at the format string. formatting and the
+ write syscall never run on the calling thread.
+
+ when the ring is full a message is dropped and counted (the writer
+ reports how many), unless it is an error or clog_set_policy(CLOG_BLOCK)
+ was called, then the caller waits for room. everything still queued is
+ written out at exit. build with -DCLOG_SYNC to print on the calling
+ thread instead.
+
+ formats are printf formats without %n and %m. the state is static, so
+ every program gets its own logger; link with -lpthread.
+ */
+#ifndef CLOG_ASYNC_H
+#define CLOG_ASYNC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CLOG_DROP  0 // drop info messages when the ring is full
+#define CLOG_BLOCK 1 // wait for room
+
+#define CLOG_SLOTS     4096 // power of 2
+#define CLOG_SLOT_DATA 480  // captured argument bytes per message
+#define CLOG_IOV_MAX   512
+#define CLOG_SCRATCH   (64 << 10)
+#define CLOG_CONV_MAX  1024 // longest text a single conversion may produce
+#define CLOG_COPY_MAX  64   // literal pieces up to this long are copied
+#define CLOG_IDLE_MS   100  // writer wakes up at least this often
+
+// argument types, as selected by the length modifier and the conversion
+enum {
+    CLOG_A_INT, CLOG_A_LONG, CLOG_A_LLONG, CLOG_A_SIZE, CLOG_A_INTMAX,
+    CLOG_A_PTRDIFF, CLOG_A_DOUBLE, CLOG_A_LDOUBLE, CLOG_A_PTR, CLOG_A_STR,
+    CLOG_A_NONE, // %% or something we cannot capture
+};
+
+struct clog_slot {
+    unsigned long seq;
+    const char *prefix;
+    const char *fmt;
+    unsigned short len;  // bytes used in data
+    unsigned char trunc; // ran out of room, the rest of fmt is cut
+    unsigned char data[CLOG_SLOT_DATA];
+} __attribute__((aligned(64)));
+
+static struct {
+    struct clog_slot *slots;
+    unsigned long head __attribute__((aligned(64))); // next slot for producers
+    unsigned long tail __attribute__((aligned(64))); // next slot for the writer
+    int sleeping;
+    int stop;
+    int sync;    // no writer thread, print on the caller
+    int policy;
+    unsigned long dropped;
+    pthread_t tid;
+} clog_ring;
+
+static pthread_once_t clog_once = PTHREAD_ONCE_INIT;
+
+static inline void clog_set_policy(int policy)
+{
+    clog_ring.policy = policy;
+}
+
+// parse the conversion after a '%', returns its length
+static inline int clog_conv(const char *p, int *tag, int *stars, int *prec)
+{
+    const char *s = p;
+    int mod = 0; // 1 l, 2 ll, 3 z, 4 j, 5 t, 6 L
+
+    *stars = 0;
+    *prec = -1;
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    if (*p == '*')
+        (*stars)++, p++;
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.')
+    {
+        p++;
+        *prec = 0;
+        if (*p == '*')
+            (*stars)++, p++, *prec = -2; // taken from the arguments
+        while (*p >= '0' && *p <= '9')
+            *prec = *prec * 10 + (*p++ - '0');
+    }
+    while (*p && strchr("hlLqjzt", *p))
+    {
+        switch (*p++)
+        {
+        case 'l': mod = mod == 1 ? 2 : 1; break;
+        case 'q': mod = 2; break;
+        case 'z': mod = 3; break;
+        case 'j': mod = 4; break;
+        case 't': mod = 5; break;
+        case 'L': mod = 6; break;
+        }
+    }
+
+    switch (*p)
+    {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+        *tag = mod == 1 ? CLOG_A_LONG : mod == 2 ? CLOG_A_LLONG : mod == 3 ? CLOG_A_SIZE :
+               mod == 4 ? CLOG_A_INTMAX : mod == 5 ? CLOG_A_PTRDIFF : CLOG_A_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        *tag = mod == 6 ? CLOG_A_LDOUBLE : CLOG_A_DOUBLE;
+        break;
+    case 'p':
+        *tag = CLOG_A_PTR;
+        break;
+    case 's':
+        *tag = CLOG_A_STR;
+        break;
+    default:
+        *tag = CLOG_A_NONE;
+        return *p ? p - s + 1 : p - s;
+    }
+    return p - s + 1;
+}
+
+static inline void clog_vprint(const char *prefix, const char *fmt, va_list ap)
+{
+    flockfile(stdout);
+    fputs(prefix, stdout);
+    vprintf(fmt, ap);
+    putchar('\n');
+    funlockfile(stdout);
+}
+
+static inline void clog_futex(int *addr, int op, int val, const struct timespec *ts)
+{
+    syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, val, ts, NULL, 0);
+}
+
+static inline void clog_wake()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&clog_ring.sleeping, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&clog_ring.sleeping, 0, __ATOMIC_RELAXED);
+        clog_futex(&clog_ring.sleeping, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+// write the whole batch, writev may stop short on pipes
+static inline void clog_writev(struct iovec *iov, int cnt)
+{
+    while (cnt > 0)
+    {
+        ssize_t n = writev(STDOUT_FILENO, iov, cnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++, cnt--;
+        }
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+struct clog_batch {
+    struct iovec iov[CLOG_IOV_MAX];
+    int cnt;
+    char scratch[CLOG_SCRATCH];
+    size_t used;
+};
+
+static inline void clog_flush(struct clog_batch *b)
+{
+    clog_writev(b->iov, b->cnt);
+    b->cnt = 0;
+    b->used = 0;
+}
+
+// make room for n bytes of text in the scratch area
+static inline char *clog_reserve(struct clog_batch *b, size_t n)
+{
+    if (CLOG_SCRATCH - b->used < n || b->cnt == CLOG_IOV_MAX)
+        clog_flush(b);
+    return b->scratch + b->used;
+}
+
+// queue n bytes written at clog_reserve, joined to the last piece when adjacent
+static inline void clog_commit(struct clog_batch *b, size_t n)
+{
+    char *p = b->scratch + b->used;
+
+    if (n == 0)
+        return;
+    b->used += n;
+    if (b->cnt > 0 && (char *)b->iov[b->cnt - 1].iov_base + b->iov[b->cnt - 1].iov_len == p)
+    {
+        b->iov[b->cnt - 1].iov_len += n;
+        return;
+    }
+    b->iov[b->cnt].iov_base = p;
+    b->iov[b->cnt++].iov_len = n;
+}
+
+// short pieces are copied, long ones go out from where they are
+static inline void clog_put(struct clog_batch *b, const void *p, size_t len)
+{
+    if (len == 0)
+        return;
+    if (len <= CLOG_COPY_MAX)
+    {
+        memcpy(clog_reserve(b, len), p, len);
+        clog_commit(b, len);
+        return;
+    }
+    if (b->cnt == CLOG_IOV_MAX)
+        clog_flush(b);
+    b->iov[b->cnt].iov_base = (void *)p;
+    b->iov[b->cnt++].iov_len = len;
+}
+
+// print one conversion into the scratch area
+static inline void clog_emit(struct clog_batch *b, const char *conv, int convlen,
+                      int tag, int stars, int *st, const unsigned char *v)
+{
+    char spec[64];
+    char *out;
+    size_t room = CLOG_CONV_MAX;
+    int n = 0;
+
+    if (convlen + 2 > (int)sizeof(spec))
+        return;
+    spec[0] = '%';
+    memcpy(spec + 1, conv, convlen);
+    spec[convlen + 1] = '\0';
+
+    out = clog_reserve(b, room);
+
+#define CLOG_EMIT(type) do { \
+    type x; \
+    memcpy(&x, v, sizeof(x)); \
+    n = stars == 0 ? snprintf(out, room, spec, x) : \
+        stars == 1 ? snprintf(out, room, spec, st[0], x) : \
+                     snprintf(out, room, spec, st[0], st[1], x); \
+} while (0)
+
+    switch (tag)
+    {
+    case CLOG_A_INT:     CLOG_EMIT(int); break;
+    case CLOG_A_LONG:    CLOG_EMIT(long); break;
+    case CLOG_A_LLONG:   CLOG_EMIT(long long); break;
+    case CLOG_A_SIZE:    CLOG_EMIT(size_t); break;
+    case CLOG_A_INTMAX:  CLOG_EMIT(intmax_t); break;
+    case CLOG_A_PTRDIFF: CLOG_EMIT(ptrdiff_t); break;
+    case CLOG_A_DOUBLE:  CLOG_EMIT(double); break;
+    case CLOG_A_LDOUBLE: CLOG_EMIT(long double); break;
+    case CLOG_A_PTR:     CLOG_EMIT(void *); break;
+    case CLOG_A_STR:
+    {
+        const char *x = (const char *)v;
+        n = stars == 0 ? snprintf(out, room, spec, x) :
+            stars == 1 ? snprintf(out, room, spec, st[0], x) :
+                         snprintf(out, room, spec, st[0], st[1], x);
+        break;
+    }
+    }
+#undef CLOG_EMIT
+
+    if (n < 0)
+        return;
+    if ((size_t)n >= room)
+        n = room - 1;
+    clog_commit(b, n);
+}
+
+static inline size_t clog_arg_size(int tag, const unsigned char *v)
+{
+    switch (tag)
+    {
+    case CLOG_A_INT:     return sizeof(int);
+    case CLOG_A_LONG:    return sizeof(long);
+    case CLOG_A_LLONG:   return sizeof(long long);
+    case CLOG_A_SIZE:    return sizeof(size_t);
+    case CLOG_A_INTMAX:  return sizeof(intmax_t);
+    case CLOG_A_PTRDIFF: return sizeof(ptrdiff_t);
+    case CLOG_A_DOUBLE:  return sizeof(double);
+    case CLOG_A_LDOUBLE: return sizeof(long double);
+    case CLOG_A_PTR:     return sizeof(void *);
+    case CLOG_A_STR:     return strlen((const char *)v) + 1;
+    }
+    return 0;
+}
+
+// turn one captured message back into text
+static inline void clog_format(struct clog_batch *b, struct clog_slot *s)
+{
+    const char *p = s->fmt, *lit = p;
+    const unsigned char *v = s->data, *end = s->data + s->len;
+
+    clog_put(b, s->prefix, strlen(s->prefix));
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        int tag, stars, prec, st[2], i;
+        int len = clog_conv(p + 1, &tag, &stars, &prec);
+
+        if (tag == CLOG_A_NONE)
+        {
+            // "%%" prints one '%', anything else is kept as it is
+            clog_put(b, lit, p - lit + (p[1] == '%' ? 1 : 1 + len));
+            p += 1 + len;
+            lit = p;
+            continue;
+        }
+        clog_put(b, lit, p - lit);
+        for (i = 0; i < stars; i++)
+        {
+            if (v + sizeof(int) > end)
+                goto cut;
+            memcpy(&st[i], v, sizeof(int));
+            v += sizeof(int);
+        }
+        if (v >= end || v + clog_arg_size(tag, v) > end)
+            goto cut;
+        clog_emit(b, p + 1, len, tag, stars, st, v);
+        v += clog_arg_size(tag, v);
+        p += 1 + len;
+        lit = p;
+    }
+    clog_put(b, lit, strlen(lit));
+    clog_put(b, "\n", 1);
+    return;
+
+cut:
+    clog_put(b, s->trunc ? "...\n" : "\n", s->trunc ? 4 : 1);
+}
+
+static inline void *clog_writer(void *arg)
+{
+    struct clog_batch *b = arg;
+    unsigned long reported = 0;
+    sigset_t all;
+
+    // signals are for the program, not for the logger
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    while (1)
+    {
+        unsigned long tail = clog_ring.tail;
+        struct clog_slot *s = &clog_ring.slots[tail & (CLOG_SLOTS - 1)];
+
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == tail + 1)
+        {
+            clog_format(b, s);
+            __atomic_store_n(&s->seq, tail + CLOG_SLOTS, __ATOMIC_RELEASE);
+            clog_ring.tail = tail + 1;
+            continue;
+        }
+
+        // ring is empty, write out what we have before waiting
+        unsigned long dropped = __atomic_load_n(&clog_ring.dropped, __ATOMIC_RELAXED);
+        if (dropped != reported)
+        {
+            char *out = clog_reserve(b, CLOG_CONV_MAX);
+            int n = snprintf(out, CLOG_CONV_MAX, "[WARN]  log ring full, dropped %lu messages\n",
+                             dropped - reported);
+            if (n > 0)
+                clog_commit(b, n);
+            reported = dropped;
+        }
+        if (b->cnt > 0)
+            clog_flush(b);
+        if (__atomic_load_n(&clog_ring.stop, __ATOMIC_ACQUIRE))
+            break;
+
+        struct timespec ts = { 0, CLOG_IDLE_MS * 1000000L };
+        __atomic_store_n(&clog_ring.sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1 &&
+            !__atomic_load_n(&clog_ring.stop, __ATOMIC_ACQUIRE))
+            clog_futex(&clog_ring.sleeping, FUTEX_WAIT, 1, &ts);
+        __atomic_store_n(&clog_ring.sleeping, 0, __ATOMIC_RELAXED);
+    }
+    free(b);
+    return NULL;
+}
+
+static inline void clog_stop()
+{
+    if (clog_ring.sync)
+        return;
+    __atomic_store_n(&clog_ring.stop, 1, __ATOMIC_RELEASE);
+    clog_wake();
+    pthread_join(clog_ring.tid, NULL);
+    clog_ring.sync = 1;
+}
+
+// a forked child has no writer thread
+static inline void clog_atfork_child()
+{
+    clog_ring.sync = 1;
+}
+
+static inline void clog_start()
+{
+    unsigned long i;
+    struct clog_batch *b = malloc(sizeof(struct clog_batch));
+
+    clog_ring.slots = aligned_alloc(64, CLOG_SLOTS * sizeof(struct clog_slot));
+    if (b == NULL || clog_ring.slots == NULL)
+        goto fail;
+    for (i = 0; i < CLOG_SLOTS; i++)
+        clog_ring.slots[i].seq = i;
+    b->cnt = 0;
+    b->used = 0;
+    if (pthread_create(&clog_ring.tid, NULL, clog_writer, b) != 0)
+        goto fail;
+    pthread_atfork(NULL, NULL, clog_atfork_child);
+    atexit(clog_stop);
+    return;
+
+fail:
+    free(b);
+    free(clog_ring.slots);
+    clog_ring.sync = 1;
+}
+
+static inline struct clog_slot *clog_claim(int block)
+{
+    unsigned long pos = __atomic_load_n(&clog_ring.head, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        struct clog_slot *s = &clog_ring.slots[pos & (CLOG_SLOTS - 1)];
+        long dif = (long)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&clog_ring.head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return s;
+            continue;
+        }
+        if (dif < 0)
+        {
+            if (!block)
+                return NULL;
+            clog_wake();
+            sched_yield();
+        }
+        pos = __atomic_load_n(&clog_ring.head, __ATOMIC_RELAXED);
+    }
+}
+
+// copy the arguments fmt asks for into the slot
+static inline void clog_capture(struct clog_slot *s, const char *fmt, va_list ap)
+{
+    unsigned char *v = s->data, *end = s->data + CLOG_SLOT_DATA;
+    const char *p = fmt;
+
+    s->trunc = 0;
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        int tag, stars, prec, i;
+        p += 1 + clog_conv(p + 1, &tag, &stars, &prec);
+        if (tag == CLOG_A_NONE)
+            continue;
+
+        for (i = 0; i < stars; i++)
+        {
+            int x = va_arg(ap, int);
+            if (prec == -2 && i == stars - 1)
+                prec = x < 0 ? -1 : x;
+            if (v + sizeof(x) > end)
+                goto full;
+            memcpy(v, &x, sizeof(x));
+            v += sizeof(x);
+        }
+
+#define CLOG_CAPTURE(type, promoted) do { \
+    type x = (type)va_arg(ap, promoted); \
+    if (v + sizeof(x) > end) \
+        goto full; \
+    memcpy(v, &x, sizeof(x)); \
+    v += sizeof(x); \
+} while (0)
+
+        switch (tag)
+        {
+        case CLOG_A_INT:     CLOG_CAPTURE(int, int); break;
+        case CLOG_A_LONG:    CLOG_CAPTURE(long, long); break;
+        case CLOG_A_LLONG:   CLOG_CAPTURE(long long, long long); break;
+        case CLOG_A_SIZE:    CLOG_CAPTURE(size_t, size_t); break;
+        case CLOG_A_INTMAX:  CLOG_CAPTURE(intmax_t, intmax_t); break;
+        case CLOG_A_PTRDIFF: CLOG_CAPTURE(ptrdiff_t, ptrdiff_t); break;
+        case CLOG_A_DOUBLE:  CLOG_CAPTURE(double, double); break;
+        case CLOG_A_LDOUBLE: CLOG_CAPTURE(long double, long double); break;
+        case CLOG_A_PTR:     CLOG_CAPTURE(void *, void *); break;
+        case CLOG_A_STR:
+        {
+            const char *x = va_arg(ap, const char *);
+            size_t n;
+            if (x == NULL)
+                x = "(null)";
+            n = prec >= 0 ? strnlen(x, prec) : strlen(x);
+            if (v >= end)
+                goto full;
+            if (n > (size_t)(end - v) - 1)
+            {
+                n = end - v - 1; // keep the head of a long string
+                s->trunc = 1;
+            }
+            memcpy(v, x, n);
+            v[n] = '\0';
+            v += n + 1;
+            break;
+        }
+        }
+#undef CLOG_CAPTURE
+    }
+    s->len = v - s->data;
+    return;
+
+full:
+    s->trunc = 1;
+    s->len = v - s->data;
+}
+
+static inline void clog_log(const char *prefix, int must, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static inline void clog_log(const char *prefix, int must, const char *fmt, ...)
+{
+    struct clog_slot *s;
+    va_list ap;
+
+    va_start(ap, fmt);
+#ifndef CLOG_SYNC
+    pthread_once(&clog_once, clog_start);
+    if (!clog_ring.sync)
+    {
+        s = clog_claim(must || clog_ring.policy == CLOG_BLOCK);
+        if (s == NULL)
+        {
+            __atomic_add_fetch(&clog_ring.dropped, 1, __ATOMIC_RELAXED);
+            va_end(ap);
+            return;
+        }
+        s->prefix = prefix;
+        s->fmt = fmt;
+        clog_capture(s, fmt, ap);
+        __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+        clog_wake();
+        va_end(ap);
+        return;
+    }
+#else
+    (void)s, (void)clog_once;
+#endif
+    clog_vprint(prefix, fmt, ap);
+    va_end(ap);
+}
+
+#endif
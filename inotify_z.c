@@ -5,24 +5,60 @@
  *    desc:      test the function of inotify in Linux
  */
 
+#define _GNU_SOURCE // O_DIRECTORY
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <assert.h> // assert
 #include <errno.h>  // errno
 #include <string.h> // strerror
 #include <stdlib.h> // exit
+#include <fcntl.h>
+#include <dirent.h> // DT_DIR
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 #include <getopt.h>
+#include <dlfcn.h>
+#include <fnmatch.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include "clog.h"
+#include "metrics.h"
+#include "spsc.h"
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
-#define BUFFER_SIZE ((EVENT_SIZE + 16) * 16)
-#define EVENT_TYPE_SIZE 10
-#define EVENT_NAME_SIZE 20
+#define BUFFER_SIZE (256 * 1024) // default read size, a few thousand events
+#define EVENT_NAMES_SIZE 256 // every flag of one mask joined with '|'
 
 #define EXIT_FLAG "exit_flag"
 
+#define PATH_SIZE 4096
+#define DIRENT_BUF_SIZE (64 * 1024) // getdents64 buffer, one per walk thread
+#define MAX_WALK_THREADS 32
+#define COALESCE_MAX 16384  // distinct paths held back at once
+#define MOVE_MAX 64         // IN_MOVED_FROM waiting for its IN_MOVED_TO
+#define MOVE_WAIT_NS 10000000ULL // after this, an IN_MOVED_FROM moved out of the tree
+#define PATH_CACHE_MAX 4096 // directory handles with a resolved path
+#define DISPATCH_RING 1024  // events queued per dispatch worker
+#define DISPATCH_WORKERS 4
+#define MAX_DISPATCH_WORKERS 64
+#define PLUGIN_SYMBOL "inotify_z_event"
+
 static int exit_flag = 0;
 
+static struct metric *m_events;
+static struct metric *m_overflows;
+static struct metric *m_batch;
+static struct metric *m_watches;
+static struct metric *m_coalesced;
+static struct metric *m_resyncs;
+static struct metric *m_dispatched;
+static struct metric *m_dispatch_dropped;
+static struct metric *m_action_errors;
+
 /*
    struct inotify_event {
        int      wd;     // Watch descriptor
@@ -59,35 +95,36 @@ static int exit_flag = 0;
    IN_ONLYDIR        Only watch pathname if it is a directory. (since Linux 2.6.15)
  */
 
-struct event_map_s
-{
-    int  mask;
-    char name[EVENT_NAME_SIZE];
-};
+// flag names by bit number, a mask is decoded one set bit at a time
+typedef struct {
+    const char *name;
+    unsigned int len;
+} event_bit_t;
+
+#define EVENT_BIT(m) [__builtin_ctz(m)] = { #m, sizeof(#m) - 1 }
 
-struct event_map_s event_map[] =
-{
-    {IN_ACCESS, "IN_ACCESS"},
-    {IN_MODIFY, "IN_MODIFY"},
-    {IN_ATTRIB, "IN_ATTRIB"},
-    {IN_CLOSE_WRITE, "IN_CLOSE_WRITE"},
-    {IN_CLOSE_NOWRITE, "IN_CLOSE_NOWRITE"},
-    {IN_CLOSE, "IN_CLOSE"},
-    {IN_OPEN, "IN_OPEN"},
-    {IN_MOVED_FROM, "IN_MOVED_FROM"},
-    {IN_MOVED_TO, "IN_MOVED_TO"},
-    {IN_MOVE, "IN_MOVE"},
-    {IN_CREATE, "IN_CREATE"},
-    {IN_DELETE, "IN_DELETE"},
-    {IN_DELETE_SELF, "IN_DELETE_SELF"},
-    {IN_MOVE_SELF, "IN_MOVE_SELF"},
-    {IN_DONT_FOLLOW, "IN_DONT_FOLLOW"},
-    {IN_EXCL_UNLINK, "IN_EXCL_UNLINK"},
-    {IN_ONESHOT, "IN_ONESHOT"},
-    {IN_MASK_ADD, "IN_MASK_ADD"},
-    {IN_ONLYDIR, "IN_ONLYDIR"},
-    //{IN_ALL_EVENTS, "IN_ALL_EVENTS"},
-    {0, NULL}
+static const event_bit_t event_bits[32] =
+{
+    EVENT_BIT(IN_ACCESS),
+    EVENT_BIT(IN_MODIFY),
+    EVENT_BIT(IN_ATTRIB),
+    EVENT_BIT(IN_CLOSE_WRITE),
+    EVENT_BIT(IN_CLOSE_NOWRITE),
+    EVENT_BIT(IN_OPEN),
+    EVENT_BIT(IN_MOVED_FROM),
+    EVENT_BIT(IN_MOVED_TO),
+    EVENT_BIT(IN_CREATE),
+    EVENT_BIT(IN_DELETE),
+    EVENT_BIT(IN_DELETE_SELF),
+    EVENT_BIT(IN_MOVE_SELF),
+    EVENT_BIT(IN_UNMOUNT),
+    EVENT_BIT(IN_Q_OVERFLOW),
+    EVENT_BIT(IN_IGNORED),
+    EVENT_BIT(IN_ONLYDIR),
+    EVENT_BIT(IN_DONT_FOLLOW),
+    EVENT_BIT(IN_EXCL_UNLINK),
+    EVENT_BIT(IN_MASK_ADD),
+    EVENT_BIT(IN_ONESHOT),
 };
 
 struct inotify_mask_s
@@ -119,6 +156,19 @@ struct option long_options[] =
     {"create", 0, NULL, 'c'},
     {"delete", 0, NULL, 'd'},
     {"modify", 0, NULL, 'm'},
+    {"metrics", 1, NULL, 'M'},
+    {"recursive", 0, NULL, 'r'},
+    {"threads", 1, NULL, 'j'},
+    {"move", 0, NULL, 'v'},
+    {"buffer", 1, NULL, 'b'},
+    {"window", 1, NULL, 'w'},
+    {"fanotify", 0, NULL, 'F'},
+    {"close-write", 0, NULL, 'C'},
+    {"exec", 1, NULL, 'e'},
+    {"journal", 1, NULL, 'o'},
+    {"plugin", 1, NULL, 'P'},
+    {"workers", 1, NULL, 'n'},
+    {"match", 1, NULL, 'g'},
     {NULL, 0, NULL, 0}
 };
 
@@ -127,185 +177,1959 @@ typedef struct inotify_event inotify_event_t;
 typedef struct {
     int mask;
     char *path;
+    char *metrics; // export metrics to this file or unix:/path
+    int recursive;
+    int threads;   // for the first walk of the tree
+    int buffer;    // bytes per read
+    int window;    // ms to merge repeated events on one path, 0 to log each
+    int fanotify;  // one fanotify mark on the filesystem instead of inotify watches
+    char *exec;    // actions for every logged event, see dispatch below
+    char *journal;
+    char *plugin;
+    char *match;   // only dispatch names matching this glob
+    int workers;
 } inotify_opt_t;
 
+/*
+   recursive watches
+
+   every watched directory is a node that keeps its own name and the index
+   of its parent, not the whole path, so a few hundred thousand directories
+   cost a few tens of bytes each and a renamed directory is one name to
+   change. paths are put together from the parents when an event needs
+   one. a hash from wd to node finds the directory of an event, and each
+   node links its children, so a rename or a move out finds the directory
+   among its siblings and drops its subtree without a scan of the tree.
+
+   the first walk runs on several threads that take directories from a
+   shared queue and open, watch and read them on their own. a directory
+   is watched before it is read, so what is created while it is read shows
+   up as an event, in the listing or both, never in neither. directories
+   created later are walked the same way on the event loop, and whatever
+   is found in them is reported as created.
+ */
+typedef struct {
+    int wd;      // -1 until watched, or when the node is free
+    int parent;  // node index, -1 for the root
+    int child;   // first child, -1 for none
+    int next;    // siblings, -1 at the ends
+    int prev;
+    char *name;  // the root has the whole --path
+} watch_node_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    watch_node_t *nodes;
+    int nnodes;
+    int cap;
+    int free_node;      // free nodes are chained through parent
+    int *slots;         // wd -> node index, -1 for empty
+    unsigned int mask;  // slots - 1
+    unsigned int count;
+
+    // the walk
+    pthread_cond_t cond;
+    int *queue;         // node indexes still to be read
+    int qhead;
+    int qtail;
+    int qcap;
+    int busy;           // threads reading a directory
+    int report;         // log what the walk finds, for directories created later
+
+    int ifd;
+    uint32_t watch_mask;
+    unsigned long errors;
+} watch_tree_t;
+
+/*
+   coalescing
+
+   with --window, an event is held back and later events on the same path
+   (wd and name) only add their mask and a count to it. it is logged once
+   the window since the first one has passed, so a thousand IN_MODIFY on
+   one file make one line. held events sit in a ring in arrival order,
+   which is also the order they are due in, with a hash on the path.
+ */
+typedef struct {
+    int wd;
+    uint32_t mask;
+    uint32_t count;     // 0 once it has been logged out of turn
+    uint64_t first;     // ns
+    char name[NAME_MAX + 1];
+} pending_event_t;
+
+typedef struct {
+    pending_event_t *ring;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int *slots; // ring position + 1, 0 for empty
+    uint64_t window;     // ns
+} coalesce_t;
+
+// IN_MOVED_FROM and IN_MOVED_TO of one rename share a cookie
 typedef struct {
-    char type[EVENT_TYPE_SIZE];
-    char name[EVENT_NAME_SIZE];
-} event_name_t;
+    uint32_t cookie;
+    uint32_t mask;
+    int wd;
+    uint64_t time;
+    char name[NAME_MAX + 1];
+} pending_move_t;
 
-static const char *optstring = "p:cdm";
+static coalesce_t coalesce_s;
+static pending_move_t moves_s[MOVE_MAX];
+static int nmoves = 0;
 
-static event_name_t* event_name(inotify_event_t *ev)
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static const char *optstring = "p:cdmM:rj:vb:w:FCe:o:P:n:g:";
+
+static const char *event_type(uint32_t mask)
+{
+    return (mask & IN_ISDIR) ? "directory" : "file";
+}
+
+// every flag set in mask, e.g. "IN_MODIFY|IN_CLOSE_WRITE", written to buf
+static const char *event_name(uint32_t mask, char *buf, size_t size)
 {
-    assert(ev);
+    size_t len = 0;
+
+    mask &= ~IN_ISDIR;
+    while (mask)
+    {
+        const event_bit_t *bit = &event_bits[__builtin_ctz(mask)];
+        mask &= mask - 1;
+        if (bit->name == NULL || len + bit->len + 2 > size)
+        {
+            continue;
+        }
+        if (len > 0)
+        {
+            buf[len++] = '|';
+        }
+        memcpy(buf + len, bit->name, bit->len);
+        len += bit->len;
+    }
+    if (len == 0)
+    {
+        return "UNKNOWN";
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+/*
+   dispatch
+
+   with --exec, --journal or --plugin every logged event is also handed
+   to a pool of worker threads that run the actions, so a slow command
+   never holds up the read loop long enough for the kernel queue to
+   overflow. each worker has its own single-producer single-consumer ring
+   (spsc.h) filled by the read loop, and a path always hashes to the same
+   worker, so the actions for one path run in the order its events came.
+   when a worker's ring is full the event is dropped and counted, the read
+   loop never waits.
+
+   --exec runs the command with /bin/sh -c, the path in $1 and the event
+   names in $2, and waits for it. --journal appends one line per event,
+   "<unix time> <events> <file|directory> <count> <path>", with a single
+   write. --plugin loads lib.so[:symbol] and calls
+   int symbol(const char *path, uint32_t mask, uint32_t count),
+   inotify_z_event by default, from the workers at once.
+ */
+typedef struct {
+    uint32_t mask;
+    uint32_t count;
+    uint64_t time;      // realtime ns, when it was read
+    char path[PATH_SIZE];
+} dispatch_event_t;
+
+typedef struct {
+    pthread_t tid;
+    dispatch_event_t *ring;
+    struct spsc q;      // head is filled by the read loop, tail run by the worker
+} dispatch_worker_t;
+
+typedef int (*dispatch_plugin_t)(const char *path, uint32_t mask, uint32_t count);
+
+typedef struct {
+    dispatch_worker_t *workers;
+    int nworkers;       // 0 when there is nothing to dispatch
+    uint32_t mask;
+    const char *match;
+    const char *exec;
+    int journal_fd;
+    dispatch_plugin_t plugin;
+} dispatch_t;
 
-    static event_name_t event_name;
+static dispatch_t dispatch_s;
 
-    int mask = ev->mask;
+extern char **environ;
 
-    // get the type, directory or file
-    if (mask & IN_ISDIR)
+static void dispatch_exec(dispatch_t *d, const dispatch_event_t *e, const char *names)
+{
+    char *argv[] = { "sh", "-c", (char *)d->exec, "inotify_z", (char *)e->path, (char *)names, NULL };
+    pid_t pid;
+    int ret, status;
+
+    ret = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ);
+    if (ret != 0)
     {
-        strcpy(event_name.type, "directory");
+        mt_add(m_action_errors, 1);
+        lerror_rl(1, 1, "spawn %s: %s", d->exec, strerror(ret));
+        return;
     }
-    else
+    while ((ret = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+    {
+    }
+    if (ret == -1)
+    {
+        mt_add(m_action_errors, 1);
+        lerror_rl(1, 1, "wait for %s: %s", d->exec, strerror(errno));
+        return;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        mt_add(m_action_errors, 1);
+        lwarn_rl(1, 1, "exec for %s: exit status %d", e->path,
+                 WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+}
+
+static void dispatch_journal(dispatch_t *d, const dispatch_event_t *e, const char *names)
+{
+    char line[PATH_SIZE + EVENT_NAMES_SIZE + 64];
+    int n = snprintf(line, sizeof(line), "%llu.%03llu %s %s %u %s\n",
+                     (unsigned long long)(e->time / 1000000000ULL),
+                     (unsigned long long)(e->time % 1000000000ULL / 1000000),
+                     names, event_type(e->mask), e->count, e->path);
+
+    // O_APPEND and one write per line, so lines from the workers never mix
+    if (n >= (int)sizeof(line) || write(d->journal_fd, line, n) != n)
+    {
+        mt_add(m_action_errors, 1);
+        lerror_rl(1, 1, "journal write: %s", strerror(errno));
+    }
+}
+
+static void dispatch_run(dispatch_t *d, const dispatch_event_t *e)
+{
+    char names[EVENT_NAMES_SIZE];
+    const char *n = event_name(e->mask, names, sizeof(names));
+
+    if (d->journal_fd != -1)
+    {
+        dispatch_journal(d, e, n);
+    }
+    if (d->plugin != NULL && d->plugin(e->path, e->mask, e->count) != 0)
+    {
+        mt_add(m_action_errors, 1);
+    }
+    if (d->exec != NULL)
+    {
+        dispatch_exec(d, e, n);
+    }
+}
+
+static void *dispatch_worker(void *arg)
+{
+    dispatch_worker_t *w = arg;
+
+    while (spsc_wait(&w->q))
+    {
+        dispatch_run(&dispatch_s, &w->ring[w->q.tail % DISPATCH_RING]);
+        spsc_pop(&w->q);
+    }
+    return NULL;
+}
+
+// queue an event for the workers, from the read loop only
+static void dispatch_event(uint32_t mask, const char *dir, const char *name, uint32_t count)
+{
+    dispatch_t *d = &dispatch_s;
+    dispatch_worker_t *w;
+    dispatch_event_t *e;
+    uint32_t h = 2166136261u;
+    const char *c;
+    struct timespec ts;
+
+    if (d->nworkers == 0 || !(mask & d->mask) || strcmp(dir, "?") == 0 ||
+        (d->match != NULL && fnmatch(d->match, name, 0) != 0))
+    {
+        return;
+    }
+    for (c = dir; *c; c++)
+    {
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+    for (c = name; *c; c++)
+    {
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+    w = &d->workers[h % d->nworkers];
+    if (spsc_room(&w->q, DISPATCH_RING) == 0)
+    {
+        mt_add(m_dispatch_dropped, 1);
+        lwarn_rl(1, 1, "dispatch queue full, dropped %s/%s; more --workers or a faster action", dir, name);
+        return;
+    }
+    e = &w->ring[w->q.head % DISPATCH_RING];
+    if (snprintf(e->path, sizeof(e->path), "%s/%s", dir, name) >= (int)sizeof(e->path))
     {
-        strcpy(event_name.type, "file");
+        lerror_rl(10, 10, "path too long to dispatch: %s/%s", dir, name);
+        return;
     }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->mask = mask;
+    e->count = count;
+    spsc_push(&w->q);
+    mt_add(m_dispatched, 1);
+}
 
-    // get the event name
-    struct event_map_s *map = event_map;
-    while (map->mask)
+static int dispatch_start(inotify_opt_t *opt)
+{
+    dispatch_t *d = &dispatch_s;
+    int i, ret;
+
+    d->journal_fd = -1;
+    if (opt->exec == NULL && opt->journal == NULL && opt->plugin == NULL)
+    {
+        return 0;
+    }
+    d->mask = opt->mask;
+    d->match = opt->match;
+    d->exec = opt->exec;
+    if (opt->journal != NULL)
+    {
+        d->journal_fd = open(opt->journal, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (d->journal_fd == -1)
+        {
+            lerror("open %s: %s", opt->journal, strerror(errno));
+            return -1;
+        }
+    }
+    if (opt->plugin != NULL)
     {
-        if (mask & map->mask)
+        char *symbol = strrchr(opt->plugin, ':');
+        void *lib;
+
+        if (symbol != NULL)
+        {
+            *symbol++ = '\0';
+        }
+        lib = dlopen(opt->plugin, RTLD_NOW | RTLD_LOCAL);
+        if (lib == NULL)
+        {
+            lerror("dlopen: %s", dlerror());
+            return -1;
+        }
+        d->plugin = (dispatch_plugin_t)dlsym(lib, symbol != NULL ? symbol : PLUGIN_SYMBOL);
+        if (d->plugin == NULL)
         {
-            strcpy(event_name.name, map->name);
-            return &event_name;
+            lerror("dlsym: %s", dlerror());
+            return -1;
         }
-        map += 1;
     }
-    
-    // No match in event_map
-    strcpy(event_name.name, "UNKNOWN");
 
-    return &event_name;
+    d->workers = calloc(opt->workers, sizeof(dispatch_worker_t));
+    if (d->workers == NULL)
+    {
+        lerror("malloc dispatch workers");
+        return -1;
+    }
+    for (i = 0; i < opt->workers; i++)
+    {
+        dispatch_worker_t *w = &d->workers[i];
+
+        // mmap'd by malloc, only the slots that get used are touched
+        w->ring = malloc(DISPATCH_RING * sizeof(dispatch_event_t));
+        if (w->ring == NULL)
+        {
+            lerror("malloc dispatch ring");
+            return -1;
+        }
+        ret = pthread_create(&w->tid, NULL, dispatch_worker, w);
+        if (ret != 0)
+        {
+            lerror("pthread_create: %s", strerror(ret));
+            return -1;
+        }
+        d->nworkers++;
+    }
+    linfo("dispatch to %d workers:%s%s%s%s%s", d->nworkers,
+          d->exec ? " exec" : "", d->journal_fd != -1 ? " journal" : "", d->plugin ? " plugin" : "",
+          d->match ? ", names matching " : "", d->match ? d->match : "");
+    return 0;
 }
 
-static int log_inotify_event(inotify_event_t *ev)
+// run what is still queued and wait for the workers
+static void dispatch_stop()
 {
-    if (ev == NULL)
+    dispatch_t *d = &dispatch_s;
+    int i;
+
+    for (i = 0; i < d->nworkers; i++)
     {
-        lerror("log_inotify_event: ev is NULL");
-        return -1;
+        spsc_close(&d->workers[i].q);
+    }
+    for (i = 0; i < d->nworkers; i++)
+    {
+        pthread_join(d->workers[i].tid, NULL);
+        free(d->workers[i].ring);
     }
+    free(d->workers);
+    d->nworkers = 0;
+    if (d->journal_fd != -1)
+    {
+        close(d->journal_fd);
+    }
+}
 
-    int mask = ev->mask;
-    if (ev->len == 0)
+// count is how many events were merged into this one
+static int log_inotify_event(uint32_t mask, const char *dir, const char *name, uint32_t count)
+{
+    if (name[0] == '\0')
     {
-        linfo("log_inotify_event: get 0 len of ev, mask %x", mask);
+        linfo("log_inotify_event: event without a name on %s, mask %x", dir, mask);
         return -1;
     }
 
-    if (strncmp(ev->name, EXIT_FLAG, strlen(EXIT_FLAG)) == 0)
+    char names[EVENT_NAMES_SIZE];
+    if (count > 1)
     {
-        linfo("get exit flag %s, begin to set exit_flag to 1", EXIT_FLAG);
-        exit_flag = 1;
+        linfo_rl(1000, 1000, "Detect %s event from %s %s/%s, %u times",
+                 event_name(mask, names, sizeof(names)), event_type(mask), dir, name, count);
     }
-
-    event_name_t *ev_name = event_name(ev);
-    linfo("Detect %s event from %s %s", ev_name->name, ev_name->type, ev->name);
+    else
+    {
+        linfo_rl(1000, 1000, "Detect %s event from %s %s/%s",
+                 event_name(mask, names, sizeof(names)), event_type(mask), dir, name);
+    }
+    dispatch_event(mask, dir, name, count);
+    return 0;
 }
 
-static void init_options(inotify_opt_t *opt)
+static unsigned int tree_hash(const watch_tree_t *t, int wd)
 {
-    assert(opt);
+    return ((unsigned int)wd * 2654435761u) & t->mask;
+}
 
-    opt->mask = 0;
-    opt->path = NULL;
+// node index of wd, -1 if it is not ours
+static int tree_lookup(const watch_tree_t *t, int wd)
+{
+    unsigned int i = tree_hash(t, wd);
+    while (t->slots[i] != -1)
+    {
+        if (t->nodes[t->slots[i]].wd == wd)
+        {
+            return t->slots[i];
+        }
+        i = (i + 1) & t->mask;
+    }
+    return -1;
 }
 
-static void parse_options(int argc, char *argv[], inotify_opt_t *opt)
+static void tree_map(watch_tree_t *t, int idx)
 {
-    assert(argc);
-    assert(argv);
-    assert(opt);
+    unsigned int i;
 
-    int c = 0;
-    while (1)
+    if ((t->count + 1) * 2 > t->mask + 1)
     {
-        c = getopt_long(argc, argv, optstring, long_options, NULL);
+        // grow and put everything back
+        int *old = t->slots;
+        unsigned int j, size = t->mask + 1;
+        t->slots = malloc(size * 2 * sizeof(int));
+        if (t->slots == NULL)
+        {
+            lerror_exit("malloc wd map of %u", size * 2);
+        }
+        memset(t->slots, -1, size * 2 * sizeof(int));
+        t->mask = size * 2 - 1;
+        for (j = 0; j < size; j++)
+        {
+            if (old[j] == -1)
+            {
+                continue;
+            }
+            i = tree_hash(t, t->nodes[old[j]].wd);
+            while (t->slots[i] != -1)
+            {
+                i = (i + 1) & t->mask;
+            }
+            t->slots[i] = old[j];
+        }
+        free(old);
+    }
 
-        if (c == -1)
+    i = tree_hash(t, t->nodes[idx].wd);
+    while (t->slots[i] != -1)
+    {
+        i = (i + 1) & t->mask;
+    }
+    t->slots[i] = idx;
+    t->count++;
+}
+
+// drop wd from the map, pulling the rest of its cluster back like flow.h does
+static void tree_unmap(watch_tree_t *t, int wd)
+{
+    unsigned int i = tree_hash(t, wd), j, home;
+
+    while (t->slots[i] != -1 && t->nodes[t->slots[i]].wd != wd)
+    {
+        i = (i + 1) & t->mask;
+    }
+    if (t->slots[i] == -1)
+    {
+        return;
+    }
+    for (j = i; ; )
+    {
+        j = (j + 1) & t->mask;
+        if (t->slots[j] == -1)
         {
             break;
         }
-
-        switch (c)
+        home = tree_hash(t, t->nodes[t->slots[j]].wd);
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
         {
-            case 'p':
-                opt->path = optarg;
-                break;
-            case 'c':
-                opt->mask = opt->mask | IN_CREATE;
-                break;
-            case 'd':
-                opt->mask = opt->mask | IN_DELETE;
-                break;
-            case 'm':
-                opt->mask = opt->mask | IN_MODIFY;
-                break;
-            default:
-                lerror("Unknown option %c", c);
-                break;
+            t->slots[i] = t->slots[j];
+            i = j;
         }
     }
-
-    linfo("parse_options finish");
+    t->slots[i] = -1;
+    t->count--;
 }
 
-static void check_options(inotify_opt_t *opt)
+static void tree_link(watch_tree_t *t, int idx, int parent)
 {
-    assert(opt);
+    watch_node_t *n = &t->nodes[idx];
 
-    if (opt->path == NULL)
+    n->parent = parent;
+    n->prev = -1;
+    n->next = parent == -1 ? -1 : t->nodes[parent].child;
+    if (n->next != -1)
     {
-        lerror("You should specify a path to monitored");
-        exit(-1);
+        t->nodes[n->next].prev = idx;
     }
-    else if (opt->mask == 0)
+    if (parent != -1)
     {
-        lerror("You should specify inotify mask");
-        exit(-1);
+        t->nodes[parent].child = idx;
     }
+}
 
-    linfo("check_options: path = %s; mask = %x", opt->path, opt->mask);
+static void tree_unlink(watch_tree_t *t, int idx)
+{
+    watch_node_t *n = &t->nodes[idx];
+
+    if (n->prev != -1)
+    {
+        t->nodes[n->prev].next = n->next;
+    }
+    else if (n->parent != -1)
+    {
+        t->nodes[n->parent].child = n->next;
+    }
+    if (n->next != -1)
+    {
+        t->nodes[n->next].prev = n->prev;
+    }
+    n->parent = n->next = n->prev = -1;
 }
 
-int main(int argc, char *argv[])
+static int tree_node_new(watch_tree_t *t, int parent, const char *name)
 {
-    inotify_opt_t *opt;
-    init_options(opt);
-    parse_options(argc, argv, opt);
-    check_options(opt);
+    int idx;
 
-    int ifd = inotify_init();
-    if (ifd == -1)
+    if (t->free_node != -1)
     {
-        lerror("inotify_init: %s", strerror(errno));
-        goto ERR;
+        idx = t->free_node;
+        t->free_node = t->nodes[idx].parent;
+    }
+    else
+    {
+        if (t->nnodes == t->cap)
+        {
+            int cap = t->cap ? t->cap * 2 : 1024;
+            watch_node_t *nodes = realloc(t->nodes, cap * sizeof(watch_node_t));
+            if (nodes == NULL)
+            {
+                lerror_exit("realloc %d nodes", cap);
+            }
+            t->nodes = nodes;
+            t->cap = cap;
+        }
+        idx = t->nnodes++;
+    }
+    t->nodes[idx].wd = -1;
+    t->nodes[idx].child = -1;
+    tree_link(t, idx, parent);
+    t->nodes[idx].name = strdup(name);
+    if (t->nodes[idx].name == NULL)
+    {
+        lerror_exit("strdup %s", name);
     }
+    return idx;
+}
 
-    linfo("inotify_add_watch: add path = %s with mask = %x", opt->path, opt->mask);
-    int wd = inotify_add_watch(ifd, opt->path, opt->mask);
-    if (wd == -1)
+static void tree_node_free(watch_tree_t *t, int idx)
+{
+    // children still here have lost their place, they are dropped on their own
+    while (t->nodes[idx].child != -1)
     {
-        lerror("inotify_add_watch: %s", strerror(errno));
-        goto ERR;
+        tree_unlink(t, t->nodes[idx].child);
+    }
+    tree_unlink(t, idx);
+    if (t->nodes[idx].wd != -1)
+    {
+        tree_unmap(t, t->nodes[idx].wd);
+        mt_gauge_add(m_watches, -1);
     }
+    free(t->nodes[idx].name);
+    t->nodes[idx].name = NULL;
+    t->nodes[idx].wd = -1;
+    t->nodes[idx].parent = t->free_node;
+    t->free_node = idx;
+}
 
-    while (exit_flag == 0)
+// put the path of node idx together from its parents, -1 if it does not fit
+static int tree_path(const watch_tree_t *t, int idx, char *buf, int size)
+{
+    int chain[PATH_SIZE / 2];
+    int depth = 0, len = 0, n;
+
+    for (; idx != -1 && depth < PATH_SIZE / 2; idx = t->nodes[idx].parent)
     {
-        int shift = 0;
-        char buffer[BUFFER_SIZE];
-        int len = read(ifd, buffer, BUFFER_SIZE);
-        if(len < 0)
+        chain[depth++] = idx;
+    }
+    while (depth-- > 0)
+    {
+        n = snprintf(buf + len, size - len, "%s%s", len && buf[len - 1] != '/' ? "/" : "",
+                     t->nodes[chain[depth]].name);
+        if (n >= size - len)
         {
-            lerror("read: %s", strerror(errno));
-            continue;
+            return -1;
         }
+        len += n;
+    }
+    return len;
+}
 
-        while (shift < len)
+static void tree_push(watch_tree_t *t, int idx)
+{
+    if (t->qtail - t->qhead == t->qcap)
+    {
+        int i, cap = t->qcap ? t->qcap * 2 : 1024;
+        int *queue = malloc(cap * sizeof(int));
+        if (queue == NULL)
         {
-            inotify_event_t *ev = (inotify_event_t *)(buffer + shift);
-            log_inotify_event(ev);
-
-            shift += EVENT_SIZE + ev->len;
+            lerror_exit("malloc walk queue of %d", cap);
         }
+        for (i = 0; i < t->qtail - t->qhead; i++)
+        {
+            queue[i] = t->queue[(t->qhead + i) % t->qcap];
+        }
+        free(t->queue);
+        t->queue = queue;
+        t->qtail -= t->qhead;
+        t->qhead = 0;
+        t->qcap = cap;
+    }
+    t->queue[t->qtail++ % t->qcap] = idx;
+}
+
+static int tree_init(watch_tree_t *t, int ifd, uint32_t watch_mask, const char *path)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    t->free_node = -1;
+    t->mask = 1023;
+    t->slots = malloc((t->mask + 1) * sizeof(int));
+    if (t->slots == NULL)
+    {
+        return -1;
     }
+    memset(t->slots, -1, (t->mask + 1) * sizeof(int));
+    t->ifd = ifd;
+    t->watch_mask = watch_mask;
+    return tree_node_new(t, -1, path);
+}
+
+// watch node idx through the fd it was opened as, -1 if it is not watched
+static int tree_watch(watch_tree_t *t, int idx, int fd, const char *path)
+{
+    char proc[64];
+    int wd, ret = 0;
 
-    linfo("inotify_rm_watch: rm watch %d with mask = %x", wd, opt->mask);
-    int res = inotify_rm_watch(ifd, wd);
+    // the fd, not the path, so this is the directory that was opened
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    wd = inotify_add_watch(t->ifd, proc, t->watch_mask);
+    if (wd == -1)
+    {
+        __atomic_add_fetch(&t->errors, 1, __ATOMIC_RELAXED);
+        if (errno == ENOSPC)
+        {
+            lerror_rl(1, 1, "inotify_add_watch %s: out of watches, raise /proc/sys/fs/inotify/max_user_watches", path);
+        }
+        else
+        {
+            lerror_rl(10, 10, "inotify_add_watch %s: %s", path, strerror(errno));
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if (tree_lookup(t, wd) != -1)
+    {
+        // the same directory again, through a bind mount or a move; keep the first
+        ret = -1;
+    }
+    else
+    {
+        t->nodes[idx].wd = wd;
+        tree_map(t, idx);
+        mt_gauge_add(m_watches, 1);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+// watch one directory and queue its subdirectories
+static void walk_dir(watch_tree_t *t, int idx, char *buf)
+{
+    char path[PATH_SIZE];
+    int fd, n, off;
+
+    pthread_mutex_lock(&t->lock);
+    n = tree_path(t, idx, path, sizeof(path));
+    pthread_mutex_unlock(&t->lock);
+    fd = n == -1 ? -1 : open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (n == -1)
+    {
+        // what fit of it, put together under the lock like the rest
+        lerror_rl(10, 10, "a path is too long: %s...", path);
+    }
+    else if (fd == -1)
+    {
+        // gone already, or not ours to read
+        ldebug("open %s: %s", path, strerror(errno));
+    }
+    if (fd == -1 || tree_watch(t, idx, fd, path) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        pthread_mutex_lock(&t->lock);
+        tree_node_free(t, idx);
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+
+    while ((n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF_SIZE)) > 0)
+    {
+        pthread_mutex_lock(&t->lock);
+        for (off = 0; off < n; )
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            int dir = d->d_type == DT_DIR;
+            struct stat st;
+
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            {
+                continue;
+            }
+            // some filesystems leave the type to stat
+            if (d->d_type == DT_UNKNOWN && fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                dir = S_ISDIR(st.st_mode);
+            }
+            if (t->report)
+            {
+                linfo_rl(1000, 1000, "Detect IN_CREATE event from %s %s/%s (found by rescan)",
+                         dir ? "directory" : "file", path, d->d_name);
+                dispatch_event(IN_CREATE | (dir ? IN_ISDIR : 0), path, d->d_name, 1);
+            }
+            if (dir)
+            {
+                tree_push(t, tree_node_new(t, idx, d->d_name));
+            }
+        }
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+    if (n == -1)
+    {
+        lerror_rl(10, 10, "getdents64 %s: %s", path, strerror(errno));
+    }
+    close(fd);
+}
+
+static void *walk_thread(void *arg)
+{
+    watch_tree_t *t = arg;
+    char *buf = malloc(DIRENT_BUF_SIZE);
+    int idx;
+
+    if (buf == NULL)
+    {
+        lerror_exit("malloc dirent buffer");
+    }
+    pthread_mutex_lock(&t->lock);
+    while (1)
+    {
+        while (t->qhead == t->qtail && t->busy > 0)
+        {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if (t->qhead == t->qtail)
+        {
+            break; // nothing queued and nobody left to queue more
+        }
+        idx = t->queue[t->qhead++ % t->qcap];
+        t->busy++;
+        pthread_mutex_unlock(&t->lock);
+
+        walk_dir(t, idx, buf);
+
+        pthread_mutex_lock(&t->lock);
+        t->busy--;
+        if (t->busy == 0 && t->qhead == t->qtail)
+        {
+            pthread_cond_broadcast(&t->cond);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    free(buf);
+    return NULL;
+}
+
+// walk what is queued, on threads new ones or on this one if threads is 1
+static void tree_walk(watch_tree_t *t, int threads)
+{
+    pthread_t tids[MAX_WALK_THREADS];
+    int i, started = 0;
+
+    for (i = 1; i < threads && i < MAX_WALK_THREADS; i++)
+    {
+        if (pthread_create(&tids[started], NULL, walk_thread, t) == 0)
+        {
+            started++;
+        }
+    }
+    walk_thread(t);
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void log_event_at(watch_tree_t *t, int wd, uint32_t mask, const char *name, uint32_t count)
+{
+    char dir[PATH_SIZE];
+    int idx = tree_lookup(t, wd);
+
+    if (idx == -1 || tree_path(t, idx, dir, sizeof(dir)) == -1)
+    {
+        strcpy(dir, "?");
+    }
+    log_inotify_event(mask, dir, name, count);
+}
+
+// the child of parent called name, -1 if there is none
+static int tree_child(const watch_tree_t *t, int parent, const char *name)
+{
+    int i;
+    for (i = t->nodes[parent].child; i != -1; i = t->nodes[i].next)
+    {
+        if (strcmp(t->nodes[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// stop watching idx and everything under it, it has left the tree
+static void tree_drop(watch_tree_t *t, int idx)
+{
+    int cap = 64, n = 1, i, c;
+    int *drop = malloc(cap * sizeof(int));
+
+    if (drop == NULL)
+    {
+        lerror_exit("malloc %d nodes", cap);
+    }
+    // breadth first, so a parent always comes before its children
+    drop[0] = idx;
+    for (i = 0; i < n; i++)
+    {
+        for (c = t->nodes[drop[i]].child; c != -1; c = t->nodes[c].next)
+        {
+            if (n == cap)
+            {
+                cap *= 2;
+                drop = realloc(drop, cap * sizeof(int));
+                if (drop == NULL)
+                {
+                    lerror_exit("realloc %d nodes", cap);
+                }
+            }
+            drop[n++] = c;
+        }
+    }
+    while (n-- > 0)
+    {
+        if (t->nodes[drop[n]].wd != -1)
+        {
+            inotify_rm_watch(t->ifd, t->nodes[drop[n]].wd);
+        }
+        tree_node_free(t, drop[n]);
+    }
+    free(drop);
+}
+
+static unsigned int coalesce_hash(int wd, const char *name)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)wd;
+    for (; *name; name++)
+    {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h & (COALESCE_MAX * 2 - 1);
+}
+
+// take ring position pos out of the hash
+static void coalesce_unmap(coalesce_t *c, unsigned int pos)
+{
+    pending_event_t *e = &c->ring[pos % COALESCE_MAX];
+    unsigned int i = coalesce_hash(e->wd, e->name), j, home;
+    unsigned int mask = COALESCE_MAX * 2 - 1;
+
+    while (c->slots[i] != pos + 1)
+    {
+        i = (i + 1) & mask;
+    }
+    for (j = i; ; )
+    {
+        j = (j + 1) & mask;
+        if (c->slots[j] == 0)
+        {
+            break;
+        }
+        e = &c->ring[(c->slots[j] - 1) % COALESCE_MAX];
+        home = coalesce_hash(e->wd, e->name);
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            c->slots[i] = c->slots[j];
+            i = j;
+        }
+    }
+    c->slots[i] = 0;
+}
+
+// log the held events that are due at now, or all of them if now is 0
+static void coalesce_flush(watch_tree_t *t, coalesce_t *c, uint64_t now)
+{
+    while (c->head != c->tail)
+    {
+        pending_event_t *e = &c->ring[c->head % COALESCE_MAX];
+        if (now != 0 && e->count > 0 && now - e->first < c->window)
+        {
+            break;
+        }
+        if (e->count > 0)
+        {
+            coalesce_unmap(c, c->head);
+            log_event_at(t, e->wd, e->mask, e->name, e->count);
+        }
+        c->head++;
+    }
+}
+
+// log the event held for this path now, before something that must come after it
+static void coalesce_take(watch_tree_t *t, coalesce_t *c, int wd, const char *name)
+{
+    unsigned int i = coalesce_hash(wd, name);
+
+    if (c->window == 0)
+    {
+        return;
+    }
+    for (; c->slots[i] != 0; i = (i + 1) & (COALESCE_MAX * 2 - 1))
+    {
+        pending_event_t *e = &c->ring[(c->slots[i] - 1) % COALESCE_MAX];
+        if (e->wd == wd && strcmp(e->name, name) == 0)
+        {
+            coalesce_unmap(c, c->slots[i] - 1);
+            log_event_at(t, e->wd, e->mask, e->name, e->count);
+            e->count = 0;
+            return;
+        }
+    }
+}
+
+static void coalesce_add(watch_tree_t *t, coalesce_t *c, int wd, uint32_t mask, const char *name, uint64_t now)
+{
+    unsigned int i = coalesce_hash(wd, name);
+    pending_event_t *e;
+
+    if (c->window == 0)
+    {
+        log_event_at(t, wd, mask, name, 1);
+        return;
+    }
+    for (; c->slots[i] != 0; i = (i + 1) & (COALESCE_MAX * 2 - 1))
+    {
+        e = &c->ring[(c->slots[i] - 1) % COALESCE_MAX];
+        if (e->wd == wd && strcmp(e->name, name) == 0)
+        {
+            e->mask |= mask;
+            e->count++;
+            mt_add(m_coalesced, 1);
+            return;
+        }
+    }
+
+    if (c->tail - c->head == COALESCE_MAX)
+    {
+        // full, the oldest goes out early and its slot may be where i is
+        pending_event_t *old = &c->ring[c->head % COALESCE_MAX];
+        if (old->count > 0)
+        {
+            coalesce_unmap(c, c->head);
+            log_event_at(t, old->wd, old->mask, old->name, old->count);
+        }
+        c->head++;
+        coalesce_add(t, c, wd, mask, name, now);
+        return;
+    }
+    e = &c->ring[c->tail % COALESCE_MAX];
+    e->wd = wd;
+    e->mask = mask;
+    e->count = 1;
+    e->first = now;
+    strncpy(e->name, name, NAME_MAX);
+    e->name[NAME_MAX] = '\0';
+    c->slots[i] = ++c->tail;
+}
+
+// ns until the next held event or move is due, -1 if there is none
+static int64_t pending_deadline(coalesce_t *c, uint64_t now)
+{
+    int64_t wait = -1;
+    int64_t d;
+
+    while (c->head != c->tail && c->ring[c->head % COALESCE_MAX].count == 0)
+    {
+        c->head++;
+    }
+    if (c->head != c->tail)
+    {
+        d = c->ring[c->head % COALESCE_MAX].first + c->window - now;
+        wait = d > 0 ? d : 0;
+    }
+    if (nmoves > 0)
+    {
+        d = moves_s[0].time + MOVE_WAIT_NS - now;
+        d = d > 0 ? d : 0;
+        wait = wait == -1 || d < wait ? d : wait;
+    }
+    return wait;
+}
+
+// an IN_MOVED_FROM with no IN_MOVED_TO: the file left the tree
+static void move_out(watch_tree_t *t, inotify_opt_t *opt, pending_move_t *m)
+{
+    int idx = tree_lookup(t, m->wd);
+
+    // what is held back for it happened before, and still has a path
+    if (m->mask & IN_ISDIR)
+    {
+        coalesce_flush(t, &coalesce_s, 0);
+    }
+    else
+    {
+        coalesce_take(t, &coalesce_s, m->wd, m->name);
+    }
+    if (m->mask & opt->mask)
+    {
+        log_event_at(t, m->wd, m->mask, m->name, 1);
+    }
+    if (opt->recursive && (m->mask & IN_ISDIR) && idx != -1)
+    {
+        int child = tree_child(t, idx, m->name);
+        if (child != -1)
+        {
+            tree_drop(t, child);
+        }
+    }
+}
+
+static void moves_expire(watch_tree_t *t, inotify_opt_t *opt, uint64_t now)
+{
+    while (nmoves > 0 && (now == 0 || now - moves_s[0].time >= MOVE_WAIT_NS))
+    {
+        move_out(t, opt, &moves_s[0]);
+        memmove(&moves_s[0], &moves_s[1], --nmoves * sizeof(pending_move_t));
+    }
+}
+
+static void rename_in_tree(watch_tree_t *t, inotify_opt_t *opt, pending_move_t *from, inotify_event_t *to)
+{
+    char old_dir[PATH_SIZE], new_dir[PATH_SIZE];
+    int old_parent = tree_lookup(t, from->wd);
+    int new_parent = tree_lookup(t, to->wd);
+
+    coalesce_take(t, &coalesce_s, from->wd, from->name);
+    if (old_parent == -1 || tree_path(t, old_parent, old_dir, sizeof(old_dir)) == -1)
+    {
+        strcpy(old_dir, "?");
+    }
+    if (new_parent == -1 || tree_path(t, new_parent, new_dir, sizeof(new_dir)) == -1)
+    {
+        strcpy(new_dir, "?");
+    }
+    if (to->mask & opt->mask)
+    {
+        linfo_rl(1000, 1000, "Detect rename of %s %s/%s to %s/%s",
+                 event_type(to->mask), old_dir, from->name, new_dir, to->name);
+        dispatch_event(to->mask, new_dir, to->name, 1);
+    }
+
+    if (opt->recursive && (to->mask & IN_ISDIR) && new_parent != -1)
+    {
+        int child = old_parent == -1 ? -1 : tree_child(t, old_parent, from->name);
+        if (child != -1)
+        {
+            // the watches moved with it, only the name and parent change
+            free(t->nodes[child].name);
+            t->nodes[child].name = strdup(to->name);
+            tree_unlink(t, child);
+            tree_link(t, child, new_parent);
+        }
+        else
+        {
+            tree_push(t, tree_node_new(t, new_parent, to->name));
+            t->report = 1;
+            tree_walk(t, 1);
+            t->report = 0;
+        }
+    }
+}
+
+// watch everything again from scratch, after the kernel dropped events
+static void tree_resync(watch_tree_t *t, inotify_opt_t *opt)
+{
+    struct timespec start, end;
+    int i, ifd = inotify_init1(IN_CLOEXEC);
+
+    if (ifd == -1)
+    {
+        lerror("inotify_init: %s", strerror(errno));
+        return;
+    }
+    close(t->ifd); // takes every old watch with it
+    t->ifd = ifd;
+    for (i = 0; i < t->nnodes; i++)
+    {
+        if (t->nodes[i].name != NULL && i != 0)
+        {
+            tree_node_free(t, i);
+        }
+    }
+    if (t->nodes[0].wd != -1)
+    {
+        tree_unmap(t, t->nodes[0].wd);
+        mt_gauge_add(m_watches, -1);
+        t->nodes[0].wd = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    tree_push(t, 0);
+    tree_walk(t, opt->threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mt_add(m_resyncs, 1);
+    lwarn("resynced, watching %u directories in %.3f s", t->count,
+          end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+static void handle_event(watch_tree_t *t, inotify_opt_t *opt, inotify_event_t *ev, uint64_t now)
+{
+    int idx = tree_lookup(t, ev->wd);
+    int i;
+
+    if (ev->len > 0 && strncmp(ev->name, EXIT_FLAG, strlen(EXIT_FLAG)) == 0)
+    {
+        linfo("get exit flag %s, begin to set exit_flag to 1", EXIT_FLAG);
+        exit_flag = 1;
+    }
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        // events are gone for good; say so and make sure no directory is missed
+        mt_add(m_overflows, 1);
+        coalesce_flush(t, &coalesce_s, 0);
+        moves_expire(t, opt, 0);
+        lwarn("kernel event queue overflowed, events were lost; "
+              "raise /proc/sys/fs/inotify/max_queued_events or --buffer");
+        if (opt->recursive)
+        {
+            tree_resync(t, opt);
+        }
+        return;
+    }
+
+    if (ev->mask & IN_IGNORED)
+    {
+        // the directory is gone, or its watch was removed; log what it still has
+        if (idx != -1)
+        {
+            coalesce_flush(t, &coalesce_s, 0);
+            tree_node_free(t, idx);
+        }
+        return;
+    }
+    if (idx == -1)
+    {
+        return; // a watch that was already dropped
+    }
+
+    if (ev->mask & IN_MOVED_FROM)
+    {
+        if (nmoves == MOVE_MAX)
+        {
+            moves_expire(t, opt, 0);
+        }
+        moves_s[nmoves].cookie = ev->cookie;
+        moves_s[nmoves].mask = ev->mask;
+        moves_s[nmoves].wd = ev->wd;
+        moves_s[nmoves].time = now;
+        strncpy(moves_s[nmoves].name, ev->name, NAME_MAX);
+        moves_s[nmoves].name[NAME_MAX] = '\0';
+        nmoves++;
+        return;
+    }
+
+    if (ev->mask & IN_MOVED_TO)
+    {
+        for (i = 0; i < nmoves && moves_s[i].cookie != ev->cookie; i++)
+        {
+        }
+        if (i < nmoves)
+        {
+            rename_in_tree(t, opt, &moves_s[i], ev);
+            memmove(&moves_s[i], &moves_s[i + 1], (--nmoves - i) * sizeof(pending_move_t));
+            return;
+        }
+    }
+
+    if (ev->mask & opt->mask)
+    {
+        coalesce_add(t, &coalesce_s, ev->wd, ev->mask, ev->name, now);
+    }
+
+    if (opt->recursive && ev->len > 0 &&
+        (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        // a new directory: watch it and catch up on what it got before that
+        tree_push(t, tree_node_new(t, idx, ev->name));
+        t->report = 1;
+        tree_walk(t, 1);
+        t->report = 0;
+    }
+}
+
+// resident memory of this process in KB
+static unsigned long rss_kb()
+{
+    unsigned long size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+        {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+   fanotify backend (--fanotify)
+
+   one FAN_MARK_FILESYSTEM mark covers the whole filesystem of --path, so
+   startup costs the same for ten directories or a million and there is
+   no watch per directory, in the kernel or here. with FAN_REPORT_DFID_NAME
+   an event carries the file handle of the directory and the name in it;
+   a handle is turned into a path only when an event needs it, with
+   open_by_handle_at, and kept in an LRU of PATH_CACHE_MAX entries.
+   events outside --path are dropped once their path is known. renames
+   come as one FAN_RENAME event with both names. needs CAP_SYS_ADMIN.
+
+   the FAN_ masks used here have the values of their IN_ counterparts
+   and FAN_ONDIR is IN_ISDIR, so the inotify logging works unchanged.
+ */
+typedef struct {
+    unsigned int hash;
+    int type;           // handle_type
+    unsigned int len;   // handle_bytes
+    unsigned char handle[MAX_HANDLE_SZ];
+    char *path;         // NULL if it could not be opened, gone or elsewhere
+    int hnext;          // bucket chain, or the free list
+    int live;           // in the buckets and the LRU list
+    int prev;           // LRU list, most recent at the head
+    int next;
+} path_cache_entry_t;
+
+typedef struct {
+    path_cache_entry_t entries[PATH_CACHE_MAX];
+    int buckets[PATH_CACHE_MAX];
+    int used;
+    int free;           // entries given back by path_cache_drop
+    int head;
+    int tail;
+    int mount_fd;       // any fd on the filesystem, for open_by_handle_at
+    unsigned long hits;
+    unsigned long misses;
+} path_cache_t;
+
+static void path_cache_clear(path_cache_t *c)
+{
+    int i;
+    for (i = 0; i < c->used; i++)
+    {
+        free(c->entries[i].path);
+    }
+    memset(c->buckets, -1, sizeof(c->buckets));
+    c->used = 0;
+    c->free = -1;
+    c->head = c->tail = -1;
+}
+
+static void lru_unlink(path_cache_t *c, int i)
+{
+    path_cache_entry_t *e = &c->entries[i];
+    if (e->prev != -1)
+    {
+        c->entries[e->prev].next = e->next;
+    }
+    else
+    {
+        c->head = e->next;
+    }
+    if (e->next != -1)
+    {
+        c->entries[e->next].prev = e->prev;
+    }
+    else
+    {
+        c->tail = e->prev;
+    }
+}
+
+static void lru_push(path_cache_t *c, int i)
+{
+    c->entries[i].prev = -1;
+    c->entries[i].next = c->head;
+    if (c->head != -1)
+    {
+        c->entries[c->head].prev = i;
+    }
+    c->head = i;
+    if (c->tail == -1)
+    {
+        c->tail = i;
+    }
+}
+
+static char *path_resolve(path_cache_t *c, struct file_handle *fh)
+{
+    char proc[64], buf[PATH_SIZE];
+    int fd;
+    ssize_t n;
+
+    fd = open_by_handle_at(c->mount_fd, fh, O_PATH | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL; // ESTALE once the directory is deleted
+    }
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    n = readlink(proc, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+    {
+        return NULL;
+    }
+    buf[n] = '\0';
+    return strdup(buf);
+}
+
+// take entry i out of the cache and onto the free list
+static void path_cache_remove(path_cache_t *c, int i)
+{
+    path_cache_entry_t *e = &c->entries[i];
+    int *link;
+
+    lru_unlink(c, i);
+    for (link = &c->buckets[e->hash % PATH_CACHE_MAX]; *link != i; link = &c->entries[*link].hnext)
+    {
+    }
+    *link = e->hnext;
+    free(e->path);
+    e->path = NULL;
+    e->live = 0;
+    e->hnext = c->free;
+    c->free = i;
+}
+
+// is path at or under root
+static int path_under(const char *path, const char *root, size_t root_len)
+{
+    return path != NULL && strncmp(path, root, root_len) == 0 &&
+           (path[root_len] == '\0' || path[root_len] == '/' || root_len == 1);
+}
+
+// a directory was renamed or deleted: drop the paths at or under its old one
+static void path_cache_drop(path_cache_t *c, const char *dir, const char *name)
+{
+    char old[PATH_SIZE];
+    size_t len = strlen(dir);
+    int i, n;
+
+    n = snprintf(old, sizeof(old), "%s%s%s", dir, len > 0 && dir[len - 1] == '/' ? "" : "/", name);
+    if (n >= (int)sizeof(old))
+    {
+        path_cache_clear(c);
+        return;
+    }
+    for (i = 0; i < c->used; i++)
+    {
+        if (c->entries[i].live && path_under(c->entries[i].path, old, n))
+        {
+            path_cache_remove(c, i);
+        }
+    }
+}
+
+// the path of the directory behind fh, NULL if there is none
+static const char *path_lookup(path_cache_t *c, struct file_handle *fh)
+{
+    unsigned int h = 2166136261u ^ (unsigned int)fh->handle_type, i;
+    int idx;
+    path_cache_entry_t *e;
+
+    for (i = 0; i < fh->handle_bytes; i++)
+    {
+        h = (h ^ fh->f_handle[i]) * 16777619u;
+    }
+    for (idx = c->buckets[h % PATH_CACHE_MAX]; idx != -1; idx = c->entries[idx].hnext)
+    {
+        e = &c->entries[idx];
+        if (e->hash == h && e->type == fh->handle_type && e->len == fh->handle_bytes &&
+            memcmp(e->handle, fh->f_handle, e->len) == 0)
+        {
+            c->hits++;
+            lru_unlink(c, idx);
+            lru_push(c, idx);
+            return e->path;
+        }
+    }
+
+    c->misses++;
+    if (c->free == -1 && c->used == PATH_CACHE_MAX)
+    {
+        path_cache_remove(c, c->tail); // the least recently used one
+    }
+    if (c->free != -1)
+    {
+        idx = c->free;
+        c->free = c->entries[idx].hnext;
+    }
+    else
+    {
+        idx = c->used++;
+    }
+    e = &c->entries[idx];
+    e->live = 1;
+    e->hash = h;
+    e->type = fh->handle_type;
+    e->len = fh->handle_bytes;
+    memcpy(e->handle, fh->f_handle, e->len);
+    e->path = path_resolve(c, fh);
+    e->hnext = c->buckets[h % PATH_CACHE_MAX];
+    c->buckets[h % PATH_CACHE_MAX] = idx;
+    lru_push(c, idx);
+    return e->path;
+}
+
+static int fan_run(inotify_opt_t *opt)
+{
+    static path_cache_t cache;
+    char root[PATH_SIZE];
+    struct timespec start, end;
+    uint64_t mask = FAN_ONDIR;
+    int fd, ret, rename = 0;
+    size_t root_len;
+
+    if (realpath(opt->path, root) == NULL)
+    {
+        lerror("realpath %s: %s", opt->path, strerror(errno));
+        return -1;
+    }
+    root_len = strlen(root);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_UNLIMITED_QUEUE, O_RDONLY);
+    if (fd == -1)
+    {
+        fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC, O_RDONLY);
+    }
+    if (fd == -1)
+    {
+        lerror("fanotify_init: %s", strerror(errno));
+        return -1;
+    }
+
+    mask |= opt->mask & (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE);
+    if (opt->mask & IN_MOVE)
+    {
+        mask |= FAN_RENAME;
+        rename = 1;
+    }
+    ret = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, root);
+    if (ret == -1 && rename && errno == EINVAL)
+    {
+        // before 5.17: the two halves of a rename come apart
+        mask = (mask & ~FAN_RENAME) | FAN_MOVED_FROM | FAN_MOVED_TO;
+        ret = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, root);
+    }
+    if (ret == -1)
+    {
+        lerror("fanotify_mark %s: %s", root, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    cache.mount_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cache.mount_fd == -1)
+    {
+        lerror("open %s: %s", root, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memset(cache.buckets, -1, sizeof(cache.buckets));
+    cache.free = -1;
+    cache.head = cache.tail = -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    linfo("fanotify mark on the filesystem of %s in %.3f s, rss %lu KB, mask = %llx", root,
+          end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9, rss_kb(),
+          (unsigned long long)mask);
+
+    opt->buffer = (opt->buffer + 4095) & ~4095;
+    char *buffer = aligned_alloc(4096, opt->buffer);
+    if (buffer == NULL)
+    {
+        lerror("malloc read buffer of %d", opt->buffer);
+        close(fd);
+        return -1;
+    }
+
+    while (exit_flag == 0)
+    {
+        ssize_t len = read(fd, buffer, opt->buffer);
+        struct fanotify_event_metadata *md = (struct fanotify_event_metadata *)buffer;
+        int count = 0;
+
+        if (len == -1)
+        {
+            if (errno != EINTR)
+            {
+                lerror("read: %s", strerror(errno));
+            }
+            continue;
+        }
+        for (; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len), count++)
+        {
+            const char *dirs[2] = { NULL, NULL };
+            const char *names[2] = { NULL, NULL };
+            size_t off = md->metadata_len;
+
+            if (md->mask & FAN_Q_OVERFLOW)
+            {
+                mt_add(m_overflows, 1);
+                lwarn("kernel event queue overflowed, events were lost");
+                continue;
+            }
+            // the directory handle and name, two of them for a rename
+            while (off + sizeof(struct fanotify_event_info_header) <= md->event_len)
+            {
+                struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)((char *)md + off);
+                struct file_handle *fh = (struct file_handle *)fid->handle;
+                int which = fid->hdr.info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+
+                if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+                    fid->hdr.info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME || which)
+                {
+                    dirs[which] = path_lookup(&cache, fh);
+                    names[which] = (const char *)(fh->f_handle + fh->handle_bytes);
+                }
+                if (fid->hdr.len == 0)
+                {
+                    break;
+                }
+                off += fid->hdr.len;
+            }
+            if (names[0] == NULL)
+            {
+                continue;
+            }
+            if (strncmp(names[0], EXIT_FLAG, strlen(EXIT_FLAG)) == 0 ||
+                (names[1] != NULL && strncmp(names[1], EXIT_FLAG, strlen(EXIT_FLAG)) == 0))
+            {
+                linfo("get exit flag %s, begin to set exit_flag to 1", EXIT_FLAG);
+                exit_flag = 1;
+            }
+
+            if (md->mask & FAN_RENAME)
+            {
+                if (path_under(dirs[0], root, root_len) || path_under(dirs[1], root, root_len))
+                {
+                    linfo_rl(1000, 1000, "Detect rename of %s %s/%s to %s/%s",
+                             md->mask & FAN_ONDIR ? "directory" : "file",
+                             dirs[0] ? dirs[0] : "?", names[0], dirs[1] ? dirs[1] : "?", names[1]);
+                }
+                if (path_under(dirs[1], root, root_len))
+                {
+                    dispatch_event(IN_MOVED_TO | (md->mask & FAN_ONDIR), dirs[1], names[1], 1);
+                }
+            }
+            else if (path_under(dirs[0], root, root_len))
+            {
+                log_inotify_event(md->mask & ~FAN_RENAME, dirs[0], names[0], 1);
+            }
+            // cached paths under a renamed or deleted directory are stale now
+            if ((md->mask & FAN_ONDIR) && (md->mask & (FAN_RENAME | FAN_MOVED_FROM | FAN_DELETE)) &&
+                dirs[0] != NULL)
+            {
+                path_cache_drop(&cache, dirs[0], names[0]);
+            }
+        }
+        if (count > 0)
+        {
+            mt_add(m_events, count);
+            mt_observe(m_batch, count);
+        }
+    }
+
+    linfo("path cache: %lu hits, %lu misses", cache.hits, cache.misses);
+    path_cache_clear(&cache);
+    close(cache.mount_fd);
+    close(fd);
+    free(buffer);
+    linfo("unlink file %s", EXIT_FLAG);
+    if (unlink(EXIT_FLAG) == -1)
+    {
+        lerror("unlink: %s", strerror(errno));
+    }
+    return 0;
+}
+
+static void init_options(inotify_opt_t *opt)
+{
+    assert(opt);
+
+    opt->mask = 0;
+    opt->path = NULL;
+    opt->metrics = NULL;
+    opt->recursive = 0;
+    opt->buffer = BUFFER_SIZE;
+    opt->window = 0;
+    opt->fanotify = 0;
+    opt->exec = NULL;
+    opt->journal = NULL;
+    opt->plugin = NULL;
+    opt->match = NULL;
+    opt->workers = DISPATCH_WORKERS;
+    opt->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt->threads < 4)
+    {
+        opt->threads = 4; // the walk waits on the disk as much as on the cpu
+    }
+}
+
+static void parse_options(int argc, char *argv[], inotify_opt_t *opt)
+{
+    assert(argc);
+    assert(argv);
+    assert(opt);
+
+    int c = 0;
+    while (1)
+    {
+        c = getopt_long(argc, argv, optstring, long_options, NULL);
+
+        if (c == -1)
+        {
+            break;
+        }
+
+        switch (c)
+        {
+            case 'p':
+                opt->path = optarg;
+                break;
+            case 'c':
+                opt->mask = opt->mask | IN_CREATE;
+                break;
+            case 'd':
+                opt->mask = opt->mask | IN_DELETE;
+                break;
+            case 'm':
+                opt->mask = opt->mask | IN_MODIFY;
+                break;
+            case 'M':
+                opt->metrics = optarg;
+                break;
+            case 'r':
+                opt->recursive = 1;
+                break;
+            case 'v':
+                opt->mask = opt->mask | IN_MOVE;
+                break;
+            case 'b':
+                opt->buffer = atoi(optarg);
+                if (opt->buffer < (int)(EVENT_SIZE + NAME_MAX + 1))
+                {
+                    lerror("buffer should hold at least one event of %d bytes", (int)(EVENT_SIZE + NAME_MAX + 1));
+                    exit(-1);
+                }
+                break;
+            case 'w':
+                opt->window = atoi(optarg);
+                break;
+            case 'F':
+                opt->fanotify = 1;
+                break;
+            case 'C':
+                opt->mask = opt->mask | IN_CLOSE_WRITE;
+                break;
+            case 'e':
+                opt->exec = optarg;
+                break;
+            case 'o':
+                opt->journal = optarg;
+                break;
+            case 'P':
+                opt->plugin = optarg;
+                break;
+            case 'g':
+                opt->match = optarg;
+                break;
+            case 'n':
+                opt->workers = atoi(optarg);
+                if (opt->workers < 1 || opt->workers > MAX_DISPATCH_WORKERS)
+                {
+                    lerror("workers should be in [1, %d], got %s", MAX_DISPATCH_WORKERS, optarg);
+                    exit(-1);
+                }
+                break;
+            case 'j':
+                opt->threads = atoi(optarg);
+                if (opt->threads < 1 || opt->threads > MAX_WALK_THREADS)
+                {
+                    lerror("threads should be in [1, %d], got %s", MAX_WALK_THREADS, optarg);
+                    exit(-1);
+                }
+                break;
+            default:
+                lerror("Unknown option %c", c);
+                break;
+        }
+    }
+
+    linfo("parse_options finish");
+}
+
+static void check_options(inotify_opt_t *opt)
+{
+    assert(opt);
+
+    if (opt->path == NULL)
+    {
+        lerror("You should specify a path to monitored");
+        exit(-1);
+    }
+    else if (opt->mask == 0)
+    {
+        lerror("You should specify inotify mask");
+        exit(-1);
+    }
+
+    linfo("check_options: path = %s; mask = %x", opt->path, opt->mask);
+}
+
+static void init_metrics(inotify_opt_t *opt)
+{
+    m_events = mt_counter("inotify_z_events_total", "Events read.");
+    m_overflows = mt_counter("inotify_z_overflows_total", "IN_Q_OVERFLOW events, the kernel queue was full.");
+    m_batch = mt_histogram("inotify_z_read_events", "Events returned by one read.", 1);
+    m_watches = mt_gauge("inotify_z_watches", "Directories watched.");
+    m_coalesced = mt_counter("inotify_z_coalesced_total", "Events merged into an earlier one on the same path.");
+    m_resyncs = mt_counter("inotify_z_resyncs_total", "Rewalks of the tree after an overflow.");
+    m_dispatched = mt_counter("inotify_z_dispatched_total", "Events queued for the actions.");
+    m_dispatch_dropped = mt_counter("inotify_z_dispatch_dropped_total", "Events dropped, a worker queue was full.");
+    m_action_errors = mt_counter("inotify_z_action_errors_total", "Actions that failed.");
+
+    if (opt->metrics != NULL && mt_start(opt->metrics, 1000) == -1)
+    {
+        lerror("metrics %s: %s", opt->metrics, strerror(errno));
+        exit(-1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    inotify_opt_t opt_s;
+    inotify_opt_t *opt = &opt_s;
+    watch_tree_t tree;
+    int wd = -1;
+    init_options(opt);
+    parse_options(argc, argv, opt);
+    check_options(opt);
+    init_metrics(opt);
+    if (dispatch_start(opt) == -1)
+    {
+        exit(-1);
+    }
+
+    if (opt->fanotify)
+    {
+        int ret = fan_run(opt);
+        dispatch_stop();
+        return ret == -1 ? -1 : 0;
+    }
+
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd == -1)
+    {
+        lerror("inotify_init: %s", strerror(errno));
+        goto ERR;
+    }
+
+    if (tree_init(&tree, ifd, opt->mask | (opt->recursive ? IN_CREATE | IN_MOVE | IN_ONLYDIR : 0),
+                  opt->path) == -1)
+    {
+        lerror("tree_init: %s", strerror(errno));
+        goto ERR;
+    }
+
+    if (opt->recursive)
+    {
+        struct timespec start, end;
+        linfo("walk %s with %d threads, mask = %x", opt->path, opt->threads, tree.watch_mask);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        tree_push(&tree, 0);
+        tree_walk(&tree, opt->threads);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        wd = tree.nodes[0].wd;
+        if (wd == -1)
+        {
+            lerror("can not watch %s", opt->path);
+            goto ERR;
+        }
+        linfo("watching %u directories in %.3f s, %lu failed, rss %lu KB", tree.count,
+              end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9, tree.errors, rss_kb());
+    }
+    else
+    {
+        linfo("inotify_add_watch: add path = %s with mask = %x", opt->path, opt->mask);
+        wd = inotify_add_watch(ifd, opt->path, opt->mask);
+        if (wd == -1)
+        {
+            lerror("inotify_add_watch: %s", strerror(errno));
+            goto ERR;
+        }
+        tree.nodes[0].wd = wd;
+        tree_map(&tree, 0);
+        mt_gauge_add(m_watches, 1);
+    }
+
+    // one large read drains thousands of events per syscall in a storm
+    opt->buffer = (opt->buffer + 4095) & ~4095;
+    char *buffer = aligned_alloc(4096, opt->buffer);
+    coalesce_s.ring = calloc(COALESCE_MAX, sizeof(pending_event_t));
+    coalesce_s.slots = calloc(COALESCE_MAX * 2, sizeof(unsigned int));
+    coalesce_s.window = opt->window * 1000000ULL;
+    if (buffer == NULL || coalesce_s.ring == NULL || coalesce_s.slots == NULL)
+    {
+        lerror("malloc read buffer of %d", opt->buffer);
+        goto ERR;
+    }
+
+    while (exit_flag == 0)
+    {
+        int shift = 0;
+        int64_t wait = pending_deadline(&coalesce_s, now_ns());
+        struct pollfd pfd = { .fd = tree.ifd, .events = POLLIN };
+
+        // sleep until an event comes in or something held back is due
+        if (poll(&pfd, 1, wait == -1 ? -1 : (int)((wait + 999999) / 1000000)) == -1 && errno != EINTR)
+        {
+            lerror("poll: %s", strerror(errno));
+        }
+        int len = pfd.revents & POLLIN ? read(tree.ifd, buffer, opt->buffer) : 0;
+        if (len < 0)
+        {
+            lerror("read: %s", strerror(errno));
+            continue;
+        }
+
+        int count = 0;
+        uint64_t now = now_ns();
+        while (shift < len)
+        {
+            inotify_event_t *ev = (inotify_event_t *)(buffer + shift);
+            handle_event(&tree, opt, ev, now);
+
+            shift += EVENT_SIZE + ev->len;
+            count++;
+        }
+        if (count > 0)
+        {
+            mt_add(m_events, count);
+            mt_observe(m_batch, count);
+        }
+        coalesce_flush(&tree, &coalesce_s, now);
+        moves_expire(&tree, opt, now);
+    }
+    coalesce_flush(&tree, &coalesce_s, 0);
+    moves_expire(&tree, opt, 0);
+    ifd = tree.ifd;
+    wd = tree.nodes[0].wd; // a resync watches the root again on a new ifd
+
+    int res = 0;
+    if (wd != -1)
+    {
+        linfo("inotify_rm_watch: rm watch %d with mask = %x", wd, opt->mask);
+        res = inotify_rm_watch(ifd, wd);
+    }
     if (res == -1)
     {
         lerror("inotify_rm_watch: %s", strerror(errno));
@@ -319,6 +2143,7 @@ int main(int argc, char *argv[])
     }
 
     close(ifd);
+    dispatch_stop();
     goto END;
 
 ERR:
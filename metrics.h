@@ -0,0 +1,501 @@
+/*
+ metrics registry
+
+ counters, gauges and log-linear histograms registered by name at start
+ up and updated lock-free from any thread. counters and histograms are
+ sharded: every thread writes its own cache line (counters) or its own
+ copy of the buckets (histograms), readers add the shards up.
+
+ mt_start exports the registry in Prometheus text format, refreshed
+ every interval: either rewritten to a file (atomically, through a
+ rename) or, for a target of "unix:/path", served to whoever connects
+ to that unix socket (plain text, or an HTTP response when the peer
+ sends a GET, so curl --unix-socket works). histograms are exported as
+ summaries whose quantiles cover the last interval only, while _sum and
+ _count run since start, so they show the current tail latency.
+
+ the state is static, so every program gets its own registry; link
+ with -lpthread.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MT_MAX         64
+#define MT_SHARDS      64 // counter shards, one cache line each
+#define MT_HIST_SHARDS 16
+
+// log-linear histogram: 2^MT_SUB_BITS linear buckets per power of 2
+#define MT_SUB_BITS  5
+#define MT_SUB_COUNT (1 << MT_SUB_BITS)
+#define MT_BUCKETS   ((64 - MT_SUB_BITS + 1) * MT_SUB_COUNT)
+
+enum { MT_COUNTER, MT_GAUGE, MT_HISTOGRAM };
+
+struct mt_hist
+{
+    unsigned long long counts[MT_BUCKETS];
+    unsigned long long total;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+};
+
+struct mt_cell
+{
+    unsigned long long v;
+} __attribute__((aligned(64)));
+
+struct metric
+{
+    int type;
+    const char *name;
+    const char *help;
+    double scale;             // histogram values are exported times this
+    struct mt_cell *cells;    // counter shards
+    long long gauge;
+    struct mt_hist *shards;   // histogram shards
+    struct mt_hist *last;     // histogram at the previous export
+};
+
+static struct {
+    struct metric *list[MT_MAX];
+    int count;
+    int next_shard;
+    pthread_mutex_t lock;
+    pthread_t tid;
+    char *text;               // latest export
+    size_t len;
+} mt_reg = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread int mt_shard_id = -1;
+
+static inline int mt_shard()
+{
+    if (mt_shard_id < 0)
+        mt_shard_id = __atomic_fetch_add(&mt_reg.next_shard, 1, __ATOMIC_RELAXED);
+    return mt_shard_id;
+}
+
+/*
+ plain histograms, for a single writer
+ */
+static inline int mt_hist_index(unsigned long long v)
+{
+    if (v < MT_SUB_COUNT)
+        return v;
+    int exp = 63 - __builtin_clzll(v);        // v in [2^exp, 2^(exp+1))
+    int shift = exp - MT_SUB_BITS;
+    int sub = (v >> shift) & (MT_SUB_COUNT - 1);
+    return (shift + 1) * MT_SUB_COUNT + sub;
+}
+
+// lowest value that lands in bucket idx
+static inline unsigned long long mt_hist_value(int idx)
+{
+    if (idx < MT_SUB_COUNT)
+        return idx;
+    int shift = idx / MT_SUB_COUNT - 1;
+    int sub = idx % MT_SUB_COUNT;
+    return (unsigned long long)(MT_SUB_COUNT + sub) << shift;
+}
+
+static inline void mt_hist_record(struct mt_hist *h, unsigned long long v)
+{
+    h->counts[mt_hist_index(v)]++;
+    if (h->total == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->total++;
+    h->sum += v;
+}
+
+static inline void mt_hist_merge(struct mt_hist *to, const struct mt_hist *from)
+{
+    int i;
+    if (from->total == 0)
+        return;
+    for (i = 0; i < MT_BUCKETS; ++i)
+        to->counts[i] += from->counts[i];
+    if (to->total == 0 || from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+    to->total += from->total;
+    to->sum += from->sum;
+}
+
+static inline unsigned long long mt_hist_percentile(const struct mt_hist *h, double pct)
+{
+    unsigned long long want = (unsigned long long)(h->total * pct / 100.0 + 0.5);
+    unsigned long long seen = 0;
+    int i;
+
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < MT_BUCKETS; ++i)
+    {
+        seen += h->counts[i];
+        if (seen >= want)
+            return mt_hist_value(i) > h->max ? h->max : mt_hist_value(i);
+    }
+    return h->max;
+}
+
+/*
+ registry
+ */
+static inline struct metric *mt_register(int type, const char *name, const char *help, double scale)
+{
+    struct metric *m = calloc(1, sizeof(struct metric));
+    if (m == NULL)
+        return NULL;
+    m->type = type;
+    m->name = name;
+    m->help = help;
+    m->scale = scale;
+    if (type == MT_COUNTER)
+        m->cells = aligned_alloc(64, MT_SHARDS * sizeof(struct mt_cell));
+    if (type == MT_HISTOGRAM)
+    {
+        m->shards = calloc(MT_HIST_SHARDS, sizeof(struct mt_hist));
+        m->last = calloc(1, sizeof(struct mt_hist));
+    }
+    if ((type == MT_COUNTER && m->cells == NULL) ||
+        (type == MT_HISTOGRAM && (m->shards == NULL || m->last == NULL)))
+        goto fail;
+    if (m->cells != NULL)
+        memset(m->cells, 0, MT_SHARDS * sizeof(struct mt_cell));
+
+    pthread_mutex_lock(&mt_reg.lock);
+    if (mt_reg.count == MT_MAX)
+    {
+        pthread_mutex_unlock(&mt_reg.lock);
+        goto fail;
+    }
+    mt_reg.list[mt_reg.count++] = m;
+    pthread_mutex_unlock(&mt_reg.lock);
+    return m;
+
+fail:
+    free(m->cells);
+    free(m->shards);
+    free(m->last);
+    free(m);
+    return NULL;
+}
+
+static inline struct metric *mt_counter(const char *name, const char *help)
+{
+    return mt_register(MT_COUNTER, name, help, 1);
+}
+
+static inline struct metric *mt_gauge(const char *name, const char *help)
+{
+    return mt_register(MT_GAUGE, name, help, 1);
+}
+
+// scale converts recorded values to the exported unit, 1e-9 for ns to seconds
+static inline struct metric *mt_histogram(const char *name, const char *help, double scale)
+{
+    return mt_register(MT_HISTOGRAM, name, help, scale);
+}
+
+/*
+ updates, a NULL metric (registration failed) is ignored
+ */
+static inline void mt_add(struct metric *m, unsigned long long n)
+{
+    if (m != NULL)
+        __atomic_add_fetch(&m->cells[mt_shard() % MT_SHARDS].v, n, __ATOMIC_RELAXED);
+}
+
+static inline void mt_set(struct metric *m, long long v)
+{
+    if (m != NULL)
+        __atomic_store_n(&m->gauge, v, __ATOMIC_RELAXED);
+}
+
+static inline void mt_gauge_add(struct metric *m, long long d)
+{
+    if (m != NULL)
+        __atomic_add_fetch(&m->gauge, d, __ATOMIC_RELAXED);
+}
+
+// threads sharing a shard (more than MT_HIST_SHARDS of them) stay exact thanks to the atomics
+static inline void mt_observe(struct metric *m, unsigned long long v)
+{
+    if (m == NULL)
+        return;
+
+    struct mt_hist *h = &m->shards[mt_shard() % MT_HIST_SHARDS];
+    unsigned long long cur;
+
+    __atomic_add_fetch(&h->counts[mt_hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, v, __ATOMIC_RELAXED);
+    cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while ((cur == 0 || v < cur) &&
+           !__atomic_compare_exchange_n(&h->min, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > cur &&
+           !__atomic_compare_exchange_n(&h->max, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&h->total, 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long long mt_count(struct metric *m)
+{
+    unsigned long long sum = 0;
+    int i;
+    for (i = 0; i < MT_SHARDS; i++)
+        sum += __atomic_load_n(&m->cells[i].v, __ATOMIC_RELAXED);
+    return sum;
+}
+
+// add up the shards of a histogram metric
+static inline void mt_snapshot(struct metric *m, struct mt_hist *out)
+{
+    int i, j;
+
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < MT_HIST_SHARDS; i++)
+    {
+        struct mt_hist *h = &m->shards[i];
+        unsigned long long total = __atomic_load_n(&h->total, __ATOMIC_ACQUIRE);
+        if (total == 0)
+            continue;
+        for (j = 0; j < MT_BUCKETS; j++)
+            out->counts[j] += __atomic_load_n(&h->counts[j], __ATOMIC_RELAXED);
+        if (out->total == 0 || h->min < out->min)
+            out->min = h->min;
+        if (h->max > out->max)
+            out->max = h->max;
+        out->total += total;
+        out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ export
+ */
+static inline void mt_render_hist(FILE *fp, struct metric *m)
+{
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    struct mt_hist *now = malloc(sizeof(struct mt_hist));
+    int i;
+
+    if (now == NULL)
+        return;
+    mt_snapshot(m, now);
+
+    // the window is what was recorded since the previous export
+    for (i = 0; i < MT_BUCKETS; i++)
+    {
+        unsigned long long c = now->counts[i];
+        now->counts[i] -= m->last->counts[i];
+        m->last->counts[i] = c;
+    }
+    unsigned long long total = now->total;
+    now->total -= m->last->total;
+    m->last->total = total;
+    m->last->sum = now->sum;
+
+    for (i = 0; i < (int)(sizeof(qs) / sizeof(qs[0])); i++)
+        fprintf(fp, "%s{quantile=\"%g\"} %.9g\n", m->name, qs[i],
+                now->total ? mt_hist_percentile(now, qs[i] * 100) * m->scale : 0);
+    fprintf(fp, "%s_sum %.9g\n", m->name, m->last->sum * m->scale);
+    fprintf(fp, "%s_count %llu\n", m->name, m->last->total);
+    free(now);
+}
+
+// render the whole registry into mt_reg.text
+static inline void mt_render()
+{
+    static const char *types[] = { "counter", "gauge", "summary" };
+    char *text = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&text, &len);
+    int i, count;
+
+    if (fp == NULL)
+        return;
+    pthread_mutex_lock(&mt_reg.lock);
+    count = mt_reg.count;
+    pthread_mutex_unlock(&mt_reg.lock);
+
+    for (i = 0; i < count; i++)
+    {
+        struct metric *m = mt_reg.list[i];
+        fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, types[m->type]);
+        if (m->type == MT_COUNTER)
+            fprintf(fp, "%s %llu\n", m->name, mt_count(m));
+        else if (m->type == MT_GAUGE)
+            fprintf(fp, "%s %lld\n", m->name, __atomic_load_n(&m->gauge, __ATOMIC_RELAXED));
+        else
+            mt_render_hist(fp, m);
+    }
+    fclose(fp);
+
+    free(mt_reg.text);
+    mt_reg.text = text;
+    mt_reg.len = len;
+}
+
+static inline void mt_write_file(const char *path)
+{
+    char tmp[4096];
+    FILE *fp;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (fp == NULL)
+        return;
+    fwrite(mt_reg.text, 1, mt_reg.len, fp);
+    if (fclose(fp) == 0)
+        rename(tmp, path);
+}
+
+static inline void mt_serve_conn(int fd)
+{
+    static const char hdr[] = "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n\r\n";
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    char req[512];
+    size_t off = 0;
+    ssize_t n;
+
+    // a client that sends nothing within 100ms gets the bare text
+    if (poll(&pfd, 1, 100) == 1 && recv(fd, req, sizeof(req), MSG_DONTWAIT) >= 3 &&
+        memcmp(req, "GET", 3) == 0)
+        send(fd, hdr, sizeof(hdr) - 1, MSG_NOSIGNAL);
+    while (off < mt_reg.len)
+    {
+        n = send(fd, mt_reg.text + off, mt_reg.len - off, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    close(fd);
+}
+
+struct mt_target
+{
+    char *path;
+    int unix_sock;            // -1 when writing a file
+    unsigned int interval_ms;
+};
+
+static inline void *mt_exporter(void *arg)
+{
+    struct mt_target *t = arg;
+    struct timespec next, now;
+    sigset_t all;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1)
+    {
+        mt_render();
+        if (t->unix_sock == -1)
+            mt_write_file(t->path);
+
+        next.tv_sec += t->interval_ms / 1000;
+        next.tv_nsec += (t->interval_ms % 1000) * 1000000L;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        if (t->unix_sock == -1)
+        {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            continue;
+        }
+
+        // serve scrapes until the next refresh is due
+        while (1)
+        {
+            struct pollfd pfd = { .fd = t->unix_sock, .events = POLLIN };
+            long ms;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ms = (next.tv_sec - now.tv_sec) * 1000 + (next.tv_nsec - now.tv_nsec) / 1000000;
+            if (ms <= 0)
+                break;
+            if (poll(&pfd, 1, ms) == 1)
+            {
+                int fd = accept(t->unix_sock, NULL, NULL);
+                if (fd != -1)
+                    mt_serve_conn(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+// target is a file path or "unix:/path/to/socket". returns -1 with errno set on failure
+static inline int mt_start(const char *target, unsigned int interval_ms)
+{
+    struct mt_target *t = calloc(1, sizeof(struct mt_target));
+    if (t == NULL)
+        return -1;
+    t->interval_ms = interval_ms ? interval_ms : 1000;
+    t->unix_sock = -1;
+
+    if (strncmp(target, "unix:", 5) == 0)
+    {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        t->path = strdup(target + 5);
+        if (t->path == NULL || strlen(t->path) >= sizeof(addr.sun_path))
+        {
+            errno = ENAMETOOLONG;
+            goto fail;
+        }
+        strcpy(addr.sun_path, t->path);
+        unlink(t->path);
+        t->unix_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (t->unix_sock == -1 ||
+            bind(t->unix_sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(t->unix_sock, 16) == -1)
+            goto fail;
+    }
+    else
+    {
+        t->path = strdup(target);
+        if (t->path == NULL)
+            goto fail;
+    }
+
+    int ret = pthread_create(&mt_reg.tid, NULL, mt_exporter, t);
+    if (ret != 0)
+    {
+        errno = ret;
+        goto fail;
+    }
+    pthread_detach(mt_reg.tid);
+    return 0;
+
+fail:
+    if (t->unix_sock != -1)
+        close(t->unix_sock);
+    free(t->path);
+    free(t);
+    return -1;
+}
+
+#endif
@@ -7,104 +7,604 @@
  *			  When os is installed, the first 512 bytes would not be 0
  *			  since main boot record(MBR) is written.
  *			  Additionally, content of the last 2 bytes of the bootsector is 0xaa55
+ *
+ *			  Takes any number of devices, images or globs ("/dev/sd*") and
+ *			  scans them on a pool of threads. For each one it reads the MBR
+ *			  partition table (logical partitions too) and the GPT header and
+ *			  entries, checks both GPT CRC32s and falls back to the backup
+ *			  header when the primary one is bad. One JSON object per disk is
+ *			  printed, in the order given; problems go into its "error".
+ *			  The first read of a disk is SCAN_READ bytes, which covers the
+ *			  MBR, the GPT header and 128 entries, so a disk is usually one pread.
  */
+#define _GNU_SOURCE // open_memstream
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> // BLKSSZGET, BLKGETSIZE64
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
-
-#define linfo(...) do {\
-	printf("[INFO] "); \
-	printf(__VA_ARGS__); \
-	printf("\n"); \
-} while(0)
-
-#define lerror(...) do {\
-	printf("[ERROR] "); \
-	printf(__VA_ARGS__); \
-	printf("\n"); \
-} while(0)
+#include <getopt.h>
+#include <glob.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "clog.h"
 
 void usage()
 {
-	linfo("usage: osinstall disk");
-}	
+	linfo("usage: osinstall [-j threads] disk|image|glob ...");
+}
 
 #define OFFSET 		510
-#define CHECK_LEN	2                  
+#define SCAN_READ	(64 * 1024)     // first read of every disk
+#define MAX_THREADS	256
+#define MAX_LOGICAL	128             // logical partitions followed in an extended one
+#define MAX_GPT_ENTRIES	(1 << 20)   // bytes of GPT entries we are willing to read
+
+#define GPT_SIGNATURE	"EFI PART"
+#define GPT_MIN_HEADER	92
 
-// check whether the sector is finished with 0xaa55
-int check_boot_sector(const char* dev)
+struct disk
 {
-	assert(dev);
-	char buf[CHECK_LEN] = {0};
-	unsigned short valid_end = 0xaa55;
-	unsigned short got_end = 0;
+	const char *dev;
+	int fd;
+	unsigned long long size;    // bytes, 0 if unknown
+	unsigned int ss;            // logical sector size
+	unsigned char *buf;         // the first SCAN_READ bytes
+	size_t len;
+	char *error;                // set on the first thing that went wrong
+	int failed;
+	char *json;                 // the result line
+	size_t json_len;
+};
 
-	int fd = open(dev, O_RDONLY);
-	if (fd < 0)
+struct scan
+{
+	struct disk *disks;
+	int ndisks;
+	int next;                   // next disk to take, atomic
+};
+
+static unsigned int crc32_table[256];
+
+// the IEEE 802.3 polynomial, reflected, as GPT uses it
+void crc32_init()
+{
+	unsigned int i, j, c;
+	for (i = 0; i < 256; i++)
 	{
-		lerror("open %s failed: %s", dev, strerror(errno));
-		return -1;
+		c = i;
+		for (j = 0; j < 8; j++)
+		{
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc32_table[i] = c;
 	}
+}
 
-	off_t offset = lseek(fd, OFFSET, SEEK_SET);
-	if (offset == -1)
+unsigned int crc32(const unsigned char *p, size_t len)
+{
+	unsigned int c = 0xffffffff;
+	while (len--)
 	{
-		lerror("lseek %s failed: %s", dev, strerror(errno));
-		return -1;
+		c = crc32_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+	}
+	return c ^ 0xffffffff;
+}
+
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static unsigned long long le64(const unsigned char *p)
+{
+	return le32(p) | (unsigned long long)le32(p + 4) << 32;
+}
+
+void set_error(struct disk *d, const char *what, int err)
+{
+	char buf[256];
+	if (d->error != NULL)
+	{
+		return;
+	}
+	if (err != 0)
+	{
+		snprintf(buf, sizeof(buf), "%s: %s", what, strerror(err));
+	}
+	else
+	{
+		snprintf(buf, sizeof(buf), "%s", what);
+	}
+	d->error = strdup(buf);
+}
+
+// len bytes at off, out of the first read when it has them
+int read_at(struct disk *d, unsigned long long off, size_t len, unsigned char *dst)
+{
+	size_t done = 0;
+	if (off + len <= d->len)
+	{
+		memcpy(dst, d->buf + off, len);
+		return 0;
+	}
+	while (done < len)
+	{
+		ssize_t n = pread(d->fd, dst + done, len - done, off + done);
+		if (n == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n == 0)
+		{
+			errno = EIO; /* past the end of the image */
+		}
+		if (n <= 0)
+		{
+			return -1;
+		}
+		done += n;
 	}
+	return 0;
+}
 
-	ssize_t res = read(fd, buf, CHECK_LEN);
-	if (res < 0)
+void json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++)
 	{
-		lerror("read %s failed: %s", dev, strerror(errno));
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+		{
+			fprintf(out, "\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			fprintf(out, "\\u%04x", c);
+		}
+		else
+		{
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+// GUIDs keep their first three fields little endian
+void json_guid(FILE *out, const unsigned char *g)
+{
+	fprintf(out, "\"%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X\"",
+			le32(g), le16(g + 4), le16(g + 6), g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+// the UTF-16LE partition name, as UTF-8
+void json_utf16(FILE *out, const unsigned char *p, int units)
+{
+	char name[36 * 3 + 1];
+	int i, n = 0;
+	for (i = 0; i < units; i++)
+	{
+		unsigned int c = le16(p + i * 2);
+		if (c == 0)
+		{
+			break;
+		}
+		if (c < 0x80)
+		{
+			name[n++] = c;
+		}
+		else if (c < 0x800)
+		{
+			name[n++] = 0xc0 | c >> 6;
+			name[n++] = 0x80 | (c & 0x3f);
+		}
+		else if (c >= 0xd800 && c < 0xe000)
+		{
+			name[n++] = '?'; // half of a surrogate pair, out of the BMP
+		}
+		else
+		{
+			name[n++] = 0xe0 | c >> 12;
+			name[n++] = 0x80 | (c >> 6 & 0x3f);
+			name[n++] = 0x80 | (c & 0x3f);
+		}
+	}
+	name[n] = '\0';
+	json_string(out, name);
+}
+
+int is_extended(unsigned int type)
+{
+	return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+void mbr_entry(FILE *out, int index, const unsigned char *e, unsigned long long base, int *first)
+{
+	fprintf(out, "%s{\"index\":%d,\"boot\":%s,\"type\":\"0x%02x\",\"start\":%llu,\"sectors\":%u}",
+			*first ? "" : ",", index, e[0] == 0x80 ? "true" : "false", e[4],
+			base + le32(e + 8), le32(e + 12));
+	*first = 0;
+}
+
+// the partition table of the boot sector, and the chain of EBRs of an extended partition
+void scan_mbr(struct disk *d, FILE *out)
+{
+	const unsigned char *mbr = d->buf;
+	unsigned char ebr[512];
+	int i, first = 1, logical = 5;
+
+	fprintf(out, ",\"mbr\":{\"disk_signature\":\"0x%08x\",\"partitions\":[", le32(mbr + 440));
+	for (i = 0; i < 4; i++)
+	{
+		const unsigned char *e = mbr + 446 + i * 16;
+		if (e[4] == 0)
+		{
+			continue;
+		}
+		mbr_entry(out, i + 1, e, 0, &first);
+		if (!is_extended(e[4]))
+		{
+			continue;
+		}
+
+		// each EBR holds one logical partition and a link to the next EBR
+		unsigned long long ext = le32(e + 8), next = ext;
+		int n;
+		for (n = 0; n < MAX_LOGICAL; n++)
+		{
+			if (read_at(d, next * d->ss, sizeof(ebr), ebr) == -1)
+			{
+				set_error(d, "read EBR", errno);
+				break;
+			}
+			if (le16(ebr + OFFSET) != 0xaa55)
+			{
+				break;
+			}
+			if (ebr[446 + 4] != 0)
+			{
+				mbr_entry(out, logical++, ebr + 446, next, &first);
+			}
+			if (ebr[462 + 4] == 0 || le32(ebr + 462 + 8) == 0)
+			{
+				break;
+			}
+			next = ext + le32(ebr + 462 + 8);
+		}
+	}
+	fprintf(out, "]}");
+}
+
+// check the GPT header at lba, 0 if it is good, with the reason in why if not
+int gpt_header(struct disk *d, unsigned long long lba, unsigned char *h, const char **why)
+{
+	unsigned int size, crc;
+
+	if (read_at(d, lba * d->ss, d->ss, h) == -1)
+	{
+		*why = "read failed";
 		return -1;
 	}
+	if (memcmp(h, GPT_SIGNATURE, 8) != 0)
+	{
+		*why = "no signature";
+		return -1;
+	}
+	size = le32(h + 12);
+	if (size < GPT_MIN_HEADER || size > d->ss)
+	{
+		*why = "bad header size";
+		return -1;
+	}
+	crc = le32(h + 16);
+	memset(h + 16, 0, 4);
+	if (crc32(h, size) != crc)
+	{
+		*why = "header crc mismatch";
+		return -1;
+	}
+	if (le64(h + 24) != lba)
+	{
+		*why = "header in the wrong place";
+		return -1;
+	}
+	return 0;
+}
 
-	close(fd);
+void scan_gpt(struct disk *d, FILE *out)
+{
+	unsigned char *h = malloc(d->ss);
+	unsigned char *entries = NULL;
+	const char *why = NULL, *backup_why = NULL, *which = "primary";
+	unsigned long long last = d->size / d->ss - 1;
+	unsigned int num, esize, i;
+	size_t bytes;
+	int first = 1;
 
-	// begin to check
-	memcpy(&got_end, buf, 2);
-	if (got_end == valid_end)
+	if (h == NULL)
 	{
-		return 1;
+		set_error(d, "malloc", ENOMEM);
+		return;
 	}
-	else
+	if (gpt_header(d, 1, h, &why) == -1)
 	{
-		return 0;
+		if (d->size == 0 || gpt_header(d, last, h, &backup_why) == -1)
+		{
+			// a protective MBR is only a promise of a GPT
+			fprintf(out, ",\"gpt\":{\"valid\":false,\"primary\":");
+			json_string(out, why);
+			fprintf(out, "}");
+			free(h);
+			return;
+		}
+		which = "backup";
+	}
+
+	num = le32(h + 80);
+	esize = le32(h + 84);
+	bytes = (size_t)num * esize;
+	fprintf(out, ",\"gpt\":{\"valid\":true,\"header\":\"%s\"", which);
+	if (why != NULL)
+	{
+		fprintf(out, ",\"primary\":");
+		json_string(out, why);
+	}
+	fprintf(out, ",\"disk_guid\":");
+	json_guid(out, h + 56);
+	fprintf(out, ",\"first_usable\":%llu,\"last_usable\":%llu,\"alternate_lba\":%llu,"
+			"\"entries\":%u,\"entry_size\":%u",
+			le64(h + 40), le64(h + 48), le64(h + 32), num, esize);
+
+	if (esize < 128 || esize % 8 != 0 || bytes > MAX_GPT_ENTRIES)
+	{
+		fprintf(out, ",\"entries_crc_ok\":false}");
+		set_error(d, "bad GPT entry array size", 0);
+		free(h);
+		return;
+	}
+	entries = malloc(bytes);
+	if (entries == NULL || read_at(d, le64(h + 72) * d->ss, bytes, entries) == -1)
+	{
+		fprintf(out, ",\"entries_crc_ok\":false}");
+		set_error(d, "read GPT entries", entries == NULL ? ENOMEM : errno);
+		free(entries);
+		free(h);
+		return;
 	}
+	fprintf(out, ",\"entries_crc_ok\":%s,\"partitions\":[",
+			crc32(entries, bytes) == le32(h + 88) ? "true" : "false");
+	for (i = 0; i < num; i++)
+	{
+		const unsigned char *e = entries + (size_t)i * esize;
+		static const unsigned char unused[16];
+		if (memcmp(e, unused, 16) == 0)
+		{
+			continue;
+		}
+		fprintf(out, "%s{\"index\":%u,\"type\":", first ? "" : ",", i + 1);
+		json_guid(out, e);
+		fprintf(out, ",\"guid\":");
+		json_guid(out, e + 16);
+		fprintf(out, ",\"first\":%llu,\"last\":%llu,\"attributes\":\"0x%016llx\",\"name\":",
+				le64(e + 32), le64(e + 40), le64(e + 48));
+		json_utf16(out, e + 56, 36);
+		fprintf(out, "}");
+		first = 0;
+	}
+	fprintf(out, "]}");
+	free(entries);
+	free(h);
 }
 
-void check_has_install_os(const char* dev)
+void scan_disk(struct disk *d)
 {
-	assert(dev);
-	int res = check_boot_sector(dev);
-	if (res == 1)
+	FILE *out = open_memstream(&d->json, &d->json_len);
+	struct timespec start, end;
+	struct stat st;
+	ssize_t n;
+	int i, gpt = 0;
+
+	assert(out);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fprintf(out, "{\"device\":");
+	json_string(out, d->dev);
+
+	d->ss = 512;
+	d->fd = open(d->dev, O_RDONLY | O_CLOEXEC);
+	if (d->fd == -1)
 	{
-		linfo("disk [%s] has os installed on it", dev);
+		set_error(d, "open", errno);
+		goto END;
 	}
-	else if (res == 0)
+	if (fstat(d->fd, &st) == -1)
 	{
-		linfo("disk [%s] has not os installed on it", dev);
+		set_error(d, "fstat", errno);
+		goto END;
+	}
+	if (S_ISBLK(st.st_mode))
+	{
+		int ss = 0;
+		if (ioctl(d->fd, BLKSSZGET, &ss) == 0 && ss >= 512)
+		{
+			d->ss = ss;
+		}
+		if (ioctl(d->fd, BLKGETSIZE64, &d->size) == -1)
+		{
+			d->size = 0;
+		}
 	}
 	else
 	{
-		lerror("check disk [%s] failed", dev);
+		d->size = st.st_size;
+	}
+
+	d->buf = malloc(SCAN_READ);
+	if (d->buf == NULL)
+	{
+		set_error(d, "malloc", ENOMEM);
+		goto END;
+	}
+	while ((n = pread(d->fd, d->buf, SCAN_READ, 0)) == -1 && errno == EINTR)
+	{
+	}
+	if (n < 512)
+	{
+		set_error(d, n == -1 ? "read" : "shorter than a sector", n == -1 ? errno : 0);
+		goto END;
+	}
+	d->len = n;
+	// an image has no sector size of its own, look for the GPT header at 4096 too
+	if (!S_ISBLK(st.st_mode) && d->len >= 4096 + 8 &&
+		memcmp(d->buf + 512, GPT_SIGNATURE, 8) != 0 && memcmp(d->buf + 4096, GPT_SIGNATURE, 8) == 0)
+	{
+		d->ss = 4096;
+	}
+
+	fprintf(out, ",\"size\":%llu,\"sector_size\":%u", d->size, d->ss);
+	// the original check: an installed os leaves 0xaa55 at the end of the boot sector
+	if (le16(d->buf + OFFSET) != 0xaa55)
+	{
+		fprintf(out, ",\"boot_signature\":false,\"scheme\":\"none\"");
+		goto END;
 	}
+	for (i = 0; i < 4; i++)
+	{
+		gpt |= d->buf[446 + i * 16 + 4] == 0xee;
+	}
+	fprintf(out, ",\"boot_signature\":true,\"scheme\":\"%s\"", gpt ? "gpt" : "mbr");
+	scan_mbr(d, out);
+	if (gpt)
+	{
+		scan_gpt(d, out);
+	}
+
+END:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (d->error != NULL)
+	{
+		fprintf(out, ",\"error\":");
+		json_string(out, d->error);
+		d->failed = 1;
+	}
+	fprintf(out, ",\"ms\":%.3f}\n",
+			(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	fclose(out);
+	if (d->fd != -1)
+	{
+		close(d->fd);
+	}
+	free(d->buf);
+	free(d->error);
 }
 
-int main(int argc, char const *argv[])
+void *scan_thread(void *arg)
 {
-	if (argc != 2)
+	struct scan *s = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->ndisks)
+	{
+		scan_disk(&s->disks[i]);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tids[MAX_THREADS];
+	struct timespec start, end;
+	struct scan s = { NULL, 0, 0 };
+	glob_t g;
+	size_t i;
+	int c, threads = 0, started = 0, failed = 0;
+
+	while ((c = getopt(argc, argv, "j:h")) != -1)
+	{
+		switch (c)
+		{
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1 || threads > MAX_THREADS)
+			{
+				lerror("threads should be in [1, %d], got %s", MAX_THREADS, optarg);
+				return -1;
+			}
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	if (optind >= argc)
 	{
 		usage();
 		return -1;
 	}
 
-	char *dev = (char*)argv[1];
-	check_has_install_os(dev);
-}
\ No newline at end of file
+	// a pattern that matches nothing stays as it is, and fails to open
+	memset(&g, 0, sizeof(g));
+	for (c = optind; c < argc; c++)
+	{
+		if (glob(argv[c], GLOB_NOCHECK | (c > optind ? GLOB_APPEND : 0), NULL, &g) != 0)
+		{
+			lerror("glob %s failed", argv[c]);
+			return -1;
+		}
+	}
+
+	s.ndisks = g.gl_pathc;
+	s.disks = calloc(s.ndisks, sizeof(struct disk));
+	if (s.disks == NULL)
+	{
+		lerror("malloc %d disks", s.ndisks);
+		return -1;
+	}
+	for (i = 0; i < g.gl_pathc; i++)
+	{
+		s.disks[i].dev = g.gl_pathv[i];
+		s.disks[i].fd = -1;
+	}
+	crc32_init();
+
+	// the time goes into waiting on the disks, not the cpu
+	if (threads == 0)
+	{
+		threads = s.ndisks < 64 ? s.ndisks : 64;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (c = 1; c < threads; c++)
+	{
+		if (pthread_create(&tids[started], NULL, scan_thread, &s) == 0)
+		{
+			started++;
+		}
+	}
+	scan_thread(&s);
+	for (c = 0; c < started; c++)
+	{
+		pthread_join(tids[c], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < g.gl_pathc; i++)
+	{
+		fwrite(s.disks[i].json, 1, s.disks[i].json_len, stdout);
+		failed += s.disks[i].failed;
+		free(s.disks[i].json);
+	}
+	fflush(stdout);
+	ldebug("scanned %d disks in %.3f s with %d threads, %d failed", s.ndisks,
+		   end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9, started + 1, failed);
+	free(s.disks);
+	globfree(&g);
+	return failed > 0 ? 1 : 0;
+}
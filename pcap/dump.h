@@ -0,0 +1,299 @@
+/*
+ capture to disk
+
+ the capture thread packs pcap records straight into large aligned
+ blocks, and a writer thread of its own puts them on disk with O_DIRECT,
+ so the page cache, writeback and a slow disk never stall the capture.
+ the blocks form a single-producer single-consumer ring: the producer
+ fills the block at head and publishes it, the writer writes the block
+ at tail and hands it back. when every block is still waiting for the
+ disk, packets are dropped and counted rather than blocking.
+
+ O_DIRECT wants aligned file offsets, so a block starts at the last
+ DUMP_ALIGN boundary of the one before it and repeats its unaligned
+ tail (less than DUMP_ALIGN bytes). every write is rounded up, and the
+ file is cut to its real size when it is closed.
+
+ files rotate when they reach max_size bytes or max_secs of packet
+ time; then each one gets a number, path.N, or path.W.N with several
+ workers. prealloc reserves max_size with fallocate when a file is
+ opened.
+ */
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../clog.h"
+#include "../spsc.h"
+
+#define DUMP_BLOCK (4 << 20)   // bytes per write
+#define DUMP_QUEUE 16          // blocks per writer
+#define DUMP_ALIGN 4096
+#define DUMP_FLUSH_NS 1000000000ULL // a partly filled block goes out after this long
+
+// file header linktypes, these differ from the DLT_ values for raw IP
+#define DUMP_LINK_ETH 1
+#define DUMP_LINK_RAW 101
+#define DUMP_LINK_SLL 113
+
+struct dump_block
+{
+    unsigned char *buf;
+    size_t len;
+    unsigned long long off;  // file offset of buf[0], aligned
+    unsigned int seq;        // which file
+};
+
+struct dump
+{
+    // set before dump_start
+    const char *path;
+    int id;                  // worker, -1 if it is the only one
+    unsigned long long max_size; // 0 for no limit
+    unsigned int max_secs;
+    int prealloc;
+    unsigned int snaplen;
+    unsigned int linktype;
+
+    struct dump_block blocks[DUMP_QUEUE];
+    struct spsc q;           // head is the next block to fill, tail the next to write
+
+    // producer
+    struct dump_block *cur __attribute__((aligned(64)));
+    unsigned long long next_off;
+    size_t carry;            // bytes at the start of cur already in the previous block
+    unsigned int seq;
+    unsigned long long file_start; // packet ns
+    unsigned long long last_push;  // ns
+    unsigned long long dropped;
+    unsigned long long written;    // record bytes
+
+    // writer
+    pthread_t tid;
+    int fd;
+    unsigned int fd_seq;
+    unsigned long long fd_size;
+    unsigned long long errors;
+};
+
+static inline void dump_name(const struct dump *d, unsigned int seq, char *name, size_t size)
+{
+    int rotate = d->max_size > 0 || d->max_secs > 0;
+
+    if (d->id >= 0 && rotate)
+        snprintf(name, size, "%s.%d.%u", d->path, d->id, seq);
+    else if (d->id >= 0)
+        snprintf(name, size, "%s.%d", d->path, d->id);
+    else if (rotate)
+        snprintf(name, size, "%s.%u", d->path, seq);
+    else
+        snprintf(name, size, "%s", d->path);
+}
+
+static inline void dump_close_file(struct dump *d)
+{
+    if (d->fd == -1)
+        return;
+    if (ftruncate(d->fd, d->fd_size) == -1)
+        lerror("dump truncate %s", strerror(errno));
+    close(d->fd);
+    d->fd = -1;
+}
+
+static inline void dump_open_file(struct dump *d, unsigned int seq)
+{
+    char name[4096];
+
+    dump_close_file(d);
+    dump_name(d, seq, name, sizeof(name));
+    d->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if (d->fd == -1 && errno == EINVAL)
+    {
+        // tmpfs and some network filesystems have no O_DIRECT
+        lwarn_rl(1, 1, "%s does not take O_DIRECT, writing through the page cache", name);
+        d->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (d->fd == -1)
+        lerror_exit("open %s %s", name, strerror(errno));
+    if (d->prealloc && d->max_size > 0 && fallocate(d->fd, 0, 0, d->max_size) == -1)
+        lwarn_rl(1, 1, "fallocate %s %s", name, strerror(errno));
+    d->fd_seq = seq;
+    d->fd_size = 0;
+    ldebug("dump to %s", name);
+}
+
+static inline void dump_write(struct dump *d, struct dump_block *b)
+{
+    size_t len = (b->len + DUMP_ALIGN - 1) & ~(size_t)(DUMP_ALIGN - 1);
+    size_t done = 0;
+
+    if (d->fd == -1 || b->seq != d->fd_seq)
+        dump_open_file(d, b->seq);
+    // the padding past len is overwritten by the next block or cut at close
+    memset(b->buf + b->len, 0, len - b->len);
+    while (done < len)
+    {
+        ssize_t n = pwrite(d->fd, b->buf + done, len - done, b->off + done);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            d->errors++;
+            lerror_rl(1, 1, "dump write %s", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    d->fd_size = b->off + b->len;
+}
+
+static inline void *dump_writer(void *arg)
+{
+    struct dump *d = arg;
+
+    while (spsc_wait(&d->q))
+    {
+        dump_write(d, &d->blocks[d->q.tail % DUMP_QUEUE]);
+        spsc_pop(&d->q);
+    }
+    dump_close_file(d);
+    return NULL;
+}
+
+// take the next free block, returns -1 if the writer has all of them
+static inline int dump_acquire(struct dump *d)
+{
+    unsigned int head = d->q.head;
+    struct dump_block *b;
+
+    if (spsc_room(&d->q, DUMP_QUEUE) == 0)
+        return -1;
+    b = &d->blocks[head % DUMP_QUEUE];
+    b->off = d->next_off;
+    b->seq = d->seq;
+    b->len = d->carry;
+    if (d->carry > 0)
+    {
+        const struct dump_block *prev = &d->blocks[(head - 1) % DUMP_QUEUE];
+        memcpy(b->buf, prev->buf + prev->len - d->carry, d->carry);
+    }
+    else if (b->off == 0)
+    {
+        // a new file starts with the pcap header, nanosecond timestamps
+        unsigned int h[6] = { 0xa1b23c4d, 2 | 4 << 16, 0, 0, d->snaplen, d->linktype };
+        memcpy(b->buf, h, sizeof(h));
+        b->len = sizeof(h);
+    }
+    d->cur = b;
+    return 0;
+}
+
+// hand cur to the writer, the next block picks up its unaligned tail
+static inline void dump_push(struct dump *d, unsigned long long now)
+{
+    struct dump_block *b = d->cur;
+
+    d->cur = NULL;
+    d->last_push = now;
+    d->next_off = b->off + (b->len & ~(size_t)(DUMP_ALIGN - 1));
+    d->carry = b->len & (DUMP_ALIGN - 1);
+    spsc_push(&d->q);
+}
+
+static inline void dump_rotate(struct dump *d, unsigned long long ts)
+{
+    if (d->cur != NULL)
+        dump_push(d, d->last_push);
+    d->seq++;
+    d->next_off = 0;
+    d->carry = 0;
+    d->file_start = ts;
+}
+
+// append one record, ts in ns
+static inline void dump_packet(struct dump *d, unsigned long long ts, unsigned int caplen,
+                               unsigned int len, const unsigned char *data)
+{
+    unsigned int h[4];
+    size_t need = sizeof(h) + caplen;
+    unsigned long long size = d->next_off + (d->cur ? d->cur->len : d->carry);
+
+    if (d->file_start == 0)
+        d->file_start = ts;
+    if (d->max_secs > 0 && ts - d->file_start >= d->max_secs * 1000000000ULL)
+        dump_rotate(d, ts);
+    else if (d->max_size > 0 && size > 24 && size + need > d->max_size)
+        dump_rotate(d, ts); // a file gets at least one packet, however big
+    if (d->cur != NULL && d->cur->len + need > DUMP_BLOCK)
+        dump_push(d, d->last_push);
+    if (d->cur == NULL && dump_acquire(d) == -1)
+    {
+        d->dropped++;
+        return;
+    }
+    if (need > DUMP_BLOCK - d->cur->len)
+    {
+        d->dropped++; // only if the snaplen is close to the block size
+        return;
+    }
+
+    h[0] = ts / 1000000000ULL;
+    h[1] = ts % 1000000000ULL;
+    h[2] = caplen;
+    h[3] = len;
+    memcpy(d->cur->buf + d->cur->len, h, sizeof(h));
+    memcpy(d->cur->buf + d->cur->len + sizeof(h), data, caplen);
+    d->cur->len += need;
+    d->written += need;
+}
+
+// push a partly filled block that has waited long enough, now in ns
+static inline void dump_flush(struct dump *d, unsigned long long now)
+{
+    if (d->last_push == 0)
+        d->last_push = now;
+    if (d->cur != NULL && d->cur->len > d->carry && now - d->last_push >= DUMP_FLUSH_NS)
+        dump_push(d, now);
+}
+
+static inline int dump_start(struct dump *d)
+{
+    int i, ret;
+
+    for (i = 0; i < DUMP_QUEUE; ++i)
+    {
+        d->blocks[i].buf = aligned_alloc(DUMP_ALIGN, DUMP_BLOCK);
+        if (d->blocks[i].buf == NULL)
+            return -1;
+    }
+    d->fd = -1;
+    ret = pthread_create(&d->tid, NULL, dump_writer, d);
+    if (ret != 0)
+    {
+        errno = ret;
+        return -1;
+    }
+    return 0;
+}
+
+// write out what is left and wait for the writer
+static inline void dump_stop(struct dump *d)
+{
+    int i;
+
+    if (d->cur != NULL && d->cur->len > d->carry)
+        dump_push(d, d->last_push);
+    spsc_close(&d->q);
+    pthread_join(d->tid, NULL);
+    for (i = 0; i < DUMP_QUEUE; ++i)
+        free(d->blocks[i].buf);
+}
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ flow aggregation
+
+ packets are parsed down to their 5-tuple (Ethernet with up to two VLAN
+ tags, Linux cooked or raw IP; IPv4, IPv6 with its common extension
+ headers; TCP, UDP, anything else without ports) and counted in an
+ open-addressing table with linear probing. entries are 64 bytes, one
+ cache line each, so a lookup is usually one miss. removal shifts the
+ rest of the cluster back instead of leaving tombstones, so the table
+ never needs a rebuild.
+
+ flow_expire hands flows that have been idle for too long, that have run
+ for longer than the active timeout (their counters restart), or that saw
+ a FIN or RST to the export callback and drops them. a table belongs to
+ one thread.
+ */
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define LINK_ETH  0
+#define LINK_RAW  1 // starts with the IP header
+#define LINK_SLL  2 // Linux cooked capture
+
+#define FLOW_END_IDLE   0
+#define FLOW_END_ACTIVE 1
+#define FLOW_END_TCP    2 // FIN or RST seen
+#define FLOW_END_EXIT   3
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+
+struct flow_key
+{
+    unsigned char src[16];  // IPv4 addresses use the first 4 bytes
+    unsigned char dst[16];
+    unsigned short sport;   // host order
+    unsigned short dport;
+    unsigned char proto;
+    unsigned char ver;      // 4 or 6, 0 marks a free slot
+    unsigned short pad;
+} __attribute__((aligned(8)));
+
+struct flow
+{
+    struct flow_key key;    // 40 bytes
+    unsigned int pkts;
+    unsigned char tcp_flags; // every flag seen
+    unsigned char pad[3];
+    unsigned long long bytes;
+    unsigned int first;     // seconds since the table epoch, saves 8 bytes
+    unsigned int last;
+} __attribute__((aligned(64)));
+
+struct flow_table
+{
+    struct flow *slots;
+    unsigned int mask;
+    unsigned int count;
+    unsigned int max;       // stop inserting at this load
+    unsigned long long epoch;  // ns, first/last count from here
+    unsigned long long idle;   // ns
+    unsigned long long active; // ns
+    unsigned long long last_scan;
+    unsigned long long dropped; // new flows that found the table full
+    void (*export)(void *arg, const struct flow *f, unsigned long long epoch, int reason);
+    void *arg;
+};
+
+static inline unsigned int flow_hash(const struct flow_key *k)
+{
+    const unsigned long long *w = (const unsigned long long *)k;
+    unsigned long long h = 0;
+    unsigned int i;
+    for (i = 0; i < sizeof(*k) / 8; i++)
+    {
+        h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h ^ (h >> 32);
+}
+
+static inline int flow_key_eq(const struct flow_key *a, const struct flow_key *b)
+{
+    const unsigned long long *x = (const unsigned long long *)a;
+    const unsigned long long *y = (const unsigned long long *)b;
+    return ((x[0] ^ y[0]) | (x[1] ^ y[1]) | (x[2] ^ y[2]) | (x[3] ^ y[3]) | (x[4] ^ y[4])) == 0;
+}
+
+// parse a packet into k, returns -1 for anything that is not IP
+static inline int flow_parse(int link, const unsigned char *p, unsigned int len,
+                             struct flow_key *k, unsigned char *tcp_flags)
+{
+    const unsigned char *end = p + len;
+    unsigned int type, proto, off;
+    int frag = 0;
+
+    memset(k, 0, sizeof(*k));
+    *tcp_flags = 0;
+
+    switch (link)
+    {
+    case LINK_ETH:
+        if (len < 14)
+            return -1;
+        type = p[12] << 8 | p[13];
+        p += 14;
+        while ((type == 0x8100 || type == 0x88a8) && p + 4 <= end)
+        {
+            type = p[2] << 8 | p[3];
+            p += 4;
+        }
+        break;
+    case LINK_SLL:
+        if (len < 16)
+            return -1;
+        type = p[14] << 8 | p[15];
+        p += 16;
+        break;
+    default:
+        if (len < 1)
+            return -1;
+        type = (p[0] >> 4) == 6 ? 0x86dd : 0x0800;
+        break;
+    }
+
+    if (type == 0x0800)
+    {
+        if (p + 20 > end || (p[0] >> 4) != 4)
+            return -1;
+        off = (p[0] & 0x0f) * 4;
+        proto = p[9];
+        frag = ((p[6] & 0x1f) << 8 | p[7]) != 0; // not the first fragment, no ports
+        k->ver = 4;
+        memcpy(k->src, p + 12, 4);
+        memcpy(k->dst, p + 16, 4);
+        p += off;
+    }
+    else if (type == 0x86dd)
+    {
+        if (p + 40 > end || (p[0] >> 4) != 6)
+            return -1;
+        proto = p[6];
+        k->ver = 6;
+        memcpy(k->src, p + 8, 16);
+        memcpy(k->dst, p + 24, 16);
+        p += 40;
+        // hop-by-hop, routing, fragment and destination options
+        while ((proto == 0 || proto == 43 || proto == 44 || proto == 60) && p + 8 <= end)
+        {
+            if (proto == 44)
+            {
+                frag = ((p[2] << 8 | p[3]) & 0xfff8) != 0;
+                off = 8;
+            }
+            else
+            {
+                off = (p[1] + 1) * 8;
+            }
+            proto = p[0];
+            p += off;
+        }
+    }
+    else
+    {
+        return -1;
+    }
+
+    k->proto = proto;
+    if (frag)
+        return 0;
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && p + 4 <= end)
+    {
+        k->sport = p[0] << 8 | p[1];
+        k->dport = p[2] << 8 | p[3];
+        if (proto == IPPROTO_TCP && p + 14 <= end)
+            *tcp_flags = p[13];
+    }
+    return 0;
+}
+
+static inline int flow_table_init(struct flow_table *t, unsigned int size,
+                                  unsigned long long idle, unsigned long long active)
+{
+    unsigned int cap = 1;
+    while (cap < size)
+        cap <<= 1;
+    t->slots = aligned_alloc(64, (size_t)cap * sizeof(struct flow));
+    if (t->slots == NULL)
+        return -1;
+    memset(t->slots, 0, (size_t)cap * sizeof(struct flow));
+    t->mask = cap - 1;
+    t->count = 0;
+    t->max = cap / 4 * 3;
+    t->epoch = 0;
+    t->idle = idle;
+    t->active = active;
+    t->last_scan = 0;
+    t->dropped = 0;
+    return 0;
+}
+
+static inline void flow_table_free(struct flow_table *t)
+{
+    free(t->slots);
+    t->slots = NULL;
+}
+
+// ts in ns since the epoch
+static inline void flow_update(struct flow_table *t, const struct flow_key *k,
+                               unsigned char tcp_flags, unsigned int bytes, unsigned long long ts)
+{
+    unsigned int i = flow_hash(k) & t->mask;
+    unsigned int now;
+    struct flow *f;
+
+    if (t->epoch == 0)
+        t->epoch = ts - ts % 1000000000ULL;
+    now = ts > t->epoch ? (ts - t->epoch) / 1000000000ULL : 0;
+
+    while (1)
+    {
+        f = &t->slots[i];
+        if (f->key.ver == 0)
+            break;
+        if (flow_key_eq(&f->key, k))
+        {
+            f->pkts++;
+            f->bytes += bytes;
+            f->tcp_flags |= tcp_flags;
+            f->last = now;
+            return;
+        }
+        i = (i + 1) & t->mask;
+    }
+
+    if (t->count >= t->max)
+    {
+        t->dropped++;
+        return;
+    }
+    f->key = *k;
+    f->pkts = 1;
+    f->bytes = bytes;
+    f->tcp_flags = tcp_flags;
+    f->first = f->last = now;
+    t->count++;
+}
+
+// remove slot i and pull the rest of its cluster back into place
+static inline void flow_remove(struct flow_table *t, unsigned int i)
+{
+    unsigned int j = i, home;
+
+    while (1)
+    {
+        j = (j + 1) & t->mask;
+        if (t->slots[j].key.ver == 0)
+            break;
+        home = flow_hash(&t->slots[j].key) & t->mask;
+        // move j to i unless its home lies cyclically in (i, j]
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].key.ver = 0;
+    t->count--;
+}
+
+static inline int flow_reason(const struct flow_table *t, const struct flow *f, unsigned int now)
+{
+    if (f->tcp_flags & (TCP_FIN | TCP_RST))
+        return FLOW_END_TCP;
+    if (now < f->last)
+        return -1;
+    if ((unsigned long long)(now - f->last) * 1000000000ULL >= t->idle)
+        return FLOW_END_IDLE;
+    if ((unsigned long long)(now - f->first) * 1000000000ULL >= t->active)
+        return FLOW_END_ACTIVE;
+    return -1;
+}
+
+/*
+ export what is due at ts (ns since the epoch), at most once a second
+ unless force is set, which also exports everything left.
+ returns how many flows went out
+ */
+static inline unsigned int flow_expire(struct flow_table *t, unsigned long long ts, int force)
+{
+    unsigned int i, now, n = 0;
+
+    if (t->epoch == 0 || ts < t->epoch)
+        return 0;
+    if (!force && ts - t->last_scan < 1000000000ULL)
+        return 0;
+    t->last_scan = ts;
+    now = (ts - t->epoch) / 1000000000ULL;
+
+    for (i = 0; i <= t->mask; )
+    {
+        struct flow *f = &t->slots[i];
+        int reason = f->key.ver == 0 ? -1 : force ? FLOW_END_EXIT : flow_reason(t, f, now);
+
+        if (reason == -1)
+        {
+            i++;
+            continue;
+        }
+        // a flow restarted by the active timeout may have seen nothing since
+        if (f->pkts > 0)
+        {
+            t->export(t->arg, f, t->epoch, reason);
+            n++;
+        }
+        if (reason == FLOW_END_ACTIVE && f->pkts > 0)
+        {
+            // long flows stay, with fresh counters
+            f->pkts = 0;
+            f->bytes = 0;
+            f->tcp_flags = 0;
+            f->first = now;
+            i++;
+            continue;
+        }
+        flow_remove(t, i); // something else may have moved into i, look again
+    }
+    return n;
+}
+
+#endif
@@ -1,7 +1,198 @@
+#define _GNU_SOURCE
 #include <pcap/pcap.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
 #include <errno.h>
+#include <limits.h> // PIPE_BUF
 #include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h> // getopt
+#include <string.h>
 #include "../clog.h"
+#include "../metrics.h"
+#include "flow.h"
+#include "dump.h"
+
+#define ENGINE_RING 0 // AF_PACKET TPACKET_V3 ring
+#define ENGINE_PCAP 1 // libpcap
+#define ENGINE_FILE 2 // read a pcap or pcapng file
+
+#define MAX_WORKERS 64
+#define POLL_MS     100 // how often an idle worker checks for stop
+#define MAX_SNAPLEN 262144 // what libpcap uses for 0
+
+struct args
+{
+    char *dev;                // capture device, the first one pcap finds by default
+    char *file;               // read this file instead of capturing
+    int engine;               // ENGINE_*
+    size_t ring_size;         // ring bytes per worker (libpcap: buffer size)
+    unsigned int block_size;  // ring block, the unit handed over by the kernel
+    unsigned int block_tmo;   // ms before the kernel hands over a partly filled block
+    unsigned int workers;     // fanout sockets or file chunks, one thread each
+    int fanout;               // PACKET_FANOUT_* mode
+    int promisc;
+    unsigned int snaplen;     // bytes kept per packet, 0 for all of it
+    char *filter;             // pcap filter expression, the arguments after the options
+    unsigned long long count; // stop after this many packets, 0 for never
+    unsigned int duration;    // stop after this many seconds, 0 for never
+    char *metrics;            // export metrics to this file or unix:/path
+    unsigned int flows;       // flow table slots per worker, 0 to not aggregate
+    char *flow_file;          // flow records go here, stdout by default (the log then goes to stderr)
+    unsigned int flow_idle;   // s without packets before a flow is exported
+    unsigned int flow_active; // s before a long flow is exported and restarted
+    char *dump;               // write the packets to this file
+    unsigned long long dump_size; // rotate after this many bytes, 0 for never
+    unsigned int dump_secs;   // rotate after this many seconds, 0 for never
+    int dump_prealloc;        // fallocate dump_size for each file
+};
+
+static struct args args_s = {
+    .dev = NULL,
+    .file = NULL,
+    .engine = ENGINE_RING,
+    .ring_size = 64 << 20,
+    .block_size = 1 << 20,
+    .block_tmo = 10,
+    .workers = 0,             // 1 for live capture, a thread per cpu for files
+    .fanout = PACKET_FANOUT_HASH,
+    .promisc = 1,
+    .snaplen = 0,
+    .filter = NULL,
+    .count = 0,
+    .duration = 0,
+    .metrics = NULL,
+    .flows = 0,
+    .flow_file = NULL,
+    .flow_idle = 15,
+    .flow_active = 60,
+    .dump = NULL,
+    .dump_size = 0,
+    .dump_secs = 0,
+    .dump_prealloc = 0,
+};
+
+struct pkt
+{
+    unsigned long long ts; // ns since the epoch
+    unsigned int caplen;
+    unsigned int len;
+    const unsigned char *data;
+};
+
+struct worker
+{
+    pthread_t tid;
+    int id;
+    int fd;                   // ring: AF_PACKET socket
+    unsigned char *map;       // ring: the mmapped blocks
+    struct tpacket_req3 req;
+    pcap_t *handle;           // pcap engine, or a pcapng file
+    const unsigned char *chunk; // file: the records this worker reads
+    const unsigned char *chunk_end;
+    unsigned long long batch_bytes; // pcap engine: the current dispatch call
+    unsigned long long batch_first;
+    unsigned long long batch_last;
+    unsigned long long received; // ring: PACKET_STATISTICS, read by the report loop
+    unsigned long long drops;
+    unsigned long long freezes;
+    int link;                 // LINK_*, what the captured frames start with
+    struct flow_table flows;
+    char *out;                // flow records not written yet
+    size_t out_len;
+    unsigned long long unparsed;
+    unsigned int flows_seen;  // table size and drops last put into metrics
+    unsigned long long flows_dropped;
+    struct dump *dump;        // capture to disk, its own writer thread
+    unsigned long long dump_written; // what last went into metrics
+    unsigned long long dump_dropped;
+};
+
+#define FLOW_OUT_SIZE (64 << 10)
+
+static int flow_fd = STDOUT_FILENO;
+static size_t flow_chunk = 0; // PIPE_BUF when flow_fd is not a regular file
+
+static volatile sig_atomic_t stop = 0;
+static int running = 0;      // file workers not done yet
+
+static struct metric *m_pkts;
+static struct metric *m_bytes;
+static struct metric *m_received;
+static struct metric *m_drops;
+static struct metric *m_ifdrops;
+static struct metric *m_delay;
+static struct metric *m_blocks;
+static struct metric *m_flows;
+static struct metric *m_flows_out;
+static struct metric *m_flows_dropped;
+static struct metric *m_unparsed;
+static struct metric *m_dump_bytes;
+static struct metric *m_dump_dropped;
+
+static void metrics_init(const char *target)
+{
+    m_pkts    = mt_counter("pcap_z_packets_total", "Packets captured.");
+    m_bytes   = mt_counter("pcap_z_bytes_total", "Bytes on the wire of the captured packets.");
+    m_received = mt_gauge("pcap_z_received_packets", "Packets that passed the filter, by the kernel's count.");
+    m_drops   = mt_gauge("pcap_z_dropped_packets", "Packets the kernel dropped because the buffer was full.");
+    m_ifdrops = mt_gauge("pcap_z_if_dropped_packets", "Packets the interface dropped before the filter.");
+    m_delay   = mt_histogram("pcap_z_delay_seconds", "Time from the packet timestamp to the handler.", 1e-9);
+    m_blocks  = mt_histogram("pcap_z_block_packets", "Packets per ring block or pcap_dispatch call.", 1);
+    m_flows   = mt_gauge("pcap_z_flows", "Flows in the tables.");
+    m_flows_out = mt_counter("pcap_z_flows_exported_total", "Flow records written.");
+    m_flows_dropped = mt_counter("pcap_z_flows_dropped_total", "New flows that found the table full.");
+    m_unparsed = mt_counter("pcap_z_unparsed_packets_total", "Packets that are not IP, left out of the flows.");
+    m_dump_bytes = mt_counter("pcap_z_dump_bytes_total", "Record bytes queued for the dump files.");
+    m_dump_dropped = mt_counter("pcap_z_dump_dropped_total", "Packets not written because the disk fell behind.");
+
+    if (target != NULL && mt_start(target, 1000) == -1)
+        lerror_exit("metrics %s %s", target, strerror(errno));
+}
+
+static off_t parse_size(const char *str)
+{
+    char *end = NULL;
+    off_t size = strtoll(str, &end, 10);
+    switch (*end)
+    {
+    case 'k': case 'K': size <<= 10; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'g': case 'G': size <<= 30; break;
+    case '\0': break;
+    default:
+        lerror_exit("bad size %s", str);
+    }
+    return size;
+}
+
+static int fanout_mode(const char *name)
+{
+    static const struct { const char *name; int mode; } modes[] = {
+        { "hash", PACKET_FANOUT_HASH },
+        { "lb", PACKET_FANOUT_LB },
+        { "cpu", PACKET_FANOUT_CPU },
+        { "rollover", PACKET_FANOUT_ROLLOVER },
+        { "rnd", PACKET_FANOUT_RND },
+        { "qm", PACKET_FANOUT_QM },
+    };
+    unsigned int i;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+        if (strcmp(name, modes[i].name) == 0)
+            return modes[i].mode;
+    return -1;
+}
 
 void dump_devs(pcap_if_t *devs)
 {
@@ -13,48 +204,1052 @@ void dump_devs(pcap_if_t *devs)
     }
 }
 
-void handler(u_char *userdata, const struct pcap_pkthdr *pkthdr, const u_char *pkt)
+static void parse_args(int argc, char *argv[])
+{
+    int opt, val;
+    while ((opt = getopt(argc, argv, "i:PR:r:b:T:w:f:ps:c:d:M:lA:o:e:a:W:C:G:F")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            args_s.dev = optarg;
+            break;
+        case 'P':
+            args_s.engine = ENGINE_PCAP;
+            break;
+        case 'R':
+            args_s.engine = ENGINE_FILE;
+            args_s.file = optarg;
+            break;
+        case 'r':
+            args_s.ring_size = parse_size(optarg);
+            break;
+        case 'b':
+            args_s.block_size = parse_size(optarg);
+            if (args_s.block_size < (unsigned int)getpagesize() ||
+                (args_s.block_size & (args_s.block_size - 1)))
+                lerror_exit("block size should be a power of 2 and at least a page, got %s", optarg);
+            break;
+        case 'T':
+            args_s.block_tmo = atoi(optarg);
+            break;
+        case 'w':
+            val = atoi(optarg);
+            if (val < 1 || val > MAX_WORKERS)
+                lerror_exit("workers should be in [1, %d], got %d", MAX_WORKERS, val);
+            args_s.workers = val;
+            break;
+        case 'f':
+            args_s.fanout = fanout_mode(optarg);
+            if (args_s.fanout == -1)
+                lerror_exit("unknown fanout mode %s", optarg);
+            break;
+        case 'p':
+            args_s.promisc = 0;
+            break;
+        case 's':
+            args_s.snaplen = parse_size(optarg);
+            break;
+        case 'c':
+            args_s.count = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            args_s.duration = atoi(optarg);
+            break;
+        case 'M':
+            args_s.metrics = optarg;
+            break;
+        case 'A':
+            args_s.flows = parse_size(optarg);
+            break;
+        case 'o':
+            args_s.flow_file = optarg;
+            break;
+        case 'e':
+            args_s.flow_idle = atoi(optarg);
+            break;
+        case 'a':
+            args_s.flow_active = atoi(optarg);
+            break;
+        case 'W':
+            args_s.dump = optarg;
+            break;
+        case 'C':
+            args_s.dump_size = parse_size(optarg);
+            break;
+        case 'G':
+            args_s.dump_secs = atoi(optarg);
+            break;
+        case 'F':
+            args_s.dump_prealloc = 1;
+            break;
+        case 'l':
+        {
+            char errbuf[PCAP_ERRBUF_SIZE] = {0};
+            pcap_if_t *devs = NULL;
+            if (pcap_findalldevs(&devs, errbuf) < 0)
+                lerror_exit("pcap_findalldevs: %s", errbuf);
+            dump_devs(devs);
+            pcap_freealldevs(devs);
+            exit(0);
+        }
+        default:
+            lerror_exit("unknown opt %c", opt);
+        }
+    }
+
+    // the rest is the filter, as with tcpdump
+    if (optind < argc)
+    {
+        size_t len = 0;
+        for (val = optind; val < argc; ++val)
+            len += strlen(argv[val]) + 1;
+        args_s.filter = calloc(1, len);
+        if (args_s.filter == NULL)
+            lerror_exit("calloc filter");
+        for (val = optind; val < argc; ++val)
+        {
+            if (val > optind)
+                strcat(args_s.filter, " ");
+            strcat(args_s.filter, argv[val]);
+        }
+    }
+
+    if (args_s.ring_size < args_s.block_size)
+        lerror_exit("ring %zu is smaller than a block %u", args_s.ring_size, args_s.block_size);
+    if (args_s.engine == ENGINE_PCAP && args_s.workers > 1)
+        lerror_exit("-w needs the ring engine, libpcap has no fanout");
+    if (args_s.dump_prealloc && args_s.dump_size == 0)
+        lerror_exit("-F preallocates the -C size, give one");
+    if (args_s.workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        args_s.workers = 1;
+        if (args_s.engine == ENGINE_FILE && cpus > 1)
+            args_s.workers = cpus < MAX_WORKERS ? cpus : MAX_WORKERS;
+    }
+
+    if (args_s.dev == NULL && args_s.engine != ENGINE_FILE)
+    {
+        char errbuf[PCAP_ERRBUF_SIZE] = {0};
+        pcap_if_t *devs = NULL;
+        if (pcap_findalldevs(&devs, errbuf) < 0 || devs == NULL)
+            lerror_exit("pcap_findalldevs: %s", errbuf);
+        args_s.dev = strdup(devs->name);
+        pcap_freealldevs(devs);
+    }
+}
+
+static unsigned long long now_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void flow_write(struct worker *w)
+{
+    size_t off = 0;
+    while (off < w->out_len)
+    {
+        size_t len = w->out_len - off;
+        // a pipe only keeps writes of up to PIPE_BUF whole, so the other
+        // workers' lines cannot land in the middle of one of ours
+        if (flow_chunk > 0 && len > flow_chunk)
+        {
+            size_t cut = flow_chunk;
+            while (cut > 0 && w->out[off + cut - 1] != '\n')
+                cut--;
+            len = cut > 0 ? cut : flow_chunk;
+        }
+        ssize_t n = write(flow_fd, w->out + off, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror_rl(1, 1, "write flows %s", strerror(errno));
+            break;
+        }
+        off += n;
+    }
+    w->out_len = 0;
+}
+
+// one csv line per flow, see the header in flow_start
+static void flow_export(void *arg, const struct flow *f, unsigned long long epoch, int reason)
+{
+    static const char *reasons[] = { "idle", "active", "tcp", "exit" };
+    struct worker *w = arg;
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    int af = f->key.ver == 6 ? AF_INET6 : AF_INET;
+
+    if (FLOW_OUT_SIZE - w->out_len < 256)
+        flow_write(w);
+    inet_ntop(af, f->key.src, src, sizeof(src));
+    inet_ntop(af, f->key.dst, dst, sizeof(dst));
+    w->out_len += snprintf(w->out + w->out_len, FLOW_OUT_SIZE - w->out_len,
+                           "%llu,%llu,%u,%s,%u,%s,%u,%u,%llu,0x%02x,%s\n",
+                           epoch / 1000000000ULL + f->first, epoch / 1000000000ULL + f->last,
+                           f->key.proto, src, f->key.sport, dst, f->key.dport,
+                           f->pkts, f->bytes, f->tcp_flags, reasons[reason]);
+}
+
+// export what is due at ts and bring the metrics up to date
+static void flow_tick(struct worker *w, unsigned long long ts, int force)
+{
+    unsigned int n;
+
+    if (args_s.flows == 0)
+        return;
+    n = flow_expire(&w->flows, ts, force);
+    if (n == 0 && !force)
+        return;
+    flow_write(w);
+    mt_add(m_flows_out, n);
+    mt_gauge_add(m_flows, (long long)w->flows.count - w->flows_seen);
+    w->flows_seen = w->flows.count;
+    mt_add(m_flows_dropped, w->flows.dropped - w->flows_dropped);
+    w->flows_dropped = w->flows.dropped;
+    mt_add(m_unparsed, w->unparsed);
+    w->unparsed = 0;
+}
+
+static void dump_metrics(struct worker *w)
+{
+    struct dump *d = w->dump;
+
+    mt_add(m_dump_bytes, d->written - w->dump_written);
+    w->dump_written = d->written;
+    mt_add(m_dump_dropped, d->dropped - w->dump_dropped);
+    w->dump_dropped = d->dropped;
+}
+
+// flush a dump block that has waited too long
+static void dump_tick(struct worker *w, unsigned long long ts)
+{
+    if (w->dump == NULL)
+        return;
+    dump_flush(w->dump, ts);
+    dump_metrics(w);
+}
+
+static void dump_end(struct worker *w)
+{
+    if (w->dump == NULL)
+        return;
+    dump_stop(w->dump);
+    dump_metrics(w);
+    if (w->dump->errors > 0 || w->dump->dropped > 0)
+        lwarn("worker %d dump: %llu write errors, %llu packets dropped",
+              w->id, w->dump->errors, w->dump->dropped);
+}
+
+static void flow_start(struct worker *w)
+{
+    if (args_s.flows == 0)
+        return;
+    if (flow_table_init(&w->flows, args_s.flows, args_s.flow_idle * 1000000000ULL,
+                        args_s.flow_active * 1000000000ULL) == -1)
+        lerror_exit("worker %d flow table of %u %s", w->id, args_s.flows, strerror(errno));
+    w->flows.export = flow_export;
+    w->flows.arg = w;
+    w->out = malloc(FLOW_OUT_SIZE);
+    if (w->out == NULL)
+        lerror_exit("malloc");
+}
+
+static void flow_finish(struct worker *w)
+{
+    if (args_s.flows == 0)
+        return;
+    flow_tick(w, now_ns(CLOCK_REALTIME), 1);
+    flow_table_free(&w->flows);
+    free(w->out);
+}
+
+// everything captured goes through here, a block or a dispatch call at a time
+static void process_packet(struct worker *w, const struct pkt *p)
+{
+    struct flow_key k;
+    unsigned char tcp_flags;
+
+    ltrace("worker %d ts %llu caplen %u len %u", w->id, p->ts, p->caplen, p->len);
+    if (w->dump != NULL)
+        dump_packet(w->dump, p->ts, p->caplen, p->len, p->data);
+    if (args_s.flows == 0)
+        return;
+    if (flow_parse(w->link, p->data, p->caplen, &k, &tcp_flags) == -1)
+    {
+        w->unparsed++;
+        return;
+    }
+    flow_update(&w->flows, &k, tcp_flags, p->len, p->ts);
+}
+
+// account for a batch once instead of per packet
+static void account_batch(struct worker *w, unsigned long long pkts, unsigned long long bytes,
+                          unsigned long long first_ts, unsigned long long last_ts)
+{
+    static unsigned long long total = 0;
+
+    mt_add(m_pkts, pkts);
+    mt_add(m_bytes, bytes);
+    mt_observe(m_blocks, pkts);
+    if (first_ts > 0)
+    {
+        long long delay = now_ns(CLOCK_REALTIME) - first_ts;
+        if (delay >= 0)
+            mt_observe(m_delay, delay);
+    }
+    flow_tick(w, last_ts, 0);
+    dump_tick(w, last_ts);
+    if (args_s.count > 0 && __atomic_add_fetch(&total, pkts, __ATOMIC_RELAXED) >= args_s.count)
+        stop = 1;
+}
+
+/*
+ * TPACKET_V3 ring
+ *
+ * the kernel fills whole blocks of -b bytes in a ring of -r bytes and
+ * hands a block over once it is full or -T ms old. a worker walks every
+ * packet of a block in one go and gives the block back, so there is no
+ * syscall per packet and poll only runs when the ring is empty. with -w
+ * several sockets join one PACKET_FANOUT group and the kernel spreads
+ * packets over them (-f hash keeps a flow on one worker).
+ */
+// frames on ethernet-like devices start with an ethernet header, the rest with IP
+static int ring_link(int fd)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, args_s.dev, IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+        lerror_exit("SIOCGIFHWADDR %s %s", args_s.dev, strerror(errno));
+    switch (ifr.ifr_hwaddr.sa_family)
+    {
+    case ARPHRD_ETHER:
+    case ARPHRD_LOOPBACK:
+        return LINK_ETH;
+    default:
+        return LINK_RAW;
+    }
+}
+
+static bpf_u_int32 dev_netmask()
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    bpf_u_int32 net, mask;
+    if (pcap_lookupnet(args_s.dev, &net, &mask, errbuf) == -1)
+        return PCAP_NETMASK_UNKNOWN;
+    return mask;
+}
+
+/*
+ the filter runs in the kernel before a packet is copied into the ring,
+ and its return value is how many bytes to keep, which is how snaplen
+ works here: an empty expression compiles to just "ret #snaplen".
+ */
+static void ring_filter(struct worker *w)
+{
+    struct bpf_program prog;
+    struct sock_fprog fprog;
+    pcap_t *dead;
+
+    if (args_s.filter == NULL && args_s.snaplen == 0)
+        return;
+    dead = pcap_open_dead(w->link == LINK_ETH ? DLT_EN10MB : DLT_RAW,
+                          args_s.snaplen ? args_s.snaplen : MAX_SNAPLEN);
+    if (dead == NULL)
+        lerror_exit("pcap_open_dead");
+    if (pcap_compile(dead, &prog, args_s.filter ? args_s.filter : "", 1, dev_netmask()) == -1)
+        lerror_exit("filter '%s': %s", args_s.filter, pcap_geterr(dead));
+
+    // struct bpf_insn and struct sock_filter are the same classic BPF instruction
+    fprog.len = prog.bf_len;
+    fprog.filter = (struct sock_filter *)prog.bf_insns;
+    if (setsockopt(w->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == -1)
+        lerror_exit("SO_ATTACH_FILTER %s", strerror(errno));
+    pcap_freecode(&prog);
+    pcap_close(dead);
+}
+
+static void ring_open(struct worker *w)
+{
+    int version = TPACKET_V3;
+    struct sockaddr_ll ll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex = if_nametoindex(args_s.dev),
+    };
+
+    if (ll.sll_ifindex == 0)
+        lerror_exit("no device %s", args_s.dev);
+
+    // protocol 0 receives nothing until bind, so no packet gets past the filter
+    w->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (w->fd == -1)
+        lerror_exit("socket AF_PACKET %s", strerror(errno));
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+        lerror_exit("PACKET_VERSION %s", strerror(errno));
+    w->link = ring_link(w->fd);
+    ring_filter(w);
+
+    w->req.tp_block_size = args_s.block_size;
+    w->req.tp_block_nr = args_s.ring_size / args_s.block_size;
+    w->req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    w->req.tp_frame_nr = w->req.tp_block_size / w->req.tp_frame_size * w->req.tp_block_nr;
+    w->req.tp_retire_blk_tov = args_s.block_tmo;
+    w->req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_RX_RING, &w->req, sizeof(w->req)) == -1)
+        lerror_exit("PACKET_RX_RING %u x %u %s", w->req.tp_block_nr, w->req.tp_block_size, strerror(errno));
+
+    w->map = mmap(NULL, (size_t)w->req.tp_block_size * w->req.tp_block_nr, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, w->fd, 0);
+    if (w->map == MAP_FAILED)
+        lerror_exit("mmap ring %s", strerror(errno));
+
+    if (bind(w->fd, (struct sockaddr *)&ll, sizeof(ll)) == -1)
+        lerror_exit("bind %s %s", args_s.dev, strerror(errno));
+
+    if (args_s.promisc)
+    {
+        struct packet_mreq mr = { .mr_ifindex = ll.sll_ifindex, .mr_type = PACKET_MR_PROMISC };
+        if (setsockopt(w->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) == -1)
+            lerror("PACKET_MR_PROMISC %s", strerror(errno));
+    }
+
+    if (args_s.workers > 1)
+    {
+        int fanout = (getpid() & 0xffff) | (args_s.fanout << 16);
+        if (setsockopt(w->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) == -1)
+            lerror_exit("PACKET_FANOUT %s", strerror(errno));
+    }
+}
+
+static void ring_close(struct worker *w)
+{
+    munmap(w->map, (size_t)w->req.tp_block_size * w->req.tp_block_nr);
+    close(w->fd);
+}
+
+// PACKET_STATISTICS resets on every read, so keep the running sum
+static void ring_stats(struct worker *w)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    if (getsockopt(w->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+    {
+        w->received += st.tp_packets;
+        w->drops += st.tp_drops;
+        w->freezes += st.tp_freeze_q_cnt;
+    }
+}
+
+static void ring_block(struct worker *w, struct tpacket_block_desc *bd)
+{
+    struct tpacket3_hdr *ph = (struct tpacket3_hdr *)((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+    unsigned int i, num = bd->hdr.bh1.num_pkts;
+    unsigned long long bytes = 0, first = 0;
+    struct pkt p;
+
+    for (i = 0; i < num; ++i)
+    {
+        p.ts = ph->tp_sec * 1000000000ULL + ph->tp_nsec;
+        p.caplen = ph->tp_snaplen;
+        p.len = ph->tp_len;
+        p.data = (unsigned char *)ph + ph->tp_mac;
+        if (i == 0)
+            first = p.ts;
+        bytes += p.len;
+        process_packet(w, &p);
+        ph = (struct tpacket3_hdr *)((unsigned char *)ph + ph->tp_next_offset);
+    }
+    account_batch(w, num, bytes, first, p.ts);
+}
+
+static void *ring_worker(void *arg)
 {
-    linfo("tv_sec: %ld, tv_usec: %ld, userdata: %s, pkthdr->caplen: %u, pkthdr->len: %u",
-        pkthdr->ts.tv_sec, pkthdr->ts.tv_usec, userdata, pkthdr->caplen, pkthdr->len);
+    struct worker *w = arg;
+    unsigned int cur = 0;
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN | POLLERR };
+
+    while (!stop)
+    {
+        struct tpacket_block_desc *bd =
+            (struct tpacket_block_desc *)(w->map + (size_t)cur * w->req.tp_block_size);
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        {
+            int ret = poll(&pfd, 1, POLL_MS);
+            if (ret == -1 && errno != EINTR)
+                lerror_exit("worker %d poll %s", w->id, strerror(errno));
+            if (ret == 0)
+            {
+                flow_tick(w, now_ns(CLOCK_REALTIME), 0);
+                dump_tick(w, now_ns(CLOCK_REALTIME));
+            }
+            continue;
+        }
+
+        ring_block(w, bd);
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        cur = (cur + 1) % w->req.tp_block_nr;
+    }
+    flow_finish(w);
+    dump_end(w);
+    return NULL;
 }
 
+/*
+ * libpcap engine (-P)
+ *
+ * for systems without TPACKET_V3, or to compare against it. the capture
+ * buffer gets the -r size and immediate mode stays off, so every
+ * pcap_dispatch returns a whole buffer of packets.
+ */
+static void pcap_setup(struct worker *w);
 
-int main(int argc, char const *argv[])
+static void pcap_engine_open(struct worker *w)
 {
-    // get all device
     char errbuf[PCAP_ERRBUF_SIZE] = {0};
-    pcap_if_t *dev, *devs = NULL;
-    pcap_t *handle = NULL;
-    struct pcap_pkthdr header;
-    u_char *pkt = NULL;
-    int ret = 0;
 
-    ret = pcap_findalldevs(&devs, errbuf);
-    if (ret < 0)
-        lerror_exit("pcap_findalldevs");
+    w->handle = pcap_create(args_s.dev, errbuf);
+    if (w->handle == NULL)
+        lerror_exit("pcap_create %s: %s", args_s.dev, errbuf);
+    pcap_set_snaplen(w->handle, args_s.snaplen ? args_s.snaplen : MAX_SNAPLEN);
+    pcap_set_promisc(w->handle, args_s.promisc);
+    pcap_set_timeout(w->handle, POLL_MS);
+    pcap_set_buffer_size(w->handle, args_s.ring_size);
+    if (pcap_activate(w->handle) < 0)
+        lerror_exit("pcap_activate %s: %s", args_s.dev, pcap_geterr(w->handle));
+    pcap_setup(w);
+}
+
+static void pcap_setup(struct worker *w)
+{
+    switch (pcap_datalink(w->handle))
+    {
+    case DLT_EN10MB:
+        w->link = LINK_ETH;
+        break;
+    case DLT_LINUX_SLL:
+        w->link = LINK_SLL;
+        break;
+    default:
+        w->link = LINK_RAW;
+        break;
+    }
+
+    if (args_s.filter != NULL)
+    {
+        struct bpf_program prog;
+        if (pcap_compile(w->handle, &prog, args_s.filter, 1, dev_netmask()) == -1 ||
+            pcap_setfilter(w->handle, &prog) == -1)
+            lerror_exit("filter '%s': %s", args_s.filter, pcap_geterr(w->handle));
+        pcap_freecode(&prog);
+    }
+}
+
+static void pcap_handler_cb(u_char *user, const struct pcap_pkthdr *h, const u_char *data)
+{
+    struct worker *w = (struct worker *)user;
+    struct pkt p = {
+        .ts = h->ts.tv_sec * 1000000000ULL + h->ts.tv_usec * 1000ULL,
+        .caplen = h->caplen,
+        .len = h->len,
+        .data = data,
+    };
+    if (args_s.snaplen && p.caplen > args_s.snaplen)
+        p.caplen = args_s.snaplen; // files keep what they were captured with
+    if (w->batch_first == 0)
+        w->batch_first = p.ts;
+    w->batch_last = p.ts;
+    w->batch_bytes += p.len;
+    process_packet(w, &p);
+}
+
+static void *pcap_worker(void *arg)
+{
+    struct worker *w = arg;
+
+    while (!stop)
+    {
+        int n = pcap_dispatch(w->handle, -1, pcap_handler_cb, (u_char *)w);
+        if (n == PCAP_ERROR)
+            lerror_exit("pcap_dispatch: %s", pcap_geterr(w->handle));
+        if (n == 0 && args_s.engine == ENGINE_FILE)
+            break; // end of the file
+        if (n > 0)
+            account_batch(w, n, w->batch_bytes, w->batch_first, w->batch_last);
+        else
+        {
+            flow_tick(w, now_ns(CLOCK_REALTIME), 0);
+            dump_tick(w, now_ns(CLOCK_REALTIME));
+        }
+        w->batch_bytes = 0;
+        w->batch_first = 0;
+    }
+    flow_finish(w);
+    dump_end(w);
+    if (args_s.engine == ENGINE_FILE)
+        stop = 1;
+    return NULL;
+}
+
+/*
+ * pcap files (-R)
+ *
+ * classic pcap files are mmapped and cut into one chunk per worker. a
+ * chunk starts at the first offset past its nominal start where a run of
+ * record headers chains up, and ends where the next one starts, so the
+ * workers read their part of the file in parallel straight out of the
+ * page cache, without a copy or a read call. pcapng goes through
+ * pcap_open_offline with a single worker.
+ */
+#define FILE_RESYNC 8      // records that must chain up to trust a chunk start
+#define FILE_BATCH  4096   // packets per account_batch
+
+struct pcap_file
+{
+    const unsigned char *map;
+    size_t size;
+    int swapped;           // written on a host of the other byte order
+    int nsec;              // nanosecond timestamps
+    unsigned int snaplen;
+    unsigned int dlt;
+    unsigned int first_sec; // of the first record, to tell headers from data
+};
+
+static struct pcap_file file_s;
+static struct bpf_program file_prog;
+static int file_filtered = 0;
+
+struct pcap_rec
+{
+    unsigned int sec;
+    unsigned int frac;
+    unsigned int caplen;
+    unsigned int len;
+};
+
+static inline unsigned int file_u32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, 4); // records are not aligned
+    return file_s.swapped ? __builtin_bswap32(v) : v;
+}
+
+// read the record at p, returns the next one, or NULL if this is no record
+static const unsigned char *file_record(const unsigned char *p, struct pcap_rec *r)
+{
+    const unsigned char *end = file_s.map + file_s.size;
+
+    if (end - p < 16)
+        return NULL;
+    r->sec = file_u32(p);
+    r->frac = file_u32(p + 4);
+    r->caplen = file_u32(p + 8);
+    r->len = file_u32(p + 12);
+    if (r->caplen > r->len || r->caplen > MAX_SNAPLEN || r->len > MAX_SNAPLEN * 4 ||
+        r->frac >= (file_s.nsec ? 1000000000U : 1000000U) ||
+        (unsigned int)(r->sec - file_s.first_sec + 86400 * 365) > 2 * 86400 * 365 ||
+        (unsigned long long)(end - p - 16) < r->caplen)
+        return NULL;
+    return p + 16 + r->caplen;
+}
+
+// the first offset at or past p where FILE_RESYNC records chain up
+static const unsigned char *file_resync(const unsigned char *p)
+{
+    const unsigned char *end = file_s.map + file_s.size;
+    struct pcap_rec r;
+
+    for (; p < end; p++)
+    {
+        const unsigned char *q = p;
+        int i;
+        for (i = 0; i < FILE_RESYNC && q != NULL && q < end; i++)
+            q = file_record(q, &r);
+        if (q == end || (q != NULL && i == FILE_RESYNC))
+            return p;
+    }
+    return end;
+}
+
+static void file_filter()
+{
+    pcap_t *dead;
+
+    if (args_s.filter == NULL)
+        return;
+    dead = pcap_open_dead(file_s.dlt, MAX_SNAPLEN);
+    if (dead == NULL)
+        lerror_exit("pcap_open_dead");
+    if (pcap_compile(dead, &file_prog, args_s.filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+        lerror_exit("filter '%s': %s", args_s.filter, pcap_geterr(dead));
+    pcap_close(dead);
+    file_filtered = 1;
+}
+
+// map the file and hand out the chunks, returns how many workers got one
+static int file_open(struct worker *workers, int n)
+{
+    const unsigned char *h;
+    unsigned int magic;
+    struct stat st;
+    int fd, i, link;
+
+    fd = open(args_s.file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        lerror_exit("open %s %s", args_s.file, strerror(errno));
+    if (fstat(fd, &st) == -1)
+        lerror_exit("fstat %s %s", args_s.file, strerror(errno));
+    if (st.st_size < 24)
+        lerror_exit("%s is too short for a pcap file", args_s.file);
+
+    file_s.size = st.st_size;
+    file_s.map = mmap(NULL, file_s.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (file_s.map == MAP_FAILED)
+        lerror_exit("mmap %s %s", args_s.file, strerror(errno));
+    close(fd);
+
+    h = file_s.map;
+    memcpy(&magic, h, 4);
+    switch (magic)
+    {
+    case 0xa1b2c3d4: break;
+    case 0xd4c3b2a1: file_s.swapped = 1; break;
+    case 0xa1b23c4d: file_s.nsec = 1; break;
+    case 0x4d3cb2a1: file_s.swapped = 1; file_s.nsec = 1; break;
+    default:
+    {
+        // pcapng or something else libpcap may know
+        char errbuf[PCAP_ERRBUF_SIZE] = {0};
+        munmap((void *)file_s.map, file_s.size);
+        file_s.map = NULL;
+        workers[0].handle = pcap_open_offline(args_s.file, errbuf);
+        if (workers[0].handle == NULL)
+            lerror_exit("pcap_open_offline %s: %s", args_s.file, errbuf);
+        pcap_setup(&workers[0]);
+        return 1;
+    }
+    }
+    file_s.snaplen = file_u32(h + 16);
+    file_s.dlt = file_u32(h + 20) & 0x0fffffff; // the top bits are FCS flags
+    file_s.first_sec = file_s.size >= 28 ? file_u32(h + 24) : 0;
+    switch (file_s.dlt)
+    {
+    case DLT_EN10MB: link = LINK_ETH; break;
+    case DLT_LINUX_SLL: link = LINK_SLL; break;
+    default: link = LINK_RAW; break;
+    }
+    file_filter();
+    madvise((void *)file_s.map, file_s.size, MADV_SEQUENTIAL);
+
+    // small files are not worth a thread per chunk
+    if ((size_t)n > file_s.size / (1 << 20) + 1)
+        n = file_s.size / (1 << 20) + 1;
+    workers[0].chunk = file_s.map + 24;
+    for (i = 1; i < n; ++i)
+        workers[i].chunk = file_resync(file_s.map + file_s.size / n * i);
+    for (i = 0; i < n; ++i)
+    {
+        workers[i].chunk_end = i + 1 < n ? workers[i + 1].chunk : file_s.map + file_s.size;
+        workers[i].link = link;
+    }
+    return n;
+}
+
+static void *file_worker(void *arg)
+{
+    struct worker *w = arg;
+    const unsigned char *p = w->chunk, *next;
+    unsigned long long pkts = 0, bytes = 0;
+    struct pcap_rec r;
+    struct pkt pk;
+
+    while (p < w->chunk_end && !stop)
+    {
+        next = file_record(p, &r);
+        if (next == NULL)
+        {
+            lerror("%s: bad record at offset %zu", args_s.file, (size_t)(p - file_s.map));
+            break;
+        }
+        pk.ts = r.sec * 1000000000ULL + (file_s.nsec ? r.frac : r.frac * 1000ULL);
+        pk.caplen = args_s.snaplen && r.caplen > args_s.snaplen ? args_s.snaplen : r.caplen;
+        pk.len = r.len;
+        pk.data = p + 16;
+        p = next;
+
+        if (file_filtered)
+        {
+            struct pcap_pkthdr h = { .caplen = pk.caplen, .len = pk.len };
+            if (pcap_offline_filter(&file_prog, &h, pk.data) == 0)
+                continue;
+        }
+        pkts++;
+        bytes += pk.len;
+        process_packet(w, &pk);
+        if (pkts == FILE_BATCH)
+        {
+            // packet time, so the flows expire as they would have live
+            account_batch(w, pkts, bytes, 0, pk.ts);
+            pkts = bytes = 0;
+        }
+    }
+    if (p > w->chunk_end)
+        lerror("%s: chunk %d ran past the next one, records counted twice", args_s.file, w->id);
+    if (pkts > 0)
+        account_batch(w, pkts, bytes, 0, pk.ts);
+    flow_finish(w);
+    dump_end(w);
+    if (__atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED) == 0)
+        stop = 1;
+    return NULL;
+}
+
+static void dump_begin(struct worker *w)
+{
+    static const unsigned int linktypes[] = {
+        [LINK_ETH] = DUMP_LINK_ETH, [LINK_RAW] = DUMP_LINK_RAW, [LINK_SLL] = DUMP_LINK_SLL,
+    };
+    struct dump *d;
+
+    if (args_s.dump == NULL)
+        return;
+    d = calloc(1, sizeof(*d));
+    if (d == NULL)
+        lerror_exit("calloc dump");
+    d->path = args_s.dump;
+    d->id = args_s.workers > 1 ? w->id : -1;
+    d->max_size = args_s.dump_size;
+    d->max_secs = args_s.dump_secs;
+    d->prealloc = args_s.dump_prealloc;
+    d->snaplen = args_s.snaplen ? args_s.snaplen : MAX_SNAPLEN;
+    // a file read keeps its own linktype, it may be one flow.h reads as raw
+    d->linktype = args_s.engine == ENGINE_FILE && file_s.map != NULL ? file_s.dlt : linktypes[w->link];
+    if (dump_start(d) == -1)
+        lerror_exit("worker %d dump %s", w->id, strerror(errno));
+    w->dump = d;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+struct capture_stats
+{
+    unsigned long long received; // passed the filter
+    unsigned long long dropped;  // by the kernel, the ring or buffer was full
+    unsigned long long ifdropped; // by the interface, before the filter
+};
+
+// the device's rx_dropped, what libpcap reports as ps_ifdrop on Linux
+static unsigned long long if_dropped()
+{
+    char path[64 + IFNAMSIZ];
+    unsigned long long val = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_dropped", args_s.dev);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%llu", &val) != 1)
+        val = 0;
+    fclose(fp);
+    return val;
+}
+
+// refresh the kernel counters, the ring ones add up over the workers
+static void collect_stats(struct worker *workers, int n, struct capture_stats *st)
+{
+    static unsigned long long ifdrop_base = -1ULL;
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    if (args_s.engine == ENGINE_FILE)
+        return;
+    if (args_s.engine == ENGINE_PCAP)
+    {
+        struct pcap_stat ps;
+        if (pcap_stats(workers[0].handle, &ps) == 0)
+        {
+            st->received = ps.ps_recv;
+            st->dropped = ps.ps_drop;
+            st->ifdropped = ps.ps_ifdrop;
+        }
+    }
+    else
+    {
+        unsigned long long ifdrop = if_dropped();
+        if (ifdrop_base == -1ULL)
+            ifdrop_base = ifdrop;
+        st->ifdropped = ifdrop - ifdrop_base;
+        for (i = 0; i < n; ++i)
+        {
+            ring_stats(&workers[i]);
+            st->received += workers[i].received;
+            st->dropped += workers[i].drops;
+        }
+    }
+    mt_set(m_received, st->received);
+    mt_set(m_drops, st->dropped);
+    mt_set(m_ifdrops, st->ifdropped);
+}
+
+int main(int argc, char *argv[])
+{
+    int i, ret, n;
+    struct worker *workers;
+    void *(*worker_fn)(void *);
+    struct sigaction sa = { .sa_handler = on_signal };
+    struct capture_stats st, last = { 0 };
+
+    parse_args(argc, argv);
+    metrics_init(args_s.metrics);
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (args_s.flows > 0)
+    {
+        static const char header[] = "first,last,proto,src,sport,dst,dport,packets,bytes,tcp_flags,end\n";
+        if (args_s.flow_file != NULL)
+        {
+            flow_fd = open(args_s.flow_file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            if (flow_fd == -1)
+                lerror_exit("open %s %s", args_s.flow_file, strerror(errno));
+        }
+        else
+        {
+            // the flows keep stdout to themselves, the log moves to stderr
+            fflush(stdout);
+            flow_fd = dup(STDOUT_FILENO);
+            if (flow_fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+                lerror_exit("dup stdout %s", strerror(errno));
+        }
+        struct stat st;
+        if (fstat(flow_fd, &st) == 0 && !S_ISREG(st.st_mode))
+            flow_chunk = PIPE_BUF;
+        if (write(flow_fd, header, sizeof(header) - 1) == -1)
+            lerror_exit("write %s", strerror(errno));
+    }
+
+    n = args_s.workers;
+    workers = calloc(n, sizeof(struct worker));
+    if (workers == NULL)
+        lerror_exit("calloc workers");
+
+    if (args_s.engine == ENGINE_FILE)
+        n = file_open(workers, n);
+
+    // open every socket before any worker runs, so the fanout group is complete
+    for (i = 0; i < n; ++i)
+    {
+        workers[i].id = i;
+        if (args_s.engine == ENGINE_RING)
+            ring_open(&workers[i]);
+        else if (args_s.engine == ENGINE_PCAP)
+            pcap_engine_open(&workers[i]);
+        flow_start(&workers[i]);
+        dump_begin(&workers[i]);
+    }
+
+    // start counting interface drops now
+    collect_stats(workers, n, &st);
 
-    dump_devs(devs);
+    if (args_s.engine == ENGINE_FILE)
+        linfo("read %s: %zu bytes, %d workers%s", args_s.file, file_s.size, n,
+              file_s.map ? "" : ", pcapng through libpcap");
+    else if (args_s.engine == ENGINE_RING)
+        linfo("capture %s: %d workers, ring %u x %u bytes, block timeout %u ms%s",
+              args_s.dev, n, workers[0].req.tp_block_nr, workers[0].req.tp_block_size,
+              args_s.block_tmo, n > 1 ? ", fanout" : "");
+    else
+        linfo("capture %s with libpcap, buffer %zu bytes", args_s.dev, args_s.ring_size);
+    if (args_s.filter != NULL || args_s.snaplen > 0)
+        linfo("filter '%s', snaplen %u", args_s.filter ? args_s.filter : "",
+              args_s.snaplen ? args_s.snaplen : MAX_SNAPLEN);
 
-    dev = devs;
-    char *name = dev->name;
-    int promisc = 1;
-    int timeout = 0;
+    if (args_s.engine == ENGINE_RING)
+        worker_fn = ring_worker;
+    else if (args_s.engine == ENGINE_FILE && file_s.map != NULL)
+        worker_fn = file_worker;
+    else
+        worker_fn = pcap_worker;
+
+    unsigned long long start = now_ns(CLOCK_MONOTONIC), last_report = start;
+    running = n;
+    for (i = 0; i < n; ++i)
+    {
+        ret = pthread_create(&workers[i].tid, NULL, worker_fn, &workers[i]);
+        if (ret != 0)
+            lerror_exit("pthread_create worker %d %s", i, strerror(ret));
+    }
 
-    linfo("pcap_open_live: %s", name);
-    handle = pcap_open_live(name, PCAP_BUF_SIZE, promisc, timeout, errbuf);
-    if (handle == NULL)
-        lerror_exit("pcap_open_live: %s", pcap_strerror(errno));
+    // short naps so a file read that is done does not wait for the next report
+    unsigned long long last_pkts = 0, last_bytes = 0;
+    while (!stop)
+    {
+        struct timespec ts = { 0, POLL_MS * 1000000 };
+        nanosleep(&ts, NULL);
+        unsigned long long now = now_ns(CLOCK_MONOTONIC);
 
-    // pkt = pcap_next(handle, &header);
+        if (args_s.duration > 0 && now - start >= args_s.duration * 1000000000ULL)
+            stop = 1;
+        if (now - last_report < 1000000000ULL)
+            continue;
+        last_report = now;
 
-    int pkt_cnt = 10;
-    ret = pcap_dispatch(handle, pkt_cnt, handler, pkt);
-    linfo("pcap_dispatch ret: %d", ret);
+        unsigned long long pkts = mt_count(m_pkts);
+        unsigned long long bytes = mt_count(m_bytes);
+        collect_stats(workers, n, &st);
+        if (args_s.engine == ENGINE_FILE)
+            linfo("read: %llu pps, %.1f Mbit/s, total %llu pkts",
+                  pkts - last_pkts, (bytes - last_bytes) * 8 / 1e6, pkts);
+        else if (pkts != last_pkts || st.dropped != last.dropped || st.ifdropped != last.ifdropped)
+            linfo("capture: %llu pps, %.1f Mbit/s, %llu drops/s, %llu ifdrops/s, "
+                  "total %llu pkts, kernel received %llu dropped %llu, if dropped %llu",
+                  pkts - last_pkts, (bytes - last_bytes) * 8 / 1e6, st.dropped - last.dropped,
+                  st.ifdropped - last.ifdropped, pkts, st.received, st.dropped, st.ifdropped);
+        last_pkts = pkts;
+        last_bytes = bytes;
+        last = st;
+    }
 
-    ret = pcap_loop(handle, pkt_cnt, handler, pkt);
-    linfo("pcap_loop ret: %d", ret);
+    for (i = 0; i < n; ++i)
+        pthread_join(workers[i].tid, NULL);
 
-    pcap_close(handle);
+    collect_stats(workers, n, &st);
+    double secs = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    if (args_s.engine == ENGINE_FILE)
+    {
+        // the file as a whole, headers and all, is what had to be read
+        linfo("read %llu pkts, %llu bytes in %.3f s: %.2f Mpps, %.2f GB/s",
+              mt_count(m_pkts), mt_count(m_bytes), secs, mt_count(m_pkts) / secs / 1e6,
+              file_s.size / secs / 1e9);
+    }
+    else
+    {
+        linfo("captured %llu pkts, %llu bytes in %.1f s", mt_count(m_pkts), mt_count(m_bytes), secs);
+        linfo("kernel received %llu, dropped %llu, interface dropped %llu",
+              st.received, st.dropped, st.ifdropped);
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        if (args_s.engine == ENGINE_RING)
+            ring_close(&workers[i]);
+        else if (workers[i].handle != NULL)
+            pcap_close(workers[i].handle);
+    }
+    if (file_s.map != NULL)
+        munmap((void *)file_s.map, file_s.size);
+    free(workers);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,103 @@
+/*
+ * message framing for the stream tools
+ *
+ * FRAME_NONE   whatever one recv returns is a message, the old behaviour
+ * FRAME_LENGTH 4 byte big-endian payload length, then the payload
+ * FRAME_LINE   payload terminated by FRAME_DELIM
+ *
+ * frame_next() finds the first complete frame in a buffer, so a reader
+ * calls it until it returns 0 and keeps the rest for the next read.
+ */
+#include <string.h>
+#include <arpa/inet.h>
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#define FRAME_NONE   0
+#define FRAME_LENGTH 1
+#define FRAME_LINE   2
+
+#define FRAME_HDR_SIZE 4
+#define FRAME_DELIM    '\n'
+
+struct frame
+{
+    const char *data;    // whole frame, header or delimiter included
+    unsigned int len;
+    const char *payload;
+    unsigned int payload_len;
+};
+
+static inline int frame_mode(const char *name)
+{
+    if (strcmp(name, "none") == 0)
+        return FRAME_NONE;
+    if (strcmp(name, "len") == 0)
+        return FRAME_LENGTH;
+    if (strcmp(name, "line") == 0)
+        return FRAME_LINE;
+    return -1;
+}
+
+/*
+ * return the size of the first frame in buf and fill f, 0 if the frame is
+ * not complete yet, -1 if it is longer than max
+ */
+static inline int frame_next(int mode, const char *buf, size_t len, size_t max, struct frame *f)
+{
+    const char *end;
+    unsigned int n;
+
+    if (len == 0)
+        return 0;
+
+    switch (mode)
+    {
+    case FRAME_LENGTH:
+        if (len < FRAME_HDR_SIZE)
+            return 0;
+        memcpy(&n, buf, FRAME_HDR_SIZE);
+        n = ntohl(n);
+        if ((size_t)n + FRAME_HDR_SIZE > max)
+            return -1;
+        if (len < (size_t)n + FRAME_HDR_SIZE)
+            return 0;
+        f->payload = buf + FRAME_HDR_SIZE;
+        f->payload_len = n;
+        f->len = n + FRAME_HDR_SIZE;
+        break;
+    case FRAME_LINE:
+        end = memchr(buf, FRAME_DELIM, len);
+        if (end == NULL)
+            return len >= max ? -1 : 0;
+        f->payload = buf;
+        f->payload_len = end - buf;
+        f->len = f->payload_len + 1;
+        break;
+    default:
+        f->payload = buf;
+        f->payload_len = len;
+        f->len = len;
+    }
+
+    f->data = buf;
+    return f->len;
+}
+
+// bytes a frame adds in front of and behind a payload of len
+static inline unsigned int frame_prefix(int mode, unsigned int len, char *hdr)
+{
+    if (mode != FRAME_LENGTH)
+        return 0;
+    len = htonl(len);
+    memcpy(hdr, &len, FRAME_HDR_SIZE);
+    return FRAME_HDR_SIZE;
+}
+
+static inline unsigned int frame_suffix(int mode)
+{
+    return mode == FRAME_LINE ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * UDP_GRO receive helpers shared by the datagram tools
+ *
+ * with UDP_GRO the kernel glues a run of datagrams from one flow into a
+ * single buffer and says how long each one was in a cmsg, so a reader
+ * asks for CMSG_SPACE(sizeof(int)) of control data and counts segments.
+ */
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef GRO_H
+#define GRO_H
+
+// with UDP_GRO one iovec can hold several datagrams of gso_size each
+static inline unsigned int udp_segments(struct msghdr *hdr, unsigned int len)
+{
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm))
+    {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+        {
+            int gso_size;
+            memcpy(&gso_size, CMSG_DATA(cm), sizeof(int));
+            if (gso_size > 0)
+                return (len + gso_size - 1) / gso_size;
+        }
+    }
+    return 1;
+}
+
+#endif
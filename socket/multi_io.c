@@ -1,16 +1,35 @@
+#define _GNU_SOURCE // sched_setaffinity
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/epoll.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include <unistd.h> // getopt
 #include <string.h> // strncpy
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>  // sched_setaffinity
+#include <stddef.h> // offsetof
+#include <time.h>
 
-#include "clog.h"
+#include "../clog.h"
+#include "../metrics.h"
+#include "frame.h"
+#include "gro.h"
+#include "twheel.h"
 
 #define IP_SIZE 32
 #define BUFF_SIZE 128
@@ -18,18 +37,41 @@
 #define MODE_SELECT 0
 #define MODE_POLL   1
 #define MODE_EPOLL  2
+#define MODE_URING  3
 
 #define SOCK_DGRAM_L  0
 #define SOCK_STREAM_L 1
 
-#define MAX_EVENT 10
+#define MAX_EVENT 64
+#define MAX_WORKERS 256
+#define ACCEPT_BATCH 64
+#define FRAME_IOV_MAX 64
+#define OUT_IOV_MAX   64
+#define OUT_HIGH_WATER (1 << 20)
+#define OUT_LOW_WATER  (256 << 10)
+#define TW_TICK_MS 10
+#define DGRAM_BATCH_MAX 1024
+#define DGRAM_BUF_SIZE  65536 // room for a whole GRO run
 
 struct args
 {
-    unsigned short mode; // select--1 or poll--2 or epoll--3
+    unsigned short mode; // select--0 or poll--1 or epoll--2 or io_uring--3
     unsigned short port;
     unsigned short sock; // stream--1 or graph--0
+    unsigned short workers; // threads, each with its own SO_REUSEPORT listen socket
+    unsigned short affinity; // pin worker i to cpu (i % ncpu)
+    int backlog; // listen backlog
     char *ip;
+    char *file; // sent to every client after the greeting with sendfile
+    unsigned int vlen; // dgram: datagrams per recvmmsg
+    unsigned short gro; // dgram: receive with UDP_GRO
+    int frame; // FRAME_*, how a stream is cut into messages
+    size_t high_water; // stop reading a client with this much queued for it
+    size_t low_water;  // and start again once it drained to this
+    unsigned int idle_timeout;  // ms without any traffic, 0 for none
+    unsigned int read_timeout;  // ms a partial frame may wait for its rest
+    unsigned int write_timeout; // ms queued output may make no progress
+    char *metrics; // export metrics to this file or unix:/path
 };
 
 const static char *default_ip = "127.0.0.1";
@@ -38,22 +80,65 @@ static struct args args_s = {
     .mode = MODE_EPOLL,
     .port = 8888,
     .sock = SOCK_STREAM_L,
+    .workers  = 1,
+    .affinity = 0,
+    .backlog  = SOMAXCONN,
     .ip   = NULL,
+    .file = NULL,
+    .vlen = 64,
+    .gro  = 0,
+    .frame = FRAME_NONE,
+    .high_water = OUT_HIGH_WATER,
+    .low_water  = OUT_LOW_WATER,
+    .idle_timeout  = 0,
+    .read_timeout  = 0,
+    .write_timeout = 0,
+    .metrics = NULL,
 };
 
+static int payload_fd = -1;
+static off_t payload_size = 0;
+
+static struct metric *m_accepts;
+static struct metric *m_rejects;
+static struct metric *m_conns;
+static struct metric *m_rx_bytes;
+static struct metric *m_tx_bytes;
+static struct metric *m_frames;
+static struct metric *m_timeouts;
+static struct metric *m_batch;
+static struct metric *m_pkts;
+
+static void metrics_init()
+{
+    m_accepts  = mt_counter("multi_io_accepts_total", "Accepted connections.");
+    m_rejects  = mt_counter("multi_io_rejects_total", "Clients accepted and closed at once, out of fds.");
+    m_conns    = mt_gauge("multi_io_connections", "Open connections.");
+    m_rx_bytes = mt_counter("multi_io_received_bytes_total", "Bytes received.");
+    m_tx_bytes = mt_counter("multi_io_sent_bytes_total", "Bytes sent.");
+    m_frames   = mt_counter("multi_io_frames_total", "Frames echoed.");
+    m_timeouts = mt_counter("multi_io_timeouts_total", "Connections closed by a timeout.");
+    m_batch    = mt_histogram("multi_io_batch_seconds", "Time to handle one batch of ready events.", 1e-9);
+    m_pkts     = mt_counter("multi_io_datagrams_total", "Datagrams received, GRO segments counted one by one.");
+
+    if (args_s.metrics != NULL && mt_start(args_s.metrics, 1000) == -1)
+        lerror_exit("metrics %s %s", args_s.metrics, strerror(errno));
+}
+
 static void parse_args(int argc, char *argv[])
 {
     int opt;
     int val;
     char *ip = NULL;
-    while ((opt = getopt(argc, argv, "mtup:a:")) != -1)
+    while ((opt = getopt(argc, argv, "m:tup:a:w:Ab:f:v:RF:H:L:i:r:W:M:")) != -1)
     {
         switch (opt){
         case 'm':
             val = atoi(optarg);
-            if (val != MODE_SELECT ||
-                val != MODE_POLL ||
-                val != MODE_EPOLL)
+            if (val != MODE_SELECT &&
+                val != MODE_POLL &&
+                val != MODE_EPOLL &&
+                val != MODE_URING)
                 lerror_exit("unknown mode %d", val);
             args_s.mode = val;
             break;
@@ -61,7 +146,7 @@ static void parse_args(int argc, char *argv[])
             args_s.sock = SOCK_STREAM_L;
             break;
         case 'u':
-            args_s.mode = SOCK_DGRAM_L;
+            args_s.sock = SOCK_DGRAM_L;
             break;
         case 'p':
             args_s.port = atoi(optarg);
@@ -73,6 +158,56 @@ static void parse_args(int argc, char *argv[])
             strncpy(ip, optarg, IP_SIZE);
             args_s.ip = ip;
             break;
+        case 'w':
+            val = atoi(optarg);
+            if (val < 1 || val > MAX_WORKERS)
+                lerror_exit("workers should be in [1, %d], got %d", MAX_WORKERS, val);
+            args_s.workers = val;
+            break;
+        case 'A':
+            args_s.affinity = 1;
+            break;
+        case 'b':
+            val = atoi(optarg);
+            if (val < 1)
+                lerror_exit("backlog should be positive, got %d", val);
+            args_s.backlog = val;
+            break;
+        case 'f':
+            args_s.file = optarg;
+            break;
+        case 'v':
+            val = atoi(optarg);
+            if (val < 1 || val > DGRAM_BATCH_MAX)
+                lerror_exit("vlen should be in [1, %d], got %d", DGRAM_BATCH_MAX, val);
+            args_s.vlen = val;
+            break;
+        case 'R':
+            args_s.gro = 1;
+            break;
+        case 'F':
+            args_s.frame = frame_mode(optarg);
+            if (args_s.frame == -1)
+                lerror_exit("unknown frame mode %s", optarg);
+            break;
+        case 'H':
+            args_s.high_water = atol(optarg);
+            break;
+        case 'L':
+            args_s.low_water = atol(optarg);
+            break;
+        case 'i':
+            args_s.idle_timeout = atoi(optarg);
+            break;
+        case 'r':
+            args_s.read_timeout = atoi(optarg);
+            break;
+        case 'W':
+            args_s.write_timeout = atoi(optarg);
+            break;
+        case 'M':
+            args_s.metrics = optarg;
+            break;
         default:
             lerror_exit("unknown opt %c, %d", opt, opt);
         }
@@ -81,6 +216,9 @@ static void parse_args(int argc, char *argv[])
     if (args_s.ip == NULL) {
         args_s.ip = default_ip;
     }
+
+    if (args_s.low_water > args_s.high_water)
+        lerror_exit("low water %zu is above high water %zu", args_s.low_water, args_s.high_water);
 }
 
 static int stream_socket()
@@ -116,112 +254,2057 @@ static int set_noblock(int fd)
     return 0;
 }
 
-static void create_stream_server()
+/*
+ * event loop backends
+ *
+ * every backend reports readiness through the same ev_ops, so the server
+ * loop does not care whether select, poll or epoll is underneath. select
+ * and poll are level-triggered only; EV_ET is a hint that only epoll uses,
+ * the loop drains every fd until EAGAIN so it works either way.
+ */
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4 // hup or error, reported only
+#define EV_ET    0x8 // edge-triggered hint
+
+struct ev_event
 {
-    int ret = 0;
-    int nfd = 0;
-    int i = 0;
-    int recv_fd = 0;
-    int listen_sock, epoll_fd, accept_sock;
-    listen_sock = stream_socket();
+    int fd;
+    unsigned int events;
+};
 
-    struct sockaddr_in server, client;
-    memset(&server, 0, sizeof(struct sockaddr_in));
-    memset(&client, 0, sizeof(struct sockaddr_in));
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = inet_addr(args_s.ip);
-    server.sin_port = htons(args_s.port);
+struct ev_backend;
 
-    bind(listen_sock, (struct sockaddr*)&server, sizeof(server));
-    set_noblock(listen_sock);
-    listen(listen_sock, 5);
+struct ev_ops
+{
+    const char *name;
+    int  (*init)(struct ev_backend *b);
+    int  (*add)(struct ev_backend *b, int fd, unsigned int events);
+    int  (*mod)(struct ev_backend *b, int fd, unsigned int events);
+    int  (*del)(struct ev_backend *b, int fd);
+    // return the number of ready fds in evs, 0 on timeout, -1 on error
+    int  (*wait)(struct ev_backend *b, struct ev_event *evs, int max, int timeout);
+    void (*destroy)(struct ev_backend *b);
+};
 
-    epoll_fd = epoll_create(10);
-    if (epoll_fd == -1)
-        lerror_exit("epoll_create %s", strerror(errno));
+struct ev_backend
+{
+    const struct ev_ops *ops;
+    void *priv;
+};
 
-    struct epoll_event ev, events[MAX_EVENT];
-    ev.events = EPOLLIN;
-    ev.data.fd = listen_sock;
-    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev);
-    if (ret == -1)
-        lerror_exit("epoll_ctl %s", strerror(errno));
+/* select */
 
-    for(;;)
+struct ev_select
+{
+    fd_set rset;
+    fd_set wset;
+    int maxfd;
+    int next;    // fd the next scan starts at
+};
+
+static int ev_select_init(struct ev_backend *b)
+{
+    struct ev_select *s = calloc(1, sizeof(struct ev_select));
+    if (s == NULL)
+        return -1;
+
+    FD_ZERO(&s->rset);
+    FD_ZERO(&s->wset);
+    s->maxfd = -1;
+    b->priv = s;
+    return 0;
+}
+
+static int ev_select_mod(struct ev_backend *b, int fd, unsigned int events)
+{
+    struct ev_select *s = b->priv;
+    if (fd >= FD_SETSIZE)
     {
-        nfd = epoll_wait(epoll_fd, events, MAX_EVENT, -1);
-        if (nfd == -1)
-            lerror_exit("epoll_wait %s", strerror(errno));
+        errno = EINVAL;
+        return -1;
+    }
 
-        char buff[BUFF_SIZE] = {0};
-        for(i = 0; i < nfd; ++i)
+    FD_CLR(fd, &s->rset);
+    FD_CLR(fd, &s->wset);
+    if (events & EV_READ)
+        FD_SET(fd, &s->rset);
+    if (events & EV_WRITE)
+        FD_SET(fd, &s->wset);
+    if (fd > s->maxfd)
+        s->maxfd = fd;
+    return 0;
+}
+
+static int ev_select_del(struct ev_backend *b, int fd)
+{
+    struct ev_select *s = b->priv;
+    if (fd >= FD_SETSIZE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    FD_CLR(fd, &s->rset);
+    FD_CLR(fd, &s->wset);
+    while (s->maxfd >= 0 &&
+           !FD_ISSET(s->maxfd, &s->rset) &&
+           !FD_ISSET(s->maxfd, &s->wset))
+        s->maxfd--;
+    return 0;
+}
+
+static int ev_select_wait(struct ev_backend *b, struct ev_event *evs, int max, int timeout)
+{
+    struct ev_select *s = b->priv;
+    struct timeval tv, *tvp = NULL;
+    fd_set rset = s->rset;
+    fd_set wset = s->wset;
+    int i, fd, n, cnt = 0;
+
+    if (timeout >= 0)
+    {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    n = select(s->maxfd + 1, &rset, &wset, NULL, tvp);
+    if (n <= 0)
+        return n;
+
+    // level-triggered: whatever does not fit in evs is reported next round,
+    // and that round starts where this one stopped so high fds get their turn
+    if (s->next > s->maxfd)
+        s->next = 0;
+    for (i = 0; i <= s->maxfd && cnt < max; ++i)
+    {
+        unsigned int events = 0;
+        fd = (s->next + i) % (s->maxfd + 1);
+        if (FD_ISSET(fd, &rset))
+            events |= EV_READ;
+        if (FD_ISSET(fd, &wset))
+            events |= EV_WRITE;
+        if (events)
         {
-            // get new connection
-            if (events[i].data.fd == listen_sock)
-            {
-                socklen_t len = sizeof(client);
-                accept_sock = accept(listen_sock, (struct sockaddr*)&client, &len);
-                set_noblock(accept_sock);
-                linfo("accept client: %s %d", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-
-                char buff[BUFF_SIZE] = {0};
-                strncpy(buff, "from server", BUFF_SIZE);
-                send(accept_sock, buff, BUFF_SIZE, 0);
-                memset(buff, 0, BUFF_SIZE);
-
-                ev.events = EPOLLIN | EPOLLET;
-                ev.data.fd = accept_sock;
-                linfo("epoll_ctl add %d to eventpoll", accept_sock);
-                ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_sock, &ev);
-                if (ret == -1)
-                    lerror("epoll_ctl %s", strerror(errno));
-            }
-            // read
-            else if (events[i].events & EPOLLIN)
-            {
-                recv_fd = events[i].data.fd;
-                while ((ret = recv(recv_fd, buff, BUFF_SIZE, 0)) > 0)
-                {
-                    linfo("recv from %d: msg [ %s ]", recv_fd, buff);
-                }
-                if (ret == -1)
-                {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    {
-                        linfo("recv from %d: %d, try again", recv_fd, errno);
-                    }
-                    else
-                    {
-                        lerror("recv from %d: %s, delete it from eventpoll", recv_fd, strerror(errno));
-                        ev.data.fd = recv_fd;
-                        ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
-                        if (ret == -1)
-                            lerror("epoll_ctl EPOLL_CTL_DEL %s", strerror(errno));
-                        
-                        close(recv_fd);
-                    }
-                }
-                if (ret == 0)
-                {
-                    linfo("client of %d closed, delete from eventpoll", recv_fd);
-                    ev.data.fd = recv_fd;
-                    ret = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, &ev);
-                    if (ret == -1)
-                        lerror("epoll_ctl EPOLL_CTL_DEL %s", strerror(errno));
-                    
-                    close(recv_fd);
-                }
-            }
+            evs[cnt].fd = fd;
+            evs[cnt].events = events;
+            cnt++;
         }
     }
+    s->next = (s->next + i) % (s->maxfd + 1);
+    return cnt;
+}
 
-    close(epoll_fd);
+static void ev_select_destroy(struct ev_backend *b)
+{
+    free(b->priv);
+    b->priv = NULL;
 }
 
-static void create_dgram_server()
+static const struct ev_ops ev_select_ops = {
+    .name    = "select",
+    .init    = ev_select_init,
+    .add     = ev_select_mod,
+    .mod     = ev_select_mod,
+    .del     = ev_select_del,
+    .wait    = ev_select_wait,
+    .destroy = ev_select_destroy,
+};
+
+/* poll */
+
+struct ev_poll
+{
+    struct pollfd *fds;
+    int *slot;   // fd -> index in fds, -1 if not registered
+    int nfds;
+    int cap;     // size of fds
+    int slot_cap;// size of slot
+    int next;    // index the next scan starts at
+};
+
+static short ev_poll_events(unsigned int events)
+{
+    short pev = 0;
+    if (events & EV_READ)
+        pev |= POLLIN;
+    if (events & EV_WRITE)
+        pev |= POLLOUT;
+    return pev;
+}
+
+static int ev_poll_init(struct ev_backend *b)
+{
+    struct ev_poll *p = calloc(1, sizeof(struct ev_poll));
+    if (p == NULL)
+        return -1;
+
+    b->priv = p;
+    return 0;
+}
+
+static int ev_poll_add(struct ev_backend *b, int fd, unsigned int events)
+{
+    struct ev_poll *p = b->priv;
+    int i;
+
+    if (fd >= p->slot_cap)
+    {
+        int cap = p->slot_cap ? p->slot_cap : 64;
+        while (cap <= fd)
+            cap *= 2;
+        int *slot = realloc(p->slot, cap * sizeof(int));
+        if (slot == NULL)
+            return -1;
+        for (i = p->slot_cap; i < cap; ++i)
+            slot[i] = -1;
+        p->slot = slot;
+        p->slot_cap = cap;
+    }
+    if (p->slot[fd] != -1)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (p->nfds == p->cap)
+    {
+        int cap = p->cap ? p->cap * 2 : 64;
+        struct pollfd *fds = realloc(p->fds, cap * sizeof(struct pollfd));
+        if (fds == NULL)
+            return -1;
+        p->fds = fds;
+        p->cap = cap;
+    }
+
+    p->fds[p->nfds].fd = fd;
+    p->fds[p->nfds].events = ev_poll_events(events);
+    p->fds[p->nfds].revents = 0;
+    p->slot[fd] = p->nfds++;
+    return 0;
+}
+
+static int ev_poll_mod(struct ev_backend *b, int fd, unsigned int events)
+{
+    struct ev_poll *p = b->priv;
+    if (fd >= p->slot_cap || p->slot[fd] == -1)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    p->fds[p->slot[fd]].events = ev_poll_events(events);
+    return 0;
+}
+
+static int ev_poll_del(struct ev_backend *b, int fd)
+{
+    struct ev_poll *p = b->priv;
+    if (fd >= p->slot_cap || p->slot[fd] == -1)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // move the last entry into the hole to keep fds dense
+    int idx = p->slot[fd];
+    int last = --p->nfds;
+    if (idx != last)
+    {
+        p->fds[idx] = p->fds[last];
+        p->slot[p->fds[idx].fd] = idx;
+    }
+    p->slot[fd] = -1;
+    return 0;
+}
+
+static int ev_poll_wait(struct ev_backend *b, struct ev_event *evs, int max, int timeout)
+{
+    struct ev_poll *p = b->priv;
+    int i, j, n, cnt = 0;
+
+    n = poll(p->fds, p->nfds, timeout);
+    if (n <= 0)
+        return n;
+
+    // as with select, start after the last fd reported when evs was full
+    if (p->next >= p->nfds)
+        p->next = 0;
+    for (i = 0; i < p->nfds && cnt < n && cnt < max; ++i)
+    {
+        j = (p->next + i) % p->nfds;
+        short rev = p->fds[j].revents;
+        if (rev == 0)
+            continue;
+
+        unsigned int events = 0;
+        if (rev & (POLLIN | POLLHUP))
+            events |= EV_READ;
+        if (rev & POLLOUT)
+            events |= EV_WRITE;
+        if (rev & (POLLERR | POLLHUP | POLLNVAL))
+            events |= EV_ERROR;
+        evs[cnt].fd = p->fds[j].fd;
+        evs[cnt].events = events;
+        cnt++;
+    }
+    p->next = (p->next + i) % p->nfds;
+    return cnt;
+}
+
+static void ev_poll_destroy(struct ev_backend *b)
+{
+    struct ev_poll *p = b->priv;
+    free(p->fds);
+    free(p->slot);
+    free(p);
+    b->priv = NULL;
+}
+
+static const struct ev_ops ev_poll_ops = {
+    .name    = "poll",
+    .init    = ev_poll_init,
+    .add     = ev_poll_add,
+    .mod     = ev_poll_mod,
+    .del     = ev_poll_del,
+    .wait    = ev_poll_wait,
+    .destroy = ev_poll_destroy,
+};
+
+/* epoll */
+
+struct ev_epoll
+{
+    int epfd;
+    int cap;
+    struct epoll_event *events;
+};
+
+static int ev_epoll_init(struct ev_backend *b)
+{
+    struct ev_epoll *e = calloc(1, sizeof(struct ev_epoll));
+    if (e == NULL)
+        return -1;
+
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (e->epfd == -1)
+    {
+        free(e);
+        return -1;
+    }
+    b->priv = e;
+    return 0;
+}
+
+static int ev_epoll_ctl(struct ev_backend *b, int op, int fd, unsigned int events)
+{
+    struct ev_epoll *e = b->priv;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (events & EV_READ)
+        ev.events |= EPOLLIN;
+    if (events & EV_WRITE)
+        ev.events |= EPOLLOUT;
+    if (events & EV_ET)
+        ev.events |= EPOLLET;
+    ev.data.fd = fd;
+    return epoll_ctl(e->epfd, op, fd, &ev);
+}
+
+static int ev_epoll_add(struct ev_backend *b, int fd, unsigned int events)
+{
+    return ev_epoll_ctl(b, EPOLL_CTL_ADD, fd, events);
+}
+
+static int ev_epoll_mod(struct ev_backend *b, int fd, unsigned int events)
+{
+    return ev_epoll_ctl(b, EPOLL_CTL_MOD, fd, events);
+}
+
+static int ev_epoll_del(struct ev_backend *b, int fd)
+{
+    return ev_epoll_ctl(b, EPOLL_CTL_DEL, fd, 0);
+}
+
+static int ev_epoll_wait(struct ev_backend *b, struct ev_event *evs, int max, int timeout)
+{
+    struct ev_epoll *e = b->priv;
+    int i, n;
+
+    if (max > e->cap)
+    {
+        struct epoll_event *events = realloc(e->events, max * sizeof(struct epoll_event));
+        if (events == NULL)
+            return -1;
+        e->events = events;
+        e->cap = max;
+    }
+
+    n = epoll_wait(e->epfd, e->events, max, timeout);
+    for (i = 0; i < n; ++i)
+    {
+        unsigned int rev = e->events[i].events;
+        unsigned int events = 0;
+        if (rev & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))
+            events |= EV_READ;
+        if (rev & EPOLLOUT)
+            events |= EV_WRITE;
+        if (rev & (EPOLLERR | EPOLLHUP))
+            events |= EV_ERROR;
+        evs[i].fd = e->events[i].data.fd;
+        evs[i].events = events;
+    }
+    return n;
+}
+
+static void ev_epoll_destroy(struct ev_backend *b)
+{
+    struct ev_epoll *e = b->priv;
+    close(e->epfd);
+    free(e->events);
+    free(e);
+    b->priv = NULL;
+}
+
+static const struct ev_ops ev_epoll_ops = {
+    .name    = "epoll",
+    .init    = ev_epoll_init,
+    .add     = ev_epoll_add,
+    .mod     = ev_epoll_mod,
+    .del     = ev_epoll_del,
+    .wait    = ev_epoll_wait,
+    .destroy = ev_epoll_destroy,
+};
+
+static const struct ev_ops *ev_backend_ops(unsigned short mode)
+{
+    switch (mode)
+    {
+    case MODE_SELECT:
+        return &ev_select_ops;
+    case MODE_POLL:
+        return &ev_poll_ops;
+    case MODE_EPOLL:
+        return &ev_epoll_ops;
+    default:
+        return NULL;
+    }
+}
+
+// the soft limit is usually 1024, take all we are allowed; returns the limit
+static int raise_nofile()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        lerror_exit("getrlimit %s", strerror(errno));
+
+    if (rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1 << 20))
+        rl.rlim_cur = 1 << 20;
+    return rl.rlim_cur;
+}
+
+/*
+ * io_uring
+ *
+ * completion based, so it does not fit ev_ops: the worker runs its own loop.
+ * one multishot accept keeps producing connections, each connection gets one
+ * multishot recv that picks buffers out of a provided buffer ring, echoes are
+ * sent straight from that buffer and it goes back to the ring when the send
+ * completes. every sqe queued while handling a batch of cqes goes to the
+ * kernel in the next io_uring_enter, which also waits for the next batch.
+ *
+ * a connection has at most one send in flight, the greeting first and then
+ * the received buffers in the order they came, so a short send never lets a
+ * later buffer overtake the rest of an earlier one. it is closed only when
+ * none of its ops is left in the kernel, or a late completion could act on
+ * a new connection that got the same fd number. when the buffer ring runs
+ * dry its recv is parked instead of rearmed, and a buffer coming back rearms
+ * the oldest parked one.
+ *
+ * raw syscalls against <linux/io_uring.h>, so no liburing needed. multishot
+ * recv and buffer rings want linux 6.0+.
+ */
+#define URING_ENTRIES   4096
+#define URING_BUF_COUNT 4096 // power of 2
+#define URING_BUF_SIZE  4096
+#define URING_BGID      1
+
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV   2
+#define URING_OP_SEND   3
+#define URING_OP_GREET  4
+#define URING_OP_CANCEL 5
+
+// user_data: op in bits 48-55, bid in bits 32-47, fd in bits 0-31
+#define URING_DATA(op, bid, fd) \
+    (((__u64)(op) << 48) | ((__u64)(__u16)(bid) << 32) | (__u32)(fd))
+#define URING_DATA_OP(d)  ((int)(((d) >> 48) & 0xff))
+#define URING_DATA_BID(d) ((int)(((d) >> 32) & 0xffff))
+#define URING_DATA_FD(d)  ((int)((d) & 0xffffffff))
+
+struct uring_conn
+{
+    int head;           // bids waiting to be sent, chained through buf_next
+    int tail;
+    unsigned int refs;  // ops in the kernel, the fd is closed when this is 0
+    unsigned int greet_off; // bytes of the greeting sent
+    int park_prev;      // fds in the parked list, -1 at the ends
+    int park_next;
+    unsigned char armed;    // a multishot recv is in the kernel
+    unsigned char sending;
+    unsigned char parked;   // recv waits for a free buffer
+    unsigned char eof;
+    unsigned char failed;
+};
+
+// fds are unique process wide, so every worker uses the same table
+static struct uring_conn *uring_conns = NULL;
+static int uring_conns_size = 0;
+
+static const char uring_greeting[BUFF_SIZE] = "from server";
+
+struct uring
+{
+    int fd;
+    unsigned int pending; // sqes queued but not submitted
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_entries;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    unsigned int *buf_len; // bytes in buffer bid waiting to be echoed
+    unsigned int *buf_off; // bytes of it already sent
+    int *buf_next;         // next bid queued on the same connection
+    int park_head;         // oldest parked connection, -1 for none
+    int park_tail;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_buf_add(struct uring *r, int bid)
+{
+    unsigned short tail = r->br->tail;
+    struct io_uring_buf *buf = &r->br->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len  = URING_BUF_SIZE;
+    buf->bid  = bid;
+    __atomic_store_n(&r->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_init(struct uring *r)
+{
+    struct io_uring_params p;
+    int i;
+
+    memset(r, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+    r->fd = uring_setup(URING_ENTRIES, &p);
+    if (r->fd == -1)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            return -1;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        return -1;
+
+    r->sq_head    = (unsigned int *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail    = (unsigned int *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask    = (unsigned int *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned int *)((char *)r->sq_ptr + p.sq_off.ring_entries);
+    r->sq_array   = (unsigned int *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head    = (unsigned int *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail    = (unsigned int *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask    = (unsigned int *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes       = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    // provided buffer ring, the kernel picks a buffer for every recv
+    r->br_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED)
+        return -1;
+    r->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    r->buf_len = calloc(URING_BUF_COUNT, sizeof(unsigned int));
+    r->buf_off = calloc(URING_BUF_COUNT, sizeof(unsigned int));
+    r->buf_next = calloc(URING_BUF_COUNT, sizeof(int));
+    if (r->bufs == NULL || r->buf_len == NULL || r->buf_off == NULL || r->buf_next == NULL)
+        return -1;
+    r->park_head = r->park_tail = -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    r->br->tail = 0;
+    for (i = 0; i < URING_BUF_COUNT; ++i)
+        uring_buf_add(r, i);
+
+    return 0;
+}
+
+static void uring_destroy(struct uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    if (r->br && r->br != MAP_FAILED)
+        munmap(r->br, r->br_len);
+    free(r->bufs);
+    free(r->buf_len);
+    free(r->buf_off);
+    free(r->buf_next);
+    if (r->fd > 0)
+        close(r->fd);
+}
+
+static int uring_submit(struct uring *r, unsigned int wait_nr)
+{
+    int ret;
+    unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+    do {
+        ret = uring_enter(r->fd, r->pending, wait_nr, flags);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret >= 0)
+        r->pending -= ret;
+    return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *r->sq_tail;
+
+    // sq full, flush it without waiting
+    if (tail - head >= *r->sq_entries)
+    {
+        if (uring_submit(r, 0) == -1)
+            lerror_exit("io_uring_enter %s", strerror(errno));
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= *r->sq_entries)
+            lerror_exit("io_uring sq stays full");
+    }
+
+    unsigned int idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
+}
+
+static void uring_prep_accept(struct uring *r, int listen_sock)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(URING_OP_ACCEPT, 0, listen_sock);
+}
+
+static void uring_prep_recv(struct uring *r, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_DATA(URING_OP_RECV, 0, fd);
+}
+
+static void uring_prep_send(struct uring *r, int fd, const void *buf, unsigned int len, int op, int bid)
 {
-    linfo("not implemented");
-    return;
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(op, bid, fd);
+}
+
+static void uring_send_buf(struct uring *r, int fd, int bid)
+{
+    char *buf = r->bufs + (size_t)bid * URING_BUF_SIZE;
+    uring_prep_send(r, fd, buf + r->buf_off[bid], r->buf_len[bid] - r->buf_off[bid], URING_OP_SEND, bid);
+}
+
+static void uring_prep_cancel(struct uring *r, __u64 user_data, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = URING_DATA(URING_OP_CANCEL, 0, fd);
+}
+
+static void uring_arm_recv(struct uring *r, int fd)
+{
+    struct uring_conn *c = &uring_conns[fd];
+    uring_prep_recv(r, fd);
+    c->armed = 1;
+    c->refs++;
+}
+
+static void uring_park(struct uring *r, int fd)
+{
+    struct uring_conn *c = &uring_conns[fd];
+    if (c->parked)
+        return;
+    c->parked = 1;
+    c->park_next = -1;
+    c->park_prev = r->park_tail;
+    if (r->park_tail != -1)
+        uring_conns[r->park_tail].park_next = fd;
+    else
+        r->park_head = fd;
+    r->park_tail = fd;
+}
+
+static void uring_unpark(struct uring *r, int fd)
+{
+    struct uring_conn *c = &uring_conns[fd];
+    if (!c->parked)
+        return;
+    if (c->park_prev != -1)
+        uring_conns[c->park_prev].park_next = c->park_next;
+    else
+        r->park_head = c->park_next;
+    if (c->park_next != -1)
+        uring_conns[c->park_next].park_prev = c->park_prev;
+    else
+        r->park_tail = c->park_prev;
+    c->parked = 0;
+}
+
+// give a buffer back to the kernel, and with it a recv that had none
+static void uring_buf_recycle(struct uring *r, int bid)
+{
+    uring_buf_add(r, bid);
+    if (r->park_head != -1)
+    {
+        int fd = r->park_head;
+        uring_unpark(r, fd);
+        uring_arm_recv(r, fd);
+    }
+}
+
+// start the next send of a connection unless one is in flight
+static void uring_conn_send(struct uring *r, int fd)
+{
+    struct uring_conn *c = &uring_conns[fd];
+
+    if (c->sending || c->failed)
+        return;
+    if (c->greet_off < BUFF_SIZE)
+        uring_prep_send(r, fd, uring_greeting + c->greet_off, BUFF_SIZE - c->greet_off, URING_OP_GREET, 0);
+    else if (c->head != -1)
+        uring_send_buf(r, fd, c->head);
+    else
+        return;
+    c->sending = 1;
+    c->refs++;
+}
+
+// close once nothing is left in the kernel and the connection is done
+static void uring_conn_release(struct uring *r, int fd)
+{
+    struct uring_conn *c = &uring_conns[fd];
+
+    if (c->refs > 0 || !(c->failed || c->eof))
+        return;
+    while (c->head != -1)
+    {
+        int bid = c->head;
+        c->head = r->buf_next[bid];
+        uring_buf_recycle(r, bid);
+    }
+    uring_unpark(r, fd);
+    close(fd);
+    mt_gauge_add(m_conns, -1);
+}
+
+static void uring_conn_fail(struct uring *r, int fd)
+{
+    struct uring_conn *c = &uring_conns[fd];
+
+    c->failed = 1;
+    uring_unpark(r, fd);
+    if (c->armed)
+        uring_prep_cancel(r, URING_DATA(URING_OP_RECV, 0, fd), fd);
+    uring_conn_release(r, fd);
+}
+
+/*
+ * receive buffers and per-connection state
+ *
+ * buffers come from a per-worker pool of power-of-2 size classes carved out
+ * of big slabs, so the hot path never calls malloc: only refilling an empty
+ * class does, and slabs are never given back. a connection only holds a
+ * buffer while it has unconsumed bytes, so idle connections cost just their
+ * slot in the conn table; the size it grew to is kept as a hint for its
+ * next read.
+ *
+ * what cannot be written right away is copied into a queue of pool chunks
+ * and flushed with writev on EV_WRITE, which is only registered while the
+ * queue is not empty. past the high watermark the client is not read any
+ * more, so a peer that does not drain its replies cannot grow the queue
+ * without bound; reading resumes below the low watermark.
+ */
+#define POOL_MIN_SHIFT 12 // 4K
+#define POOL_CLASSES   9  // 4K .. 1M
+#define POOL_SLAB_SIZE (1 << 20)
+
+#define POOL_CLASS_SIZE(c) ((size_t)1 << (POOL_MIN_SHIFT + (c)))
+
+struct pool_free
+{
+    struct pool_free *next;
+};
+
+struct buf_pool
+{
+    struct pool_free *free[POOL_CLASSES];
+    void **slabs;
+    int nslab;
+    int slab_cap;
+};
+
+struct out_chunk
+{
+    struct out_chunk *next;
+    unsigned int cls;
+    unsigned int off;   // first unsent byte in data
+    unsigned int len;   // bytes in data
+    char data[];
+};
+
+struct conn
+{
+    char *rbuf;
+    unsigned int rlen;  // unconsumed bytes in rbuf
+    unsigned char rcls; // size class of rbuf, or of the next one
+    unsigned char events; // interest registered with the backend
+    unsigned char paused; // over the high watermark, not reading
+    struct out_chunk *oq_head;
+    struct out_chunk *oq_tail;
+    size_t oq_bytes;    // unsent bytes in the queue
+    off_t file_off;     // how much of the payload file is sent
+    struct tw_node timer;
+    unsigned long long last_active; // ms, last read or write
+    unsigned long long read_since;  // ms, a partial frame has been waiting since
+    unsigned long long write_since; // ms, last write progress
+};
+
+static struct conn *conn_table = NULL;
+static int conn_table_size = 0;
+
+static int pool_refill(struct buf_pool *pool, int cls)
+{
+    size_t size = POOL_CLASS_SIZE(cls);
+    size_t slab_size = size > POOL_SLAB_SIZE ? size : POOL_SLAB_SIZE;
+    size_t off;
+
+    if (pool->nslab == pool->slab_cap)
+    {
+        int cap = pool->slab_cap ? pool->slab_cap * 2 : 16;
+        void **slabs = realloc(pool->slabs, cap * sizeof(void *));
+        if (slabs == NULL)
+            return -1;
+        pool->slabs = slabs;
+        pool->slab_cap = cap;
+    }
+
+    char *slab = malloc(slab_size);
+    if (slab == NULL)
+        return -1;
+    pool->slabs[pool->nslab++] = slab;
+
+    for (off = 0; off + size <= slab_size; off += size)
+    {
+        struct pool_free *f = (struct pool_free *)(slab + off);
+        f->next = pool->free[cls];
+        pool->free[cls] = f;
+    }
+    return 0;
+}
+
+static char *pool_get(struct buf_pool *pool, int cls)
+{
+    if (pool->free[cls] == NULL && pool_refill(pool, cls) == -1)
+        return NULL;
+
+    struct pool_free *f = pool->free[cls];
+    pool->free[cls] = f->next;
+    return (char *)f;
+}
+
+// smallest class that holds size, or the largest one
+static int pool_class(size_t size)
+{
+    int cls = 0;
+    while (cls < POOL_CLASSES - 1 && POOL_CLASS_SIZE(cls) < size)
+        cls++;
+    return cls;
+}
+
+static void pool_put(struct buf_pool *pool, int cls, char *buf)
+{
+    struct pool_free *f = (struct pool_free *)buf;
+    f->next = pool->free[cls];
+    pool->free[cls] = f;
+}
+
+static void pool_destroy(struct buf_pool *pool)
+{
+    int i;
+    for (i = 0; i < pool->nslab; ++i)
+        free(pool->slabs[i]);
+    free(pool->slabs);
+    memset(pool, 0, sizeof(struct buf_pool));
+}
+
+// fds are unique process wide and each one is owned by a single worker,
+// so all workers share one table without locking
+static void conn_table_init()
+{
+    conn_table_size = raise_nofile();
+    conn_table = calloc(conn_table_size, sizeof(struct conn));
+    if (conn_table == NULL)
+        lerror_exit("calloc conn table of %d", conn_table_size);
+}
+
+static struct conn *conn_get(int fd)
+{
+    if (fd < 0 || fd >= conn_table_size)
+        return NULL;
+    return &conn_table[fd];
+}
+
+// make sure there is room to read into, growing the buffer when it is full
+static int conn_reserve(struct buf_pool *pool, struct conn *c)
+{
+    if (c->rbuf == NULL)
+    {
+        c->rbuf = pool_get(pool, c->rcls);
+        return c->rbuf ? 0 : -1;
+    }
+
+    if (c->rlen < POOL_CLASS_SIZE(c->rcls) || c->rcls == POOL_CLASSES - 1)
+        return 0;
+
+    char *buf = pool_get(pool, c->rcls + 1);
+    if (buf == NULL)
+        return -1;
+    memcpy(buf, c->rbuf, c->rlen);
+    pool_put(pool, c->rcls, c->rbuf);
+    c->rbuf = buf;
+    c->rcls++;
+    return 0;
+}
+
+// hand the buffer back once it is drained
+static void conn_release(struct buf_pool *pool, struct conn *c)
+{
+    if (c->rbuf && c->rlen == 0)
+    {
+        pool_put(pool, c->rcls, c->rbuf);
+        c->rbuf = NULL;
+    }
+}
+
+static void conn_reset(struct buf_pool *pool, struct conn *c)
+{
+    struct out_chunk *oc, *next;
+
+    if (c->rbuf)
+        pool_put(pool, c->rcls, c->rbuf);
+    for (oc = c->oq_head; oc; oc = next)
+    {
+        next = oc->next;
+        pool_put(pool, oc->cls, (char *)oc);
+    }
+    memset(c, 0, sizeof(struct conn));
+}
+
+// copy data to the tail of the output queue
+static int conn_queue(struct buf_pool *pool, struct conn *c, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        struct out_chunk *oc = c->oq_tail;
+        size_t room = oc ? POOL_CLASS_SIZE(oc->cls) - sizeof(struct out_chunk) - oc->len : 0;
+
+        if (room == 0)
+        {
+            int cls = pool_class(len + sizeof(struct out_chunk));
+            oc = (struct out_chunk *)pool_get(pool, cls);
+            if (oc == NULL)
+                return -1;
+            oc->next = NULL;
+            oc->cls = cls;
+            oc->off = oc->len = 0;
+            if (c->oq_tail)
+                c->oq_tail->next = oc;
+            else
+                c->oq_head = oc;
+            c->oq_tail = oc;
+            room = POOL_CLASS_SIZE(cls) - sizeof(struct out_chunk);
+        }
+
+        size_t take = len < room ? len : room;
+        memcpy(oc->data + oc->len, data, take);
+        oc->len += take;
+        c->oq_bytes += take;
+        data += take;
+        len -= take;
+    }
+    return 0;
+}
+
+struct worker
+{
+    pthread_t tid;
+    int id;
+    int listen_sock;
+    struct ev_backend ev;
+    struct buf_pool pool;
+    struct twheel *wheel;     // connection deadlines
+    unsigned long long now;   // ms, taken once per loop
+    int spare_fd;             // given up to accept and drop a client when out of fds
+    int accept_retry;         // the backlog was left waiting for a free fd
+};
+
+static int stream_listen_socket()
+{
+    int ret = 0;
+    int on = 1;
+    int sock = stream_socket();
+
+    // every worker binds the same addr, the kernel hashes connections across them
+    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (ret == -1)
+        lerror_exit("setsockopt SO_REUSEADDR %s", strerror(errno));
+    ret = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if (ret == -1)
+        lerror_exit("setsockopt SO_REUSEPORT %s", strerror(errno));
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(struct sockaddr_in));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(args_s.ip);
+    server.sin_port = htons(args_s.port);
+
+    ret = bind(sock, (struct sockaddr*)&server, sizeof(server));
+    if (ret == -1)
+        lerror_exit("bind %s:%d %s", args_s.ip, args_s.port, strerror(errno));
+    set_noblock(sock);
+    ret = listen(sock, args_s.backlog);
+    if (ret == -1)
+        lerror_exit("listen %s", strerror(errno));
+
+    return sock;
+}
+
+static void bind_worker_cpu(struct worker *w)
+{
+    cpu_set_t set;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->id % ncpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        lerror("worker %d sched_setaffinity %s", w->id, strerror(errno));
+    else
+        linfo("worker %d bound to cpu %ld", w->id, w->id % ncpu);
+}
+
+static void close_conn(struct worker *w, int fd)
+{
+    struct conn *c = conn_get(fd);
+    if (w->ev.ops->del(&w->ev, fd) == -1)
+        lerror("%s del %d %s", w->ev.ops->name, fd, strerror(errno));
+    tw_del(w->wheel, &c->timer);
+    conn_reset(&w->pool, c);
+    close(fd);
+    mt_gauge_add(m_conns, -1);
+
+    // an fd is free again, take the spare back and see to the backlog
+    if (w->spare_fd == -1)
+    {
+        w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        w->accept_retry = w->spare_fd != -1;
+    }
+}
+
+static unsigned long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * connection deadlines
+ *
+ * every connection has one timer for the earliest of its idle, read and
+ * write deadlines. traffic only pushes deadlines out, so a read just
+ * stamps last_active and the timer stays where it is; when it fires the
+ * real deadline is worked out again and the timer re-armed if it moved.
+ * only a deadline that starts earlier than the armed one (a partial frame,
+ * output getting stuck) moves the timer right away.
+ */
+#define TIMEOUT_NONE (~0ULL)
+
+static unsigned long long conn_deadline(struct conn *c, const char **why)
+{
+    unsigned long long d = TIMEOUT_NONE;
+
+    if (args_s.idle_timeout)
+    {
+        d = c->last_active + args_s.idle_timeout;
+        *why = "idle";
+    }
+    if (args_s.read_timeout && c->rlen > 0 && c->read_since + args_s.read_timeout < d)
+    {
+        d = c->read_since + args_s.read_timeout;
+        *why = "read";
+    }
+    if (args_s.write_timeout && (c->oq_bytes > 0 || c->file_off < payload_size) &&
+        c->write_since + args_s.write_timeout < d)
+    {
+        d = c->write_since + args_s.write_timeout;
+        *why = "write";
+    }
+    return d;
+}
+
+static void conn_timer_update(struct worker *w, struct conn *c)
+{
+    const char *why = NULL;
+    unsigned long long d = conn_deadline(c, &why);
+    if (d == TIMEOUT_NONE)
+        return;
+
+    unsigned long long tick = (d + TW_TICK_MS - 1) / TW_TICK_MS;
+    if (!tw_pending(&c->timer) || tick < c->timer.expire)
+        tw_add(w->wheel, &c->timer, tick);
+}
+
+static void conn_timer_fire(struct tw_node *node, void *arg)
+{
+    struct worker *w = arg;
+    struct conn *c = (struct conn *)((char *)node - offsetof(struct conn, timer));
+    int fd = c - conn_table;
+    const char *why = NULL;
+    unsigned long long d = conn_deadline(c, &why);
+
+    if (d == TIMEOUT_NONE)
+        return;
+    if (d > w->now)
+    {
+        tw_add(w->wheel, &c->timer, (d + TW_TICK_MS - 1) / TW_TICK_MS);
+        return;
+    }
+
+    ldebug("%d hit its %s timeout, close it", fd, why);
+    mt_add(m_timeouts, 1);
+    close_conn(w, fd);
+}
+
+// register what the connection is waiting for, if that changed
+static void conn_update_events(struct worker *w, int fd, struct conn *c)
+{
+    unsigned char events = EV_ET;
+    if (!c->paused)
+        events |= EV_READ;
+    if (c->oq_bytes > 0 || c->file_off < payload_size)
+        events |= EV_WRITE;
+
+    if (events == c->events)
+        return;
+    if (w->ev.ops->mod(&w->ev, fd, events) == -1)
+        lerror("%s mod %d %s", w->ev.ops->name, fd, strerror(errno));
+    else
+        c->events = events;
+}
+
+// writev the output queue, then sendfile the payload. returns -1 once fd is closed
+static int conn_flush(struct worker *w, int fd)
+{
+    struct conn *c = conn_get(fd);
+    struct iovec iov[OUT_IOV_MAX];
+    struct out_chunk *oc;
+    ssize_t n;
+    int cnt;
+
+    while (c->oq_bytes > 0)
+    {
+        for (cnt = 0, oc = c->oq_head; oc && cnt < OUT_IOV_MAX; oc = oc->next, ++cnt)
+        {
+            iov[cnt].iov_base = oc->data + oc->off;
+            iov[cnt].iov_len = oc->len - oc->off;
+        }
+
+        n = writev(fd, iov, cnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                goto wait;
+            lerror_rl(10, 10, "writev to %d: %s", fd, strerror(errno));
+            close_conn(w, fd);
+            return -1;
+        }
+
+        c->oq_bytes -= n;
+        c->last_active = c->write_since = w->now;
+        mt_add(m_tx_bytes, n);
+        while (n > 0)
+        {
+            oc = c->oq_head;
+            size_t left = oc->len - oc->off;
+            if ((size_t)n < left)
+            {
+                oc->off += n;
+                break;
+            }
+            n -= left;
+            c->oq_head = oc->next;
+            if (c->oq_head == NULL)
+                c->oq_tail = NULL;
+            pool_put(&w->pool, oc->cls, (char *)oc);
+        }
+    }
+
+    while (c->file_off < payload_size)
+    {
+        n = sendfile(fd, payload_fd, &c->file_off, payload_size - c->file_off);
+        if (n > 0)
+        {
+            c->last_active = c->write_since = w->now;
+            mt_add(m_tx_bytes, n);
+        }
+        if (n > 0 || (n == -1 && errno == EINTR))
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            goto wait;
+
+        lerror_rl(10, 10, "sendfile to %d: %s", fd, n == 0 ? "file shrunk" : strerror(errno));
+        close_conn(w, fd);
+        return -1;
+    }
+
+wait:
+    conn_update_events(w, fd, c);
+    return 0;
+}
+
+/*
+ * write iov, queueing whatever the socket does not take. nothing goes out
+ * directly while older bytes are queued, so ordering holds. returns -1
+ * once fd is closed
+ */
+static int conn_send(struct worker *w, int fd, struct iovec *iov, int cnt)
+{
+    struct conn *c = conn_get(fd);
+    ssize_t n = 0;
+    int i;
+    int was_empty = c->oq_bytes == 0;
+
+    if (c->oq_bytes == 0)
+    {
+        do {
+            n = writev(fd, iov, cnt);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            lerror_rl(10, 10, "writev to %d: %s", fd, strerror(errno));
+            close_conn(w, fd);
+            return -1;
+        }
+        if (n == -1)
+            n = 0;
+        mt_add(m_tx_bytes, n);
+    }
+
+    for (i = 0; i < cnt; ++i)
+    {
+        if ((size_t)n >= iov[i].iov_len)
+        {
+            n -= iov[i].iov_len;
+            continue;
+        }
+        if (conn_queue(&w->pool, c, (char *)iov[i].iov_base + n, iov[i].iov_len - n) == -1)
+        {
+            lerror_rl(10, 10, "no buffer to queue output for %d, close it", fd);
+            close_conn(w, fd);
+            return -1;
+        }
+        n = 0;
+    }
+
+    // the write deadline starts when output gets stuck
+    if (was_empty && c->oq_bytes > 0)
+    {
+        c->write_since = w->now;
+        conn_timer_update(w, c);
+    }
+
+    if (c->oq_bytes >= args_s.high_water && !c->paused)
+    {
+        ldebug("%d has %zu bytes queued, stop reading it", fd, c->oq_bytes);
+        c->paused = 1;
+    }
+    conn_update_events(w, fd, c);
+    return 0;
+}
+
+/*
+ * out of fds: the listener is edge-triggered, so leaving the backlog alone
+ * would keep it waiting for the next client to connect. give up the spare
+ * fd for a moment to accept one client and close it, so it is told at once
+ * instead of hanging. returns -1 when that is not possible
+ */
+static int accept_reject(struct worker *w)
+{
+    int fd;
+
+    if (w->spare_fd == -1)
+        return -1;
+    close(w->spare_fd);
+    fd = accept4(w->listen_sock, NULL, NULL, SOCK_CLOEXEC);
+    if (fd != -1)
+        close(fd);
+    // another thread may take the fd first, then close_conn gets it back
+    w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    mt_add(m_rejects, 1);
+    lwarn_rl(1, 1, "worker %d out of fds, dropped a client", w->id);
+    return 0;
+}
+
+// drain the accept queue with accept4, then set up the new fds in one pass
+static void accept_conns(struct worker *w)
+{
+    static const char greeting[BUFF_SIZE] = "from server";
+    int fds[ACCEPT_BATCH];
+    int n, i, ret;
+    struct sockaddr_in client;
+    char ip[INET_ADDRSTRLEN];
+
+    do {
+        for (n = 0; n < ACCEPT_BATCH; )
+        {
+            socklen_t len = sizeof(client);
+            int fd = accept4(w->listen_sock, (struct sockaddr*)&client, &len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if ((errno == EMFILE || errno == ENFILE) && accept_reject(w) == 0)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    lerror_rl(10, 10, "worker %d accept4 %s", w->id, strerror(errno));
+                break;
+            }
+            if (conn_get(fd) == NULL)
+            {
+                lerror_rl(10, 10, "fd %d out of conn table, close it", fd);
+                close(fd);
+                continue;
+            }
+            ldebug("worker %d accept client: %s %d", w->id,
+                  inet_ntop(AF_INET, &client.sin_addr, ip, sizeof(ip)), ntohs(client.sin_port));
+            fds[n++] = fd;
+        }
+
+        for (i = 0; i < n; ++i)
+        {
+            struct iovec iov = { .iov_base = (void *)greeting, .iov_len = BUFF_SIZE };
+
+            ret = w->ev.ops->add(&w->ev, fds[i], EV_READ | EV_ET);
+            if (ret == -1)
+            {
+                lerror("%s add %d %s", w->ev.ops->name, fds[i], strerror(errno));
+                close(fds[i]);
+                continue;
+            }
+            conn_get(fds[i])->events = EV_READ | EV_ET;
+            conn_get(fds[i])->last_active = w->now;
+            mt_add(m_accepts, 1);
+            mt_gauge_add(m_conns, 1);
+            conn_timer_update(w, conn_get(fds[i]));
+
+            if (conn_send(w, fds[i], &iov, 1) == -1)
+                continue;
+            if (payload_fd != -1)
+                conn_flush(w, fds[i]);
+        }
+        if (n > 0)
+            ltrace("worker %d %s add %d new fds", w->id, w->ev.ops->name, n);
+    } while (n == ACCEPT_BATCH);
+}
+
+// echo every complete frame in rbuf, up to FRAME_IOV_MAX of them per
+// writev, and keep a trailing partial frame for the next read
+static int conn_process(struct worker *w, int fd, struct conn *c)
+{
+    struct iovec iov[FRAME_IOV_MAX];
+    struct frame f;
+    size_t max = POOL_CLASS_SIZE(POOL_CLASSES - 1);
+    size_t off = 0;
+    int n = 0, frames = 0, ret;
+
+    while ((ret = frame_next(args_s.frame, c->rbuf + off, c->rlen - off, max, &f)) > 0)
+    {
+        iov[n].iov_base = (void *)f.data;
+        iov[n].iov_len = f.len;
+        off += ret;
+        frames++;
+        if (++n == FRAME_IOV_MAX)
+        {
+            if (conn_send(w, fd, iov, n) == -1)
+                return -1;
+            n = 0;
+        }
+    }
+    if (n > 0 && conn_send(w, fd, iov, n) == -1)
+        return -1;
+
+    if (ret == -1)
+    {
+        lerror_rl(10, 10, "frame from %d is over %zu bytes, close it", fd, max);
+        close_conn(w, fd);
+        return -1;
+    }
+
+    if (frames > 0)
+    {
+        ltrace("recv from %d: %d frames", fd, frames);
+        mt_add(m_frames, frames);
+        c->read_since = 0; // whatever is left is the start of a new frame
+    }
+    if (off > 0 && off < c->rlen)
+        memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+    c->rlen -= off;
+    return 0;
+}
+
+// read until EAGAIN, echoing every frame. returns -1 once fd is closed
+static int conn_on_read(struct worker *w, int fd)
+{
+    struct conn *c = conn_get(fd);
+    int ret = 0;
+
+    for (;;)
+    {
+        if (conn_reserve(&w->pool, c) == -1)
+        {
+            lerror_rl(10, 10, "no buffer for %d, close it", fd);
+            close_conn(w, fd);
+            return -1;
+        }
+
+        size_t room = POOL_CLASS_SIZE(c->rcls) - c->rlen;
+        // the largest buffer is full, consume before reading on
+        if (room == 0)
+        {
+            if (conn_process(w, fd, c) == -1)
+                return -1;
+            if (c->paused)
+                return 0;
+            continue;
+        }
+
+        ret = recv(fd, c->rbuf + c->rlen, room, 0);
+        if (ret <= 0)
+            break;
+
+        ltrace("recv from %d: %d bytes", fd, ret);
+        c->rlen += ret;
+        c->last_active = w->now;
+        mt_add(m_rx_bytes, ret);
+        // a full read means more is probably queued, let the buffer grow
+        // so the next recv takes it in one go
+        if ((size_t)ret < room && conn_process(w, fd, c) == -1)
+            return -1;
+        // leave the rest in the socket until the client takes its replies
+        if (c->paused)
+            return 0;
+    }
+
+    if (c->rlen > 0 && conn_process(w, fd, c) == -1)
+        return -1;
+    if (c->paused)
+        return 0;
+
+    if (ret == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            ltrace("recv from %d: %d, try again", fd, errno);
+            // the read deadline starts with the first byte of a partial frame
+            if (c->rlen == 0)
+            {
+                c->read_since = 0;
+            }
+            else if (c->read_since == 0)
+            {
+                c->read_since = w->now;
+                conn_timer_update(w, c);
+            }
+            conn_release(&w->pool, c);
+            return 0;
+        }
+        lerror_rl(10, 10, "recv from %d: %s, delete it from %s", fd, strerror(errno), w->ev.ops->name);
+    }
+    else
+    {
+        ldebug("client of %d closed, delete from %s", fd, w->ev.ops->name);
+    }
+    close_conn(w, fd);
+    return -1;
+}
+
+// flush, and once the queue is below the low watermark read what piled up
+static int conn_on_write(struct worker *w, int fd)
+{
+    struct conn *c = conn_get(fd);
+    if (conn_flush(w, fd) == -1)
+        return -1;
+
+    if (c->paused && c->oq_bytes <= args_s.low_water)
+    {
+        ldebug("%d drained to %zu bytes, read it again", fd, c->oq_bytes);
+        c->paused = 0;
+        conn_update_events(w, fd, c);
+        // edge-triggered: data that came in while paused will not wake us
+        return conn_on_read(w, fd);
+    }
+    return 0;
+}
+
+// an error or hangup the read path did not see: it comes back on every
+// level-triggered wait until the fd is closed
+static void conn_on_error(struct worker *w, int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err != 0)
+        lerror_rl(10, 10, "socket %d: %s, delete it from %s", fd, strerror(err), w->ev.ops->name);
+    else
+        ldebug("client of %d hung up, delete from %s", fd, w->ev.ops->name);
+    close_conn(w, fd);
+}
+
+static void *stream_worker(void *arg)
+{
+    struct worker *w = arg;
+    int ret = 0;
+    int nfd = 0;
+    int i = 0;
+    int listen_sock = w->listen_sock;
+
+    if (args_s.affinity)
+        bind_worker_cpu(w);
+
+    w->now = now_ms();
+    w->wheel = malloc(sizeof(struct twheel));
+    if (w->wheel == NULL)
+        lerror_exit("malloc timer wheel");
+    tw_init(w->wheel, w->now / TW_TICK_MS);
+
+    w->ev.ops = ev_backend_ops(args_s.mode);
+    if (w->ev.ops->init(&w->ev) == -1)
+        lerror_exit("%s init %s", w->ev.ops->name, strerror(errno));
+
+    w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (w->spare_fd == -1)
+        lerror_exit("open /dev/null %s", strerror(errno));
+
+    struct ev_event events[MAX_EVENT];
+    // accept_conns drains the backlog every time, so edge-triggered is enough
+    ret = w->ev.ops->add(&w->ev, listen_sock, EV_READ | EV_ET);
+    if (ret == -1)
+        lerror_exit("%s add %s", w->ev.ops->name, strerror(errno));
+
+    for(;;)
+    {
+        // with timers armed wake up every tick to run the wheel
+        nfd = w->ev.ops->wait(&w->ev, events, MAX_EVENT, w->wheel->count ? TW_TICK_MS : -1);
+        if (nfd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror_exit("%s wait %s", w->ev.ops->name, strerror(errno));
+        }
+        w->now = now_ms();
+        unsigned long long start = nfd > 0 ? now_ns() : 0;
+
+        for(i = 0; i < nfd; ++i)
+        {
+            // get new connections
+            if (events[i].fd == listen_sock)
+            {
+                accept_conns(w);
+            }
+            else
+            {
+                if ((events[i].events & EV_WRITE) && conn_on_write(w, events[i].fd) == -1)
+                    continue;
+                // read and echo it back
+                if ((events[i].events & EV_READ) && !conn_get(events[i].fd)->paused)
+                    conn_on_read(w, events[i].fd);
+                else if (events[i].events & EV_ERROR)
+                    conn_on_error(w, events[i].fd);
+            }
+        }
+
+        if (nfd > 0)
+            mt_observe(m_batch, now_ns() - start);
+        tw_advance(w->wheel, w->now / TW_TICK_MS, conn_timer_fire, w);
+        if (w->accept_retry)
+        {
+            w->accept_retry = 0;
+            accept_conns(w);
+        }
+    }
+
+    w->ev.ops->destroy(&w->ev);
+    pool_destroy(&w->pool);
+    free(w->wheel);
+    return NULL;
+}
+
+static void uring_handle_cqe(struct worker *w, struct uring *r, struct io_uring_cqe *cqe)
+{
+    int op  = URING_DATA_OP(cqe->user_data);
+    int fd  = URING_DATA_FD(cqe->user_data);
+    int bid = URING_DATA_BID(cqe->user_data);
+    int res = cqe->res;
+    struct uring_conn *c = op == URING_OP_ACCEPT || op == URING_OP_CANCEL ? NULL : &uring_conns[fd];
+
+    switch (op)
+    {
+    case URING_OP_ACCEPT:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring_prep_accept(r, fd);
+        if (res < 0)
+        {
+            lerror_rl(10, 10, "worker %d accept %s", w->id, strerror(-res));
+            break;
+        }
+        if (res >= uring_conns_size)
+        {
+            lerror_rl(10, 10, "worker %d fd %d beyond the connection table", w->id, res);
+            close(res);
+            break;
+        }
+        ldebug("worker %d accept client %d", w->id, res);
+        mt_add(m_accepts, 1);
+        mt_gauge_add(m_conns, 1);
+        c = &uring_conns[res];
+        memset(c, 0, sizeof(struct uring_conn));
+        c->head = c->tail = -1;
+        uring_conn_send(r, res);
+        uring_arm_recv(r, res);
+        break;
+    case URING_OP_RECV:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            c->armed = 0;
+            c->refs--;
+        }
+        if (res == -ENOBUFS)
+        {
+            // every buffer is in flight, the next one given back rearms it
+            if (!c->failed && !c->eof)
+                uring_park(r, fd);
+            break;
+        }
+        if (res <= 0)
+        {
+            if (res == 0)
+            {
+                ldebug("client of %d closed", fd);
+                c->eof = 1; // echo what is queued, then close
+            }
+            else if (res != -ECANCELED)
+            {
+                lerror_rl(10, 10, "recv from %d: %s", fd, strerror(-res));
+                c->failed = 1;
+            }
+            uring_conn_release(r, fd);
+            break;
+        }
+
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ltrace("recv from %d: %d bytes", fd, res);
+        mt_add(m_rx_bytes, res);
+        if (c->failed)
+        {
+            uring_buf_recycle(r, bid);
+            uring_conn_release(r, fd);
+            break;
+        }
+        r->buf_len[bid] = res;
+        r->buf_off[bid] = 0;
+        r->buf_next[bid] = -1;
+        if (c->tail != -1)
+            r->buf_next[c->tail] = bid;
+        else
+            c->head = bid;
+        c->tail = bid;
+        if (!c->armed)
+            uring_arm_recv(r, fd);
+        uring_conn_send(r, fd);
+        break;
+    case URING_OP_SEND:
+    case URING_OP_GREET:
+        c->refs--;
+        c->sending = 0;
+        if (res <= 0)
+        {
+            if (res < 0 && res != -EPIPE && res != -ECONNRESET)
+                lerror_rl(10, 10, "send to %d: %s", fd, strerror(-res));
+            uring_conn_fail(r, fd);
+            break;
+        }
+        mt_add(m_tx_bytes, res);
+        if (op == URING_OP_GREET)
+        {
+            c->greet_off += res;
+        }
+        else if ((r->buf_off[bid] += res) == r->buf_len[bid])
+        {
+            c->head = r->buf_next[bid];
+            if (c->head == -1)
+                c->tail = -1;
+            uring_buf_recycle(r, bid);
+        }
+        uring_conn_send(r, fd);
+        uring_conn_release(r, fd);
+        break;
+    case URING_OP_CANCEL:
+        break;
+    default:
+        lerror("unknown io_uring op %d", op);
+    }
+}
+
+static void *uring_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct uring r;
+
+    if (args_s.affinity)
+        bind_worker_cpu(w);
+
+    if (uring_init(&r) == -1)
+        lerror_exit("worker %d io_uring init %s", w->id, strerror(errno));
+
+    uring_prep_accept(&r, w->listen_sock);
+
+    for (;;)
+    {
+        // submit everything queued by the previous batch and wait for the next
+        if (uring_submit(&r, 1) == -1)
+            lerror_exit("io_uring_enter %s", strerror(errno));
+
+        unsigned int head = *r.cq_head;
+        unsigned int tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+            uring_handle_cqe(w, &r, &r.cqes[head & *r.cq_mask]);
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_destroy(&r);
+    return NULL;
+}
+
+static void create_stream_server()
+{
+    int i = 0;
+    int ret = 0;
+    int nworker = args_s.workers;
+    struct worker *workers = calloc(nworker, sizeof(struct worker));
+    if (workers == NULL)
+        lerror_exit("calloc workers");
+
+    if (args_s.mode != MODE_URING)
+        conn_table_init();
+    else if (args_s.frame != FRAME_NONE)
+        lerror_exit("-F is not supported with io_uring, it echoes raw bytes");
+    else if (args_s.idle_timeout || args_s.read_timeout || args_s.write_timeout)
+        lerror_exit("-i/-r/-W are not supported with io_uring");
+    else
+    {
+        uring_conns_size = raise_nofile();
+        uring_conns = calloc(uring_conns_size, sizeof(struct uring_conn));
+        if (uring_conns == NULL)
+            lerror_exit("calloc connection table of %d", uring_conns_size);
+    }
+
+    if (args_s.file != NULL)
+    {
+        struct stat st;
+        if (args_s.mode == MODE_URING)
+            lerror_exit("-f is not supported with io_uring");
+        payload_fd = open(args_s.file, O_RDONLY);
+        if (payload_fd == -1 || fstat(payload_fd, &st) == -1)
+            lerror_exit("open %s %s", args_s.file, strerror(errno));
+        payload_size = st.st_size;
+    }
+
+    // open every listen socket before any worker runs, so a bind failure aborts early
+    for (i = 0; i < nworker; ++i)
+    {
+        workers[i].id = i;
+        workers[i].listen_sock = stream_listen_socket();
+    }
+
+    void *(*worker_fn)(void *) = stream_worker;
+    if (args_s.mode == MODE_URING)
+        worker_fn = uring_worker;
+
+    if (nworker == 1)
+    {
+        worker_fn(&workers[0]);
+    }
+    else
+    {
+        linfo("start %d %s workers on %s:%d", nworker,
+              args_s.mode == MODE_URING ? "io_uring" : ev_backend_ops(args_s.mode)->name,
+              args_s.ip, args_s.port);
+        for (i = 0; i < nworker; ++i)
+        {
+            ret = pthread_create(&workers[i].tid, NULL, worker_fn, &workers[i]);
+            if (ret != 0)
+                lerror_exit("pthread_create worker %d %s", i, strerror(ret));
+        }
+        for (i = 0; i < nworker; ++i)
+            pthread_join(workers[i].tid, NULL);
+    }
+
+    for (i = 0; i < nworker; ++i)
+        close(workers[i].listen_sock);
+    free(workers);
+    free(conn_table);
+    if (payload_fd != -1)
+        close(payload_fd);
+}
+
+/*
+ * datagram server: every worker blocks in recvmmsg on its own SO_REUSEPORT
+ * socket, -v datagrams per call into iovecs set up once, and the main
+ * thread prints the packet rate of all workers once a second. the event
+ * backends are not involved, a socket per thread needs no readiness loop.
+ */
+static int dgram_bind_socket()
+{
+    int on = 1;
+    int sock = dgram_socket();
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        lerror_exit("setsockopt SO_REUSEPORT %s", strerror(errno));
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(struct sockaddr_in));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(args_s.ip);
+    server.sin_port = htons(args_s.port);
+    if (bind(sock, (struct sockaddr*)&server, sizeof(server)) == -1)
+        lerror_exit("bind %s:%d %s", args_s.ip, args_s.port, strerror(errno));
+
+    if (args_s.gro && setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1)
+        lerror("UDP_GRO %s", strerror(errno));
+
+    return sock;
+}
+
+static void *dgram_worker(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int vlen = args_s.vlen;
+    size_t ctrl_size = CMSG_SPACE(sizeof(int));
+    unsigned int i;
+
+    if (args_s.affinity)
+        bind_worker_cpu(w);
+
+    struct mmsghdr *msgs = calloc(vlen, sizeof(struct mmsghdr));
+    struct iovec *iovs = calloc(vlen, sizeof(struct iovec));
+    char *bufs = malloc((size_t)vlen * DGRAM_BUF_SIZE);
+    char *ctrls = calloc(vlen, ctrl_size);
+    if (msgs == NULL || iovs == NULL || bufs == NULL || ctrls == NULL)
+        lerror_exit("worker %d malloc recv batch", w->id);
+
+    for (i = 0; i < vlen; ++i)
+    {
+        iovs[i].iov_base = bufs + (size_t)i * DGRAM_BUF_SIZE;
+        iovs[i].iov_len = DGRAM_BUF_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctrls + i * ctrl_size;
+        msgs[i].msg_hdr.msg_controllen = ctrl_size;
+    }
+
+    for (;;)
+    {
+        int n = recvmmsg(w->listen_sock, msgs, vlen, MSG_WAITFORONE, NULL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror_exit("worker %d recvmmsg %s", w->id, strerror(errno));
+        }
+
+        unsigned long long pkts = 0, bytes = 0;
+        for (i = 0; (int)i < n; ++i)
+        {
+            pkts += udp_segments(&msgs[i].msg_hdr, msgs[i].msg_len);
+            bytes += msgs[i].msg_len;
+            msgs[i].msg_hdr.msg_controllen = ctrl_size;
+        }
+        mt_add(m_pkts, pkts);
+        mt_add(m_rx_bytes, bytes);
+    }
+
+    free(msgs);
+    free(iovs);
+    free(bufs);
+    free(ctrls);
+    return NULL;
+}
+
+static void create_dgram_server()
+{
+    int i = 0;
+    int ret = 0;
+    int nworker = args_s.workers;
+    unsigned long long last_pkts = 0, last_bytes = 0;
+    struct worker *workers = calloc(nworker, sizeof(struct worker));
+    if (workers == NULL)
+        lerror_exit("calloc workers");
+
+    for (i = 0; i < nworker; ++i)
+    {
+        workers[i].id = i;
+        workers[i].listen_sock = dgram_bind_socket();
+    }
+
+    linfo("start %d dgram workers on %s:%d, %u per recvmmsg, gro %s", nworker,
+          args_s.ip, args_s.port, args_s.vlen, args_s.gro ? "on" : "off");
+    for (i = 0; i < nworker; ++i)
+    {
+        ret = pthread_create(&workers[i].tid, NULL, dgram_worker, &workers[i]);
+        if (ret != 0)
+            lerror_exit("pthread_create worker %d %s", i, strerror(ret));
+    }
+
+    for (;;)
+    {
+        sleep(1);
+
+        unsigned long long pkts = mt_count(m_pkts);
+        unsigned long long bytes = mt_count(m_rx_bytes);
+        if (pkts != last_pkts)
+            linfo("recv: %llu pps, %.1f MB/s, total %llu pkts",
+                  pkts - last_pkts, (bytes - last_bytes) / (double)(1 << 20), pkts);
+        last_pkts = pkts;
+        last_bytes = bytes;
+    }
 }
 
 static void create_server()
@@ -245,6 +2328,7 @@ static void create_socket()
 int main(int argc, char *argv[])
 {
     parse_args(argc, argv);
+    metrics_init();
 
     create_socket();
     return 0;
@@ -1,14 +1,30 @@
+#define _GNU_SOURCE // splice, pipe2
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
 
 #include <unistd.h> // getopt
 #include <string.h> // strncpy
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 
-#include "clog.h"
+#include "../clog.h"
+#include "frame.h"
+#include "gro.h"
+#include "../metrics.h"
 
 #define IP_SIZE 32
 #define BUFF_SIZE 128
@@ -21,6 +37,23 @@
 
 #define DELAY 0
 
+#define SEND_COPY     0
+#define SEND_FILE     1
+#define SEND_ZEROCOPY 2
+#define SEND_SPLICE   3
+
+#define SEND_CHUNK (1 << 20)
+
+#define UDP_BATCH_MAX 1024
+#define FRAME_BUF_SIZE (64 << 10)
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
 struct args
 {
     unsigned short mode; // server--1 or client--0
@@ -28,6 +61,34 @@ struct args
     unsigned short sock; // stream--1 or graph--0
     unsigned int   delay;
     char *ip;
+    unsigned short send_mode; // how the server sends its payload, SEND_*
+    unsigned short sink;      // client drains everything and reports throughput
+    char *file;               // payload file
+    off_t blob_size;          // in-memory payload size
+    char *upstream;           // relay every client to upstream with splice
+    unsigned short upstream_port;
+    unsigned short load;      // client runs as load generator
+    unsigned int conns;       // load: active connections
+    unsigned int idle;        // load: extra connections that never send
+    unsigned int threads;     // load: generator threads
+    unsigned int rate;        // load: requests per second, 0 for closed loop
+    unsigned int depth;       // load: requests in flight per connection
+    unsigned int msg_min;     // load: request size range
+    unsigned int msg_max;
+    unsigned int duration;    // load: seconds
+    unsigned int greeting;    // load: bytes the server sends first
+    unsigned int vlen;        // dgram: datagrams per sendmmsg/recvmmsg
+    unsigned short gso;       // dgram: client sends with UDP_SEGMENT
+    unsigned short gro;       // dgram: server receives with UDP_GRO
+    int frame;                // FRAME_*, how a stream is cut into messages
+    char *metrics;            // export metrics to this file or unix:/path
+};
+
+struct payload
+{
+    int fd;
+    off_t size;
+    char *data;
 };
 
 const static char *default_ip = "127.0.0.1";
@@ -38,13 +99,65 @@ static struct args args_s = {
     .sock = SOCK_STREAM_L,
     .delay = DELAY,
     .ip   = NULL,
+    .send_mode = SEND_COPY,
+    .sink = 0,
+    .file = NULL,
+    .blob_size = 0,
+    .upstream = NULL,
+    .upstream_port = 0,
+    .load = 0,
+    .conns = 100,
+    .idle = 0,
+    .threads = 1,
+    .rate = 0,
+    .depth = 1,
+    .msg_min = BUFF_SIZE,
+    .msg_max = BUFF_SIZE,
+    .duration = 10,
+    .greeting = BUFF_SIZE,
+    .vlen = 64,
+    .gso = 0,
+    .gro = 0,
+    .frame = FRAME_NONE,
+    .metrics = NULL,
 };
 
+static struct payload payload_s = {
+    .fd = -1,
+    .size = 0,
+    .data = NULL,
+};
+
+
+static off_t parse_size(const char *str)
+{
+    char *end = NULL;
+    off_t size = strtoll(str, &end, 10);
+    switch (*end)
+    {
+    case 'k': case 'K': size <<= 10; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'g': case 'G': size <<= 30; break;
+    case '\0': case ':': break;
+    default:
+        lerror_exit("bad size %s", str);
+    }
+    return size;
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void parse_args(int argc, char *argv[])
 {
     int opt;
     char *ip = NULL;
-    while ((opt = getopt(argc, argv, "cstup:a:d:")) != -1)
+    char *colon = NULL;
+    while ((opt = getopt(argc, argv, "cstup:a:d:f:z:x:SU:Ln:i:T:r:P:l:D:g:v:GRF:M:")) != -1)
     {
         switch (opt){
         case 'c':
@@ -72,6 +185,90 @@ static void parse_args(int argc, char *argv[])
         case 'd':
             args_s.delay = atoi(optarg);
             break;
+        case 'f':
+            args_s.file = optarg;
+            break;
+        case 'z':
+            args_s.blob_size = parse_size(optarg);
+            break;
+        case 'x':
+            if (strcmp(optarg, "send") == 0)
+                args_s.send_mode = SEND_COPY;
+            else if (strcmp(optarg, "sendfile") == 0)
+                args_s.send_mode = SEND_FILE;
+            else if (strcmp(optarg, "zerocopy") == 0)
+                args_s.send_mode = SEND_ZEROCOPY;
+            else if (strcmp(optarg, "splice") == 0)
+                args_s.send_mode = SEND_SPLICE;
+            else
+                lerror_exit("unknown send mode %s", optarg);
+            break;
+        case 'S':
+            args_s.sink = 1;
+            break;
+        case 'U':
+            colon = strrchr(optarg, ':');
+            if (colon == NULL)
+                lerror_exit("upstream should be ip:port, got %s", optarg);
+            *colon = '\0';
+            args_s.upstream = optarg;
+            args_s.upstream_port = atoi(colon + 1);
+            break;
+        case 'L':
+            args_s.mode = MODE_CLIENT;
+            args_s.load = 1;
+            break;
+        case 'n':
+            args_s.conns = atoi(optarg);
+            break;
+        case 'i':
+            args_s.idle = atoi(optarg);
+            break;
+        case 'T':
+            args_s.threads = atoi(optarg);
+            if (args_s.threads < 1)
+                lerror_exit("threads should be positive");
+            break;
+        case 'r':
+            args_s.rate = atoi(optarg);
+            break;
+        case 'P':
+            args_s.depth = atoi(optarg);
+            if (args_s.depth < 1)
+                lerror_exit("pipeline depth should be positive");
+            break;
+        case 'l':
+            args_s.msg_min = parse_size(optarg);
+            colon = strchr(optarg, ':');
+            args_s.msg_max = colon ? parse_size(colon + 1) : args_s.msg_min;
+            if (args_s.msg_min < 1 || args_s.msg_max < args_s.msg_min)
+                lerror_exit("bad message size %s", optarg);
+            break;
+        case 'D':
+            args_s.duration = atoi(optarg);
+            break;
+        case 'g':
+            args_s.greeting = atoi(optarg);
+            break;
+        case 'v':
+            args_s.vlen = atoi(optarg);
+            if (args_s.vlen < 1 || args_s.vlen > UDP_BATCH_MAX)
+                lerror_exit("vlen should be in [1, %d]", UDP_BATCH_MAX);
+            break;
+        case 'G':
+            args_s.gso = 1;
+            break;
+        case 'R':
+            args_s.gro = 1;
+            break;
+        case 'F':
+            args_s.frame = frame_mode(optarg);
+            if (args_s.frame == -1)
+                lerror_exit("unknown frame mode %s", optarg);
+            break;
+        case 'M':
+            args_s.metrics = optarg;
+            break;
         default:
             lerror_exit("unknown opt %c, %d", opt, opt);
         }
@@ -100,6 +297,443 @@ static int dgram_socket()
     return sock;
 }
 
+/*
+ * payload: what the server sends after the greeting, either a file given
+ * by -f or a blob of -z bytes. the file is also mmaped so every method can
+ * serve it.
+ */
+static void payload_init()
+{
+    if (args_s.file == NULL && args_s.blob_size == 0)
+    {
+        if (args_s.send_mode != SEND_COPY)
+            lerror_exit("-x needs a payload, give -f or -z");
+        return;
+    }
+
+    if (args_s.file != NULL)
+    {
+        struct stat st;
+        payload_s.fd = open(args_s.file, O_RDONLY);
+        if (payload_s.fd == -1)
+            lerror_exit("open %s %s", args_s.file, strerror(errno));
+        if (fstat(payload_s.fd, &st) == -1)
+            lerror_exit("fstat %s %s", args_s.file, strerror(errno));
+        payload_s.size = st.st_size;
+        if (payload_s.size > 0)
+        {
+            payload_s.data = mmap(NULL, payload_s.size, PROT_READ, MAP_SHARED, payload_s.fd, 0);
+            if (payload_s.data == MAP_FAILED)
+                lerror_exit("mmap %s %s", args_s.file, strerror(errno));
+        }
+    }
+    else
+    {
+        if (args_s.send_mode == SEND_FILE || args_s.send_mode == SEND_SPLICE)
+            lerror_exit("sendfile and splice need a file, give -f");
+        payload_s.size = args_s.blob_size;
+        payload_s.data = mmap(NULL, payload_s.size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (payload_s.data == MAP_FAILED)
+            lerror_exit("mmap blob of %lld %s", (long long)payload_s.size, strerror(errno));
+        memset(payload_s.data, 'z', payload_s.size);
+    }
+}
+
+static void payload_clean()
+{
+    if (payload_s.data != NULL && payload_s.data != MAP_FAILED)
+        munmap(payload_s.data, payload_s.size);
+    if (payload_s.fd != -1)
+        close(payload_s.fd);
+}
+
+static off_t send_copy(int sock)
+{
+    off_t off = 0;
+    while (off < payload_s.size)
+    {
+        size_t len = payload_s.size - off > SEND_CHUNK ? SEND_CHUNK : payload_s.size - off;
+        ssize_t ret = send(sock, payload_s.data + off, len, MSG_NOSIGNAL);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror("send %s", strerror(errno));
+            break;
+        }
+        off += ret;
+    }
+    return off;
+}
+
+static off_t send_file(int sock)
+{
+    off_t off = 0;
+    while (off < payload_s.size)
+    {
+        ssize_t ret = sendfile(sock, payload_s.fd, &off, payload_s.size - off);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror("sendfile %s", strerror(errno));
+            break;
+        }
+        if (ret == 0)
+            break;
+    }
+    return off;
+}
+
+// read zerocopy completions off the error queue, returns how many sends finished
+static int zerocopy_reap(int sock, unsigned int *copied)
+{
+    int done = 0;
+    for (;;)
+    {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return done;
+            lerror("recvmsg MSG_ERRQUEUE %s", strerror(errno));
+            return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // [ee_info, ee_data] is the range of finished send calls
+            unsigned int n = serr->ee_data - serr->ee_info + 1;
+            done += n;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                *copied += n;
+        }
+    }
+}
+
+// wait for POLLERR, which is how the error queue says it has completions
+static int zerocopy_wait(int sock, unsigned int *copied)
+{
+    struct pollfd pfd = { .fd = sock, .events = 0 };
+    if (poll(&pfd, 1, 1000) == -1 && errno != EINTR)
+        return -1;
+    return zerocopy_reap(sock, copied);
+}
+
+/*
+ * MSG_ZEROCOPY pins the pages instead of copying them, so the payload must
+ * stay untouched until the kernel says it is done with every send.
+ * over loopback the kernel always falls back to copying, which shows up in
+ * the copied count.
+ */
+static off_t send_zerocopy(int sock)
+{
+    int one = 1;
+    off_t off = 0;
+    unsigned int calls = 0, done = 0, copied = 0;
+    int ret;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+    {
+        lerror("setsockopt SO_ZEROCOPY %s, fall back to send", strerror(errno));
+        return send_copy(sock);
+    }
+
+    while (off < payload_s.size)
+    {
+        size_t len = payload_s.size - off > SEND_CHUNK ? SEND_CHUNK : payload_s.size - off;
+        ssize_t n = send(sock, payload_s.data + off, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            // out of optmem for pinned pages, wait for some to come back
+            if (errno == ENOBUFS)
+            {
+                ret = zerocopy_wait(sock, &copied);
+                if (ret == -1)
+                    break;
+                done += ret;
+                continue;
+            }
+            lerror("send MSG_ZEROCOPY %s", strerror(errno));
+            break;
+        }
+        off += n;
+        calls++;
+
+        ret = zerocopy_reap(sock, &copied);
+        if (ret > 0)
+            done += ret;
+    }
+
+    while (done < calls)
+    {
+        ret = zerocopy_wait(sock, &copied);
+        if (ret == -1)
+            break;
+        done += ret;
+    }
+
+    linfo("zerocopy: %u sends, %u completed, %u copied by the kernel", calls, done, copied);
+    return off;
+}
+
+static off_t send_splice(int sock)
+{
+    int pipefd[2];
+    int failed = 0;
+    off_t off = 0, sent = 0; // read from the file, written to the socket
+
+    if (pipe(pipefd) == -1)
+        lerror_exit("pipe %s", strerror(errno));
+    fcntl(pipefd[1], F_SETPIPE_SZ, SEND_CHUNK);
+
+    while (!failed && off < payload_s.size)
+    {
+        ssize_t in = splice(payload_s.fd, &off, pipefd[1], NULL,
+                            payload_s.size - off, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror("splice from file %s", strerror(errno));
+            break;
+        }
+        if (in == 0)
+            break;
+
+        while (in > 0)
+        {
+            // no MORE on the tail, or it sits corked in the socket
+            ssize_t out = splice(pipefd[0], NULL, sock, NULL, in,
+                                 SPLICE_F_MOVE | (off < payload_s.size ? SPLICE_F_MORE : 0));
+            if (out == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                lerror("splice to socket %s", strerror(errno));
+                failed = 1;
+                break;
+            }
+            in -= out;
+            sent += out;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return sent;
+}
+
+static void send_payload(int sock)
+{
+    static const char *names[] = { "send", "sendfile", "zerocopy", "splice" };
+    off_t sent = 0;
+
+    if (payload_s.size == 0)
+        return;
+
+    double start = now_sec();
+    switch (args_s.send_mode)
+    {
+    case SEND_FILE:
+        sent = send_file(sock);
+        break;
+    case SEND_ZEROCOPY:
+        sent = send_zerocopy(sock);
+        break;
+    case SEND_SPLICE:
+        sent = send_splice(sock);
+        break;
+    default:
+        sent = send_copy(sock);
+    }
+    double cost = now_sec() - start;
+
+    linfo("%s: sent %lld of %lld bytes in %.3f s, %.1f MB/s", names[args_s.send_mode],
+          (long long)sent, (long long)payload_s.size, cost, cost > 0 ? sent / cost / (1 << 20) : 0);
+}
+
+/*
+ * relay: every accepted client is spliced to the upstream given by -U and
+ * back, through one pipe per direction, so the bytes never enter user space.
+ */
+struct relay_dir
+{
+    int from;
+    int to;
+    int pipefd[2];
+    size_t pending; // bytes sitting in the pipe
+    unsigned long long bytes; // bytes passed on
+    int eof;
+};
+
+static int relay_pump(struct relay_dir *d)
+{
+    ssize_t n;
+    if (!d->eof && d->pending < SEND_CHUNK)
+    {
+        n = splice(d->from, NULL, d->pipefd[1], NULL, SEND_CHUNK - d->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            d->eof = 1;
+        else if (n > 0)
+            d->pending += n;
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    if (d->pending > 0)
+    {
+        n = splice(d->pipefd[0], NULL, d->to, NULL, d->pending,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            d->pending -= n;
+            d->bytes += n;
+        }
+        else if (n == -1 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    // pass the half close on once everything is through
+    if (d->eof == 1 && d->pending == 0)
+    {
+        shutdown(d->to, SHUT_WR);
+        d->eof = 2;
+    }
+    return 0;
+}
+
+static void relay_splice(int client)
+{
+    int upstream = stream_socket();
+    struct sockaddr_in addr;
+    struct relay_dir dirs[2];
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(args_s.upstream);
+    addr.sin_port = htons(args_s.upstream_port);
+    if (connect(upstream, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        lerror("connect upstream %s:%d %s", args_s.upstream, args_s.upstream_port, strerror(errno));
+        close(upstream);
+        return;
+    }
+
+    memset(dirs, 0, sizeof(dirs));
+    dirs[0].from = client;
+    dirs[0].to = upstream;
+    dirs[1].from = upstream;
+    dirs[1].to = client;
+    for (i = 0; i < 2; ++i)
+    {
+        if (pipe2(dirs[i].pipefd, O_NONBLOCK) == -1)
+            lerror_exit("pipe2 %s", strerror(errno));
+        fcntl(dirs[i].pipefd[1], F_SETPIPE_SZ, SEND_CHUNK);
+    }
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    fcntl(upstream, F_SETFL, fcntl(upstream, F_GETFL) | O_NONBLOCK);
+
+    linfo("relay %d <-> upstream %s:%d", client, args_s.upstream, args_s.upstream_port);
+    double start = now_sec();
+    while (!(dirs[0].eof && dirs[0].pending == 0 && dirs[1].eof && dirs[1].pending == 0))
+    {
+        struct pollfd pfd[2];
+        pfd[0].fd = client;
+        pfd[1].fd = upstream;
+        pfd[0].events = pfd[1].events = 0;
+        for (i = 0; i < 2; ++i)
+        {
+            int from = i, to = 1 - i;
+            if (!dirs[i].eof && dirs[i].pending < SEND_CHUNK)
+                pfd[from].events |= POLLIN;
+            if (dirs[i].pending > 0)
+                pfd[to].events |= POLLOUT;
+        }
+
+        if (poll(pfd, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror("poll %s", strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < 2; ++i)
+        {
+            if (relay_pump(&dirs[i]) == -1)
+            {
+                lerror("relay %s", strerror(errno));
+                goto out;
+            }
+        }
+    }
+
+out:
+    linfo("relay done in %.3f s, %llu bytes up, %llu bytes down", now_sec() - start, dirs[0].bytes, dirs[1].bytes);
+    for (i = 0; i < 2; ++i)
+    {
+        close(dirs[i].pipefd[0]);
+        close(dirs[i].pipefd[1]);
+    }
+    close(upstream);
+}
+
+// hold the connection for up to delay seconds, but stop as soon as the server closes it
+static void stream_client_linger(int sock, unsigned int delay)
+{
+    struct itimerspec its = { .it_value = { .tv_sec = delay } };
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd == -1 || timerfd_settime(tfd, 0, &its, NULL) == -1)
+        lerror_exit("timerfd %s", strerror(errno));
+
+    struct pollfd pfd[2] = {
+        { .fd = tfd, .events = POLLIN },
+        { .fd = sock, .events = POLLIN },
+    };
+    char buff[BUFF_SIZE];
+    while (1)
+    {
+        if (poll(pfd, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            lerror_exit("poll %s", strerror(errno));
+        }
+        if (pfd[0].revents & POLLIN)
+            break;
+        if (pfd[1].revents)
+        {
+            ssize_t n = recv(sock, buff, BUFF_SIZE, 0);
+            if (n == 0 || (n == -1 && errno != EINTR))
+            {
+                linfo("server closed %d during the delay", sock);
+                break;
+            }
+        }
+    }
+    close(tfd);
+}
+
 static void create_stream_client()
 {
     int sock = stream_socket();
@@ -120,21 +754,746 @@ static void create_stream_client()
     memset(buff, 0, BUFF_SIZE);
     strncpy(buff, "from create_stream_client", BUFF_SIZE);
     linfo("send: %s", buff);
-    send(sock, buff, BUFF_SIZE, 0);
+    if (args_s.frame == FRAME_NONE)
+    {
+        send(sock, buff, BUFF_SIZE, 0);
+    }
+    else
+    {
+        char hdr[FRAME_HDR_SIZE];
+        unsigned int len = strlen(buff);
+        unsigned int pre = frame_prefix(args_s.frame, len, hdr);
+        buff[len] = FRAME_DELIM;
+        struct iovec iov[2] = {
+            { .iov_base = hdr, .iov_len = pre },
+            { .iov_base = buff, .iov_len = len + frame_suffix(args_s.frame) },
+        };
+        writev(sock, iov, 2);
+    }
 
-    if (args_s.delay > 0)
+    if (args_s.sink)
     {
-        sleep(args_s.delay);
+        char *sink = malloc(SEND_CHUNK);
+        if (sink == NULL)
+            lerror_exit("malloc");
+
+        unsigned long long total = 0;
+        double start = now_sec();
+        while ((ret = recv(sock, sink, SEND_CHUNK, 0)) > 0)
+            total += ret;
+        double cost = now_sec() - start;
+        linfo("sink: recv %llu bytes in %.3f s, %.1f MB/s", total, cost,
+              cost > 0 ? total / cost / (1 << 20) : 0);
+        free(sink);
     }
 
+    if (args_s.delay > 0)
+        stream_client_linger(sock, args_s.delay);
+
     linfo("begin to close %d", sock);
     close(sock);
 }
 
+/*
+ * load generator
+ *
+ * -L turns the client into a load generator for the echo servers: -T
+ * threads each drive their share of -n connections from one epoll loop.
+ * every request is -l bytes (or uniform in min:max) and is done once the
+ * same number of bytes came back. -P requests can be in flight per
+ * connection. with -r the threads send on a fixed schedule (open loop)
+ * and latency counts from when a request was due, not when it got sent,
+ * so a stalled server cannot hide behind a stalled generator. without -r
+ * every answer triggers the next request (closed loop). with -F every
+ * request is framed, and requests queued on a connection go out together
+ * in one writev. every thread opens its connections in parallel, then all
+ * of them start the clock together, and only answers that come back
+ * within -D count towards the rates.
+ */
+#define LG_MAX_MSG    (1 << 20)
+#define LG_MAX_EVENT  256
+#define LG_DRAIN_NS   1000000000ULL // wait for late answers after -D
+#define LG_CONNECT_NS 10000000000ULL // give up on connects still going
+#define LG_IOV_MAX    64
+
+struct lg_req
+{
+    unsigned long long due; // ns
+    unsigned int size;      // payload bytes
+    unsigned int wire;      // bytes with the frame around it
+    unsigned int sent;      // bytes written
+    unsigned int left;      // bytes still to come back
+    unsigned char pre_len;
+    char pre[FRAME_HDR_SIZE];
+};
+
+struct lg_conn
+{
+    int fd;
+    unsigned int skip;      // greeting bytes still to drop
+    unsigned int head;      // oldest in-flight request in reqs
+    unsigned int inflight;
+    struct lg_req *reqs;    // ring of args_s.depth
+    unsigned int unsent;    // in-flight requests not fully written yet
+    unsigned char want_write;
+};
+
+struct lg_thread
+{
+    pthread_t tid;
+    int id;
+    int epfd;
+    int nconn;
+    int nidle;
+    struct lg_conn *conns;
+    int *idle;
+    unsigned int next;      // round robin cursor for open loop
+    unsigned long long rng;
+    double rate;            // requests per second, 0 for closed loop
+    unsigned long long end; // ns, when -D is over
+    unsigned long long reqs;  // answered within -D
+    unsigned long long bytes;
+    unsigned long long late;  // answered after -D
+    unsigned long long errors;
+};
+
+static char lg_buf[LG_MAX_MSG];
+static pthread_barrier_t lg_barrier;
+static unsigned long long lg_start; // ns, shared by every thread
+
+static struct metric *m_lg_reqs;
+static struct metric *m_lg_errors;
+static struct metric *m_lg_latency;
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int lg_msg_size(struct lg_thread *t)
+{
+    if (args_s.msg_max <= args_s.msg_min)
+        return args_s.msg_min;
+
+    // xorshift64
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return args_s.msg_min + t->rng % (args_s.msg_max - args_s.msg_min + 1);
+}
+
+// start a nonblocking connect, lg_connect_all waits for it
+static int lg_connect()
+{
+    struct sockaddr_in addr;
+    int sock = stream_socket();
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(args_s.ip);
+    addr.sin_port = htons(args_s.port);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+    {
+        lerror_rl(10, 10, "connect %s:%d %s", args_s.ip, args_s.port, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// connection i of the thread, the idle ones come after the active ones
+static int *lg_fd(struct lg_thread *t, int i)
+{
+    return i < t->nconn ? &t->conns[i].fd : &t->idle[i - t->nconn];
+}
+
+static void lg_connect_failed(struct lg_thread *t, int *fd, int err)
+{
+    lerror_rl(10, 10, "connect %s:%d %s", args_s.ip, args_s.port, strerror(err));
+    close(*fd);
+    *fd = -1;
+    t->errors++;
+    mt_add(m_lg_errors, 1);
+}
+
+// open every connection at once and wait until each is up or failed
+static void lg_connect_all(struct lg_thread *t)
+{
+    struct epoll_event ev, events[LG_MAX_EVENT];
+    unsigned long long deadline = now_ns() + LG_CONNECT_NS;
+    int i, n, err, total = t->nconn + t->nidle, pending = 0;
+    socklen_t len;
+    char *up = calloc(total ? total : 1, 1);
+
+    if (up == NULL)
+        lerror_exit("calloc");
+    for (i = 0; i < total; ++i)
+    {
+        int *fd = lg_fd(t, i);
+        *fd = lg_connect();
+        if (*fd == -1)
+        {
+            t->errors++;
+            mt_add(m_lg_errors, 1);
+            continue;
+        }
+        ev.events = EPOLLOUT;
+        ev.data.u64 = i;
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, *fd, &ev) == -1)
+            lerror_exit("epoll_ctl %s", strerror(errno));
+        pending++;
+    }
+
+    while (pending > 0)
+    {
+        unsigned long long now = now_ns();
+        if (now >= deadline)
+            break;
+        n = epoll_wait(t->epfd, events, LG_MAX_EVENT, (deadline - now) / 1000000 + 1);
+        if (n == -1 && errno != EINTR)
+            lerror_exit("epoll_wait %s", strerror(errno));
+
+        for (i = 0; i < n; ++i)
+        {
+            int *fd = lg_fd(t, events[i].data.u64);
+            epoll_ctl(t->epfd, EPOLL_CTL_DEL, *fd, NULL);
+            pending--;
+            len = sizeof(err);
+            if (getsockopt(*fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+                err = errno;
+            if (err != 0)
+                lg_connect_failed(t, fd, err);
+            else
+                up[events[i].data.u64] = 1;
+        }
+    }
+
+    for (i = 0; i < total; ++i)
+    {
+        int *fd = lg_fd(t, i);
+        if (*fd != -1 && !up[i])
+        {
+            epoll_ctl(t->epfd, EPOLL_CTL_DEL, *fd, NULL);
+            lg_connect_failed(t, fd, ETIMEDOUT);
+        }
+    }
+    free(up);
+}
+
+static void lg_close(struct lg_thread *t, struct lg_conn *c)
+{
+    if (c->fd == -1)
+        return;
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    t->errors += c->inflight;
+    c->inflight = 0;
+    c->unsent = 0;
+}
+
+static void lg_want_write(struct lg_thread *t, struct lg_conn *c, int on)
+{
+    struct epoll_event ev;
+    if (c->want_write == on)
+        return;
+
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->want_write = on;
+}
+
+// iovecs for what is left of one request: frame prefix, payload, suffix.
+// *whole says whether they cover all of it
+static int lg_req_iov(struct lg_req *r, struct iovec *iov, int *whole)
+{
+    static const char suffix[1] = { FRAME_DELIM };
+    unsigned int off = r->sent;
+    unsigned int body_end = r->pre_len + r->size;
+    int n = 0;
+
+    *whole = 1;
+    if (off < r->pre_len)
+    {
+        iov[n].iov_base = r->pre + off;
+        iov[n++].iov_len = r->pre_len - off;
+        off = r->pre_len;
+    }
+    if (off < body_end)
+    {
+        unsigned int len = body_end - off;
+        iov[n].iov_base = lg_buf;
+        iov[n++].iov_len = len > LG_MAX_MSG ? LG_MAX_MSG : len;
+        // the rest of a huge payload goes in the next writev
+        if (len > LG_MAX_MSG)
+        {
+            *whole = 0;
+            return n;
+        }
+        off = body_end;
+    }
+    if (off < r->wire)
+    {
+        iov[n].iov_base = (void *)suffix;
+        iov[n++].iov_len = r->wire - off;
+    }
+    return n;
+}
+
+// write every queued request, as many per writev as fit
+static void lg_flush(struct lg_thread *t, struct lg_conn *c)
+{
+    struct iovec iov[LG_IOV_MAX];
+
+    while (c->unsent > 0)
+    {
+        unsigned int first = c->inflight - c->unsent;
+        unsigned int i;
+        int n = 0, whole = 1;
+
+        for (i = first; i < c->inflight && whole && n + 3 <= LG_IOV_MAX; ++i)
+            n += lg_req_iov(&c->reqs[(c->head + i) % args_s.depth], iov + n, &whole);
+
+        ssize_t sent = writev(c->fd, iov, n);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                lg_want_write(t, c, 1);
+                return;
+            }
+            t->errors++;
+            mt_add(m_lg_errors, 1);
+            lg_close(t, c);
+            return;
+        }
+
+        for (i = first; i < c->inflight && sent > 0; ++i)
+        {
+            struct lg_req *r = &c->reqs[(c->head + i) % args_s.depth];
+            unsigned int take = r->wire - r->sent;
+            if ((size_t)sent < take)
+                take = sent;
+            r->sent += take;
+            sent -= take;
+            if (r->sent == r->wire)
+                c->unsent--;
+        }
+    }
+    lg_want_write(t, c, 0);
+}
+
+static void lg_send(struct lg_thread *t, struct lg_conn *c, unsigned long long due)
+{
+    struct lg_req *r = &c->reqs[(c->head + c->inflight) % args_s.depth];
+    r->due = due;
+    r->size = lg_msg_size(t);
+    r->pre_len = frame_prefix(args_s.frame, r->size, r->pre);
+    r->wire = r->pre_len + r->size + frame_suffix(args_s.frame);
+    r->sent = 0;
+    r->left = r->wire;
+    c->inflight++;
+    c->unsent++;
+}
+
+static void lg_on_read(struct lg_thread *t, struct lg_conn *c, int sending)
+{
+    static __thread char buf[LG_MAX_MSG];
+    ssize_t n;
+
+    while ((n = recv(c->fd, buf, sizeof(buf), 0)) > 0)
+    {
+        unsigned long long now = now_ns();
+        if (c->skip > 0)
+        {
+            unsigned int drop = n < c->skip ? n : c->skip;
+            c->skip -= drop;
+            n -= drop;
+        }
+        if (now < t->end)
+            t->bytes += n;
+
+        while (n > 0 && c->inflight > 0)
+        {
+            struct lg_req *r = &c->reqs[c->head];
+            unsigned int take = n < r->left ? n : r->left;
+            r->left -= take;
+            n -= take;
+            if (r->left > 0)
+                break;
+
+            mt_observe(m_lg_latency, now - r->due);
+            mt_add(m_lg_reqs, 1);
+            if (now < t->end)
+                t->reqs++;
+            else
+                t->late++;
+            c->head = (c->head + 1) % args_s.depth;
+            c->inflight--;
+            if (sending && t->rate == 0)
+                lg_send(t, c, now);
+        }
+    }
+
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        t->errors++;
+        mt_add(m_lg_errors, 1);
+        lg_close(t, c);
+        return;
+    }
+    lg_flush(t, c);
+}
+
+// give due requests to connections with room, round robin
+static unsigned long long lg_schedule(struct lg_thread *t, unsigned long long next, unsigned long long now)
+{
+    unsigned long long interval = 1000000000ULL / t->rate;
+    int tried = 0;
+
+    while (next <= now && tried < t->nconn)
+    {
+        struct lg_conn *c = &t->conns[t->next];
+        t->next = (t->next + 1) % t->nconn;
+        if (c->fd == -1 || c->inflight == args_s.depth)
+        {
+            tried++;
+            continue;
+        }
+        lg_send(t, c, next);
+        lg_flush(t, c);
+        next += interval ? interval : 1;
+        tried = 0;
+    }
+    return next;
+}
+
+static void *lg_worker(void *arg)
+{
+    struct lg_thread *t = arg;
+    struct epoll_event ev, events[LG_MAX_EVENT];
+    int i, n;
+
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epfd == -1)
+        lerror_exit("epoll_create1 %s", strerror(errno));
+
+    lg_connect_all(t);
+    for (i = 0; i < t->nconn; ++i)
+    {
+        struct lg_conn *c = &t->conns[i];
+        c->skip = args_s.greeting;
+        c->reqs = calloc(args_s.depth, sizeof(struct lg_req));
+        if (c->reqs == NULL)
+            lerror_exit("calloc");
+        if (c->fd == -1)
+            continue;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+            lerror_exit("epoll_ctl %s", strerror(errno));
+    }
+
+    // once every thread is connected create_load_client starts the clock
+    pthread_barrier_wait(&lg_barrier);
+    pthread_barrier_wait(&lg_barrier);
+    unsigned long long start = lg_start;
+    unsigned long long end = start + args_s.duration * 1000000000ULL;
+    unsigned long long next = start;
+    t->end = end;
+
+    if (t->rate == 0)
+    {
+        for (i = 0; i < t->nconn; ++i)
+        {
+            struct lg_conn *c = &t->conns[i];
+            if (c->fd == -1)
+                continue;
+            while (c->inflight < args_s.depth)
+                lg_send(t, c, start);
+            lg_flush(t, c);
+        }
+    }
+
+    for (;;)
+    {
+        unsigned long long now = now_ns();
+        int sending = now < end;
+        int timeout = 100;
+
+        if (!sending)
+        {
+            unsigned int pending = 0;
+            for (i = 0; i < t->nconn; ++i)
+                pending += t->conns[i].inflight;
+            if (pending == 0 || now >= end + LG_DRAIN_NS)
+                break;
+        }
+        else if (t->rate > 0)
+        {
+            next = lg_schedule(t, next, now);
+            timeout = next > now ? (next - now) / 1000000 : 0;
+        }
+
+        n = epoll_wait(t->epfd, events, LG_MAX_EVENT, timeout);
+        if (n == -1 && errno != EINTR)
+            lerror_exit("epoll_wait %s", strerror(errno));
+
+        for (i = 0; i < n; ++i)
+        {
+            struct lg_conn *c = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT)
+                lg_flush(t, c);
+            if (c->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                lg_on_read(t, c, now_ns() < end);
+        }
+    }
+
+    for (i = 0; i < t->nconn; ++i)
+    {
+        if (t->conns[i].fd != -1)
+            close(t->conns[i].fd);
+        free(t->conns[i].reqs);
+    }
+    for (i = 0; i < t->nidle; ++i)
+    {
+        if (t->idle[i] != -1)
+            close(t->idle[i]);
+    }
+    close(t->epfd);
+    return NULL;
+}
+
+static void create_load_client()
+{
+    unsigned int nthread = args_s.threads;
+    unsigned int i;
+    int ret;
+    struct lg_thread *threads = calloc(nthread, sizeof(struct lg_thread));
+    struct mt_hist *total = malloc(sizeof(struct mt_hist));
+    if (threads == NULL || total == NULL)
+        lerror_exit("calloc");
+    ret = pthread_barrier_init(&lg_barrier, NULL, nthread + 1);
+    if (ret != 0)
+        lerror_exit("pthread_barrier_init %s", strerror(ret));
+
+    memset(lg_buf, 'x', sizeof(lg_buf));
+    m_lg_reqs = mt_counter("socket_load_requests_total", "Requests answered.");
+    m_lg_errors = mt_counter("socket_load_errors_total", "Connection errors.");
+    m_lg_latency = mt_histogram("socket_load_latency_seconds", "Request latency, from when it was due.", 1e-9);
+    if (args_s.metrics != NULL && mt_start(args_s.metrics, 1000) == -1)
+        lerror_exit("metrics %s %s", args_s.metrics, strerror(errno));
+    linfo("load %s:%d: %u threads, %d conns (+%d idle), depth %u, msg %u:%u bytes, %s, %u s",
+          args_s.ip, args_s.port, nthread, args_s.conns, args_s.idle, args_s.depth,
+          args_s.msg_min, args_s.msg_max, args_s.rate ? "open loop" : "closed loop", args_s.duration);
+
+    for (i = 0; i < nthread; ++i)
+    {
+        struct lg_thread *t = &threads[i];
+        t->id = i;
+        t->nconn = args_s.conns / nthread + (i < args_s.conns % nthread);
+        t->nidle = args_s.idle / nthread + (i < args_s.idle % nthread);
+        t->conns = calloc(t->nconn ? t->nconn : 1, sizeof(struct lg_conn));
+        t->idle = calloc(t->nidle ? t->nidle : 1, sizeof(int));
+        if (t->conns == NULL || t->idle == NULL)
+            lerror_exit("calloc");
+        t->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        t->rate = (double)args_s.rate / nthread;
+        ret = pthread_create(&t->tid, NULL, lg_worker, t);
+        if (ret != 0)
+            lerror_exit("pthread_create %s", strerror(ret));
+    }
+
+    double connect_start = now_sec();
+    pthread_barrier_wait(&lg_barrier);
+    linfo("connected in %.3f s", now_sec() - connect_start);
+    lg_start = now_ns();
+    pthread_barrier_wait(&lg_barrier);
+
+    unsigned long long reqs = 0, bytes = 0, late = 0, errors = 0;
+    for (i = 0; i < nthread; ++i)
+    {
+        pthread_join(threads[i].tid, NULL);
+        reqs += threads[i].reqs;
+        bytes += threads[i].bytes;
+        late += threads[i].late;
+        errors += threads[i].errors;
+        free(threads[i].conns);
+        free(threads[i].idle);
+    }
+    pthread_barrier_destroy(&lg_barrier);
+
+    // the rates cover the -D window only, late answers are just counted
+    mt_snapshot(m_lg_latency, total);
+    double secs = args_s.duration > 0 ? args_s.duration : 1;
+    linfo("requests: %llu (+%llu late), errors: %llu, %.0f req/s, %.1f MB/s",
+          reqs, late, errors, reqs / secs, bytes / secs / (1 << 20));
+    if (total->total > 0)
+    {
+        linfo("latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f",
+              total->min / 1e3,
+              mt_hist_percentile(total, 50) / 1e3,
+              mt_hist_percentile(total, 90) / 1e3,
+              mt_hist_percentile(total, 99) / 1e3,
+              mt_hist_percentile(total, 99.9) / 1e3,
+              total->max / 1e3);
+    }
+
+    free(total);
+    free(threads);
+}
+
+/*
+ * datagram mode
+ *
+ * both sides move -v datagrams per syscall with sendmmsg/recvmmsg over
+ * iovecs set up once. -G lets the client hand the kernel up to 64
+ * datagrams glued together and have UDP_SEGMENT cut them (GSO), -R lets
+ * the server take coalesced runs from UDP_GRO and counts the segments in
+ * them. both print packets per second once a second.
+ */
+#define UDP_GSO_MAX   64     // segments per GSO send
+#define UDP_BUF_MAX   65536
+
+struct udp_batch
+{
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *bufs;
+    char *ctrls;
+    unsigned int vlen;
+    unsigned int buf_size;
+};
+
+struct udp_rate
+{
+    unsigned long long pkts;
+    unsigned long long bytes;
+    unsigned long long last_pkts;
+    unsigned long long last_bytes;
+    double last;
+};
+
+static void udp_batch_init(struct udp_batch *b, unsigned int vlen, unsigned int buf_size)
+{
+    unsigned int i;
+    size_t ctrl_size = CMSG_SPACE(sizeof(int));
+
+    b->vlen = vlen;
+    b->buf_size = buf_size;
+    b->msgs = calloc(vlen, sizeof(struct mmsghdr));
+    b->iovs = calloc(vlen, sizeof(struct iovec));
+    b->bufs = malloc((size_t)vlen * buf_size);
+    b->ctrls = calloc(vlen, ctrl_size);
+    if (b->msgs == NULL || b->iovs == NULL || b->bufs == NULL || b->ctrls == NULL)
+        lerror_exit("malloc udp batch of %u x %u", vlen, buf_size);
+
+    memset(b->bufs, 'u', (size_t)vlen * buf_size);
+    for (i = 0; i < vlen; ++i)
+    {
+        b->iovs[i].iov_base = b->bufs + (size_t)i * buf_size;
+        b->iovs[i].iov_len = buf_size;
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_control = b->ctrls + i * ctrl_size;
+        b->msgs[i].msg_hdr.msg_controllen = ctrl_size;
+    }
+}
+
+static void udp_batch_free(struct udp_batch *b)
+{
+    free(b->msgs);
+    free(b->iovs);
+    free(b->bufs);
+    free(b->ctrls);
+}
+
+static void udp_rate_tick(struct udp_rate *r, const char *what, int force)
+{
+    double now = now_sec();
+    double cost = now - r->last;
+    if (cost < 1.0 && !force)
+        return;
+
+    if (r->pkts != r->last_pkts)
+    {
+        linfo("%s: %.0f pps, %.1f MB/s, total %llu pkts", what,
+              (r->pkts - r->last_pkts) / cost,
+              (r->bytes - r->last_bytes) / cost / (1 << 20), r->pkts);
+    }
+    r->last = now;
+    r->last_pkts = r->pkts;
+    r->last_bytes = r->bytes;
+}
+
 static void create_dgram_client()
 {
-    linfo("not implemented");
-    return;
+    int sock = dgram_socket();
+    struct sockaddr_in server;
+    struct udp_batch b;
+    struct udp_rate rate;
+    unsigned int size = args_s.msg_min;
+    unsigned int segs = 1;
+    unsigned int i;
+
+    memset(&server, 0, sizeof(struct sockaddr_in));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(args_s.ip);
+    server.sin_port = htons(args_s.port);
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) == -1)
+        lerror_exit("connect %s", strerror(errno));
+
+    if (args_s.gso)
+    {
+        int gso_size = size;
+        segs = (UDP_BUF_MAX - 1024) / size;
+        if (segs > UDP_GSO_MAX)
+            segs = UDP_GSO_MAX;
+        if (segs < 2 || setsockopt(sock, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) == -1)
+        {
+            lerror("UDP_SEGMENT not usable, send plain datagrams");
+            segs = 1;
+        }
+    }
+
+    udp_batch_init(&b, args_s.vlen, size * segs);
+    for (i = 0; i < b.vlen; ++i)
+    {
+        b.msgs[i].msg_hdr.msg_control = NULL;
+        b.msgs[i].msg_hdr.msg_controllen = 0;
+    }
+
+    linfo("send %u byte datagrams to %s:%d, %u per sendmmsg, %u per gso buffer, %u s",
+          size, args_s.ip, args_s.port, b.vlen, segs, args_s.duration);
+
+    memset(&rate, 0, sizeof(rate));
+    double start = rate.last = now_sec();
+    double end = start + args_s.duration;
+    while (now_sec() < end)
+    {
+        int n = sendmmsg(sock, b.msgs, b.vlen, 0);
+        if (n == -1)
+        {
+            // nothing listens yet, or the socket buffer is full
+            if (errno == ECONNREFUSED || errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+                continue;
+            lerror_exit("sendmmsg %s", strerror(errno));
+        }
+        rate.pkts += (unsigned long long)n * segs;
+        rate.bytes += (unsigned long long)n * segs * size;
+        udp_rate_tick(&rate, "send", 0);
+    }
+
+    double cost = now_sec() - start;
+    linfo("sent %llu pkts in %.3f s, %.0f pps", rate.pkts, cost, rate.pkts / cost);
+    udp_batch_free(&b);
+    close(sock);
 }
 
 static void create_client()
@@ -142,7 +1501,11 @@ static void create_client()
     assert(args_s.mode == MODE_CLIENT);
 
     int sock = args_s.sock;
-    if (sock == SOCK_STREAM_L)
+    if (sock == SOCK_STREAM_L && args_s.load)
+    {
+        create_load_client();
+    }
+    else if (sock == SOCK_STREAM_L)
     {
         create_stream_client();
     }
@@ -170,18 +1533,57 @@ static void create_stream_server()
 
     linfo("client: %s %d", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
 
+    if (args_s.upstream != NULL)
+    {
+        relay_splice(sock_accept);
+        close(sock_accept);
+        close(sock);
+        return;
+    }
+
     char buff[BUFF_SIZE] = {0};
     strncpy(buff, "from server", BUFF_SIZE);
     send(sock_accept, buff, BUFF_SIZE, 0);
     memset(buff, 0, BUFF_SIZE);
     int ret = 0;
 
-    while ((ret = recv(sock_accept, buff, BUFF_SIZE, 0)) != 0)
+    if (payload_s.size > 0)
+    {
+        send_payload(sock_accept);
+        // let a sink client see the end of the payload
+        shutdown(sock_accept, SHUT_WR);
+    }
+
+    // frames can be split over reads or share one, keep the tail for the next recv
+    char *rbuf = malloc(FRAME_BUF_SIZE);
+    size_t rlen = 0;
+    if (rbuf == NULL)
+        lerror_exit("malloc");
+
+    while ((ret = recv(sock_accept, rbuf + rlen, FRAME_BUF_SIZE - rlen, 0)) > 0)
     {
-        linfo("recv: %s", buff);
-        memset(buff, 0, BUFF_SIZE);
+        struct frame f;
+        size_t off = 0;
+        int n;
+
+        rlen += ret;
+        while ((n = frame_next(args_s.frame, rbuf + off, rlen - off, FRAME_BUF_SIZE, &f)) > 0)
+        {
+            linfo_rl(100, 100, "recv: %.*s", (int)f.payload_len, f.payload);
+            off += n;
+        }
+        if (n == -1)
+        {
+            lerror("frame over %d bytes, close the client", FRAME_BUF_SIZE);
+            break;
+        }
+        memmove(rbuf, rbuf + off, rlen - off);
+        rlen -= off;
     }
+    if (ret == -1)
+        lerror("recv %s", strerror(errno));
     linfo("client close");
+    free(rbuf);
 
     close(sock_accept);
     close(sock);
@@ -189,14 +1591,59 @@ static void create_stream_server()
 
 static void create_dgram_server()
 {
-    linfo("not implemented");
-    return;
+    int sock = dgram_socket();
+    int one = 1;
+    struct sockaddr_in server;
+    struct udp_batch b;
+    struct udp_rate rate;
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    unsigned int i;
+
+    memset(&server, 0, sizeof(struct sockaddr_in));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(args_s.ip);
+    server.sin_port = htons(args_s.port);
+    if (bind(sock, (struct sockaddr*)&server, sizeof(server)) == -1)
+        lerror_exit("bind %s", strerror(errno));
+
+    if (args_s.gro && setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) == -1)
+        lerror("UDP_GRO %s", strerror(errno));
+    // wake up once a second so the rate report goes on while idle
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    udp_batch_init(&b, args_s.vlen, UDP_BUF_MAX);
+    linfo("recv on %s:%d, %u per recvmmsg, gro %s", args_s.ip, args_s.port,
+          b.vlen, args_s.gro ? "on" : "off");
+
+    memset(&rate, 0, sizeof(rate));
+    rate.last = now_sec();
+    size_t ctrl_size = CMSG_SPACE(sizeof(int));
+    for (;;)
+    {
+        int n = recvmmsg(sock, b.msgs, b.vlen, MSG_WAITFORONE, NULL);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            lerror_exit("recvmmsg %s", strerror(errno));
+
+        for (i = 0; (int)i < n; ++i)
+        {
+            struct msghdr *hdr = &b.msgs[i].msg_hdr;
+            rate.pkts += udp_segments(hdr, b.msgs[i].msg_len);
+            rate.bytes += b.msgs[i].msg_len;
+            hdr->msg_controllen = ctrl_size;
+        }
+        udp_rate_tick(&rate, "recv", 0);
+    }
+
+    udp_batch_free(&b);
+    close(sock);
 }
 
 static void create_server()
 {
     assert(args_s.mode == MODE_SERVER);
 
+    payload_init();
+
     int sock = args_s.sock;
     if (sock == SOCK_STREAM_L)
     {
@@ -229,6 +1676,7 @@ static void clean_up()
     {
         free(args_s.ip);
     }
+    payload_clean();
 }
 
 int main(int argc, char *argv[])
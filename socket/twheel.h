@@ -0,0 +1,145 @@
+/*
+ * hierarchical timing wheel
+ *
+ * TW_LEVELS wheels of TW_SLOTS slots, level n counts in units of
+ * TW_SLOTS^n ticks. a timer sits in the slot its expiry falls into on the
+ * lowest level that reaches that far; when level 0 wraps, the next slot of
+ * level 1 is cascaded down, and so on. add, del and firing are O(1) per
+ * timer, the wheel never scans its timers.
+ *
+ * nodes are embedded in their owner and the lists are intrusive, so there
+ * is no allocation. to push a deadline out cheaply (on every read, say)
+ * leave the node where it is and recheck the real deadline when it fires.
+ */
+#include <stddef.h>
+
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#define TW_BITS   8
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_MASK   (TW_SLOTS - 1)
+#define TW_LEVELS 4
+
+struct tw_node
+{
+    struct tw_node *prev;
+    struct tw_node *next;
+    unsigned long long expire; // tick
+};
+
+struct twheel
+{
+    unsigned long long now;    // tick
+    unsigned long count;
+    struct tw_node slots[TW_LEVELS][TW_SLOTS]; // list heads
+};
+
+typedef void (*tw_fire_fn)(struct tw_node *node, void *arg);
+
+static inline void tw_init(struct twheel *tw, unsigned long long now)
+{
+    int l, s;
+    tw->now = now;
+    tw->count = 0;
+    for (l = 0; l < TW_LEVELS; ++l)
+        for (s = 0; s < TW_SLOTS; ++s)
+            tw->slots[l][s].prev = tw->slots[l][s].next = &tw->slots[l][s];
+}
+
+static inline int tw_pending(const struct tw_node *node)
+{
+    return node->next != NULL;
+}
+
+static inline void tw_del(struct twheel *tw, struct tw_node *node)
+{
+    if (!tw_pending(node))
+        return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    tw->count--;
+}
+
+static inline void tw_add(struct twheel *tw, struct tw_node *node, unsigned long long expire)
+{
+    unsigned long long delta;
+    struct tw_node *head;
+    int level = 0;
+
+    tw_del(tw, node);
+    if (expire <= tw->now)
+        expire = tw->now + 1;
+    node->expire = expire;
+
+    delta = expire - tw->now;
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_BITS * (level + 1))))
+        level++;
+    // past the top level: park in its furthest slot, it gets re-added on cascade
+    if (delta >= (1ULL << (TW_BITS * TW_LEVELS)))
+        expire = tw->now + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+
+    head = &tw->slots[level][(expire >> (TW_BITS * level)) & TW_MASK];
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+    tw->count++;
+}
+
+// move every timer of slot on level down to where it belongs now
+static inline void tw_cascade(struct twheel *tw, int level, int slot)
+{
+    struct tw_node *head = &tw->slots[level][slot];
+    struct tw_node list = *head;
+
+    if (head->next == head)
+        return;
+    // detach the whole slot first, tw_add may put nodes back into it
+    list.next->prev = &list;
+    list.prev->next = &list;
+    head->prev = head->next = head;
+
+    while (list.next != &list)
+    {
+        struct tw_node *node = list.next;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = NULL;
+        tw->count--;
+        tw_add(tw, node, node->expire);
+    }
+}
+
+// run the clock up to now, calling fire for every timer that expired
+static inline void tw_advance(struct twheel *tw, unsigned long long now, tw_fire_fn fire, void *arg)
+{
+    while (tw->now < now)
+    {
+        if (tw->count == 0)
+        {
+            tw->now = now;
+            return;
+        }
+
+        tw->now++;
+        int slot = tw->now & TW_MASK;
+        int level;
+        for (level = 1; slot == 0 && level < TW_LEVELS; ++level)
+        {
+            slot = (tw->now >> (TW_BITS * level)) & TW_MASK;
+            tw_cascade(tw, level, slot);
+        }
+
+        struct tw_node *head = &tw->slots[0][tw->now & TW_MASK];
+        while (head->next != head)
+        {
+            struct tw_node *node = head->next;
+            tw_del(tw, node);
+            fire(node, arg);
+        }
+    }
+}
+
+#endif
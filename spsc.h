@@ -0,0 +1,94 @@
+/*
+ single-producer single-consumer ring indexes with a futex wakeup
+
+ the owner keeps the slots, an array of a power of two or any size, and
+ uses head % size and tail % size into it. the producer fills the slot
+ at head and publishes it with spsc_push, the consumer takes the slot at
+ tail and gives it back with spsc_pop. neither side ever blocks the
+ other: a full ring is the producer's to handle (drop, count, retry).
+
+ a consumer with nothing to do sleeps on a futex, and spsc_push only
+ makes the wake syscall when it is actually asleep, so a busy ring costs
+ no syscalls. the sleep is bounded by SPSC_NAP_NS as a safety net.
+ */
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SPSC_NAP_NS 100000000L
+
+struct spsc
+{
+    unsigned int head __attribute__((aligned(64))); // next slot to fill
+    unsigned int tail __attribute__((aligned(64))); // next slot to take
+    int sleeping;
+    int done;
+};
+
+static inline void spsc_futex(int *addr, int op, int val, const struct timespec *ts)
+{
+    syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, val, ts, NULL, 0);
+}
+
+static inline void spsc_wake(struct spsc *q)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+        spsc_futex(&q->sleeping, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+// producer: slots free to fill from head on
+static inline unsigned int spsc_room(struct spsc *q, unsigned int size)
+{
+    return size - (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE));
+}
+
+// producer: publish the slot at head
+static inline void spsc_push(struct spsc *q)
+{
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    spsc_wake(q);
+}
+
+// producer: no more pushes, the consumer drains what is left and stops
+static inline void spsc_close(struct spsc *q)
+{
+    __atomic_store_n(&q->done, 1, __ATOMIC_RELEASE);
+    spsc_wake(q);
+}
+
+// consumer: wait for the slot at tail, returns 0 once closed and drained
+static inline int spsc_wait(struct spsc *q)
+{
+    struct timespec ts = { 0, SPSC_NAP_NS };
+
+    while (1)
+    {
+        if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != q->tail)
+            return 1;
+        if (__atomic_load_n(&q->done, __ATOMIC_ACQUIRE))
+            return 0;
+
+        __atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail &&
+            !__atomic_load_n(&q->done, __ATOMIC_ACQUIRE))
+            spsc_futex(&q->sleeping, FUTEX_WAIT, 1, &ts);
+        __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// consumer: give the slot at tail back
+static inline void spsc_pop(struct spsc *q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif